@@ -19,7 +19,11 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := audio.primary.grouper
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_SRC_FILES := \
-	audio_hw.c
+	audio_hw.c \
+	audio_kernels.c \
+	buffer_pool.c \
+	polyphase_resampler.c \
+	ring_buffer.c
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
 	$(call include-path-for, audio-utils) \
@@ -29,3 +33,53 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+
+# Kernel microbenchmark: scalar fallbacks on the host, NEON on the device
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_kernels_bench
+LOCAL_SRC_FILES := \
+	audio_kernels.c \
+	bench/audio_kernels_bench.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_LDLIBS := -lrt
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_kernels_bench
+LOCAL_SRC_FILES := \
+	audio_kernels.c \
+	bench/audio_kernels_bench.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+
+# Host benchmark of the HAL against fake PCMs, see bench/audio_hw_bench.c
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench
+LOCAL_SRC_FILES := \
+	audio_kernels.c \
+	buffer_pool.c \
+	polyphase_resampler.c \
+	ring_buffer.c \
+	bench/audio_hw_bench.c \
+	bench/fake_audio_utils.c \
+	bench/fake_tinyalsa.c
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH) \
+	external/tinyalsa/include \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-route)
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lm -lpthread -lrt
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -19,9 +19,14 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <cutils/log.h>
 #include <cutils/properties.h>
@@ -31,12 +36,18 @@
 #include <hardware/hardware.h>
 
 #include <system/audio.h>
+#include <system/thread_defs.h>
 
 #include <tinyalsa/asoundlib.h>
 
 #include <audio_utils/resampler.h>
 #include <audio_route/audio_route.h>
 
+#include "audio_kernels.h"
+#include "buffer_pool.h"
+#include "polyphase_resampler.h"
+#include "ring_buffer.h"
+
 #define PCM_CARD 0
 #define PCM_DEVICE 0
 #define PCM_DEVICE_SCO 2
@@ -53,6 +64,16 @@
 #define IN_PERIOD_COUNT 2
 #define IN_SAMPLING_RATE 44100
 
+/* Time a stream keeps its PCM open after standby, ro.audio.standby_grace_ms */
+#define STANDBY_GRACE_MS_DEFAULT 1000
+
+/* Periods buffered between the capture thread and in_read() */
+#define IN_RING_PERIOD_COUNT 4
+#define CAPTURE_THREAD_PRIORITY 2
+
+/* Resamplers kept by the device for reuse by the streams */
+#define RESAMPLER_CACHE_SIZE 4
+
 #define SCO_PERIOD_SIZE 256
 #define SCO_PERIOD_COUNT 4
 #define SCO_SAMPLING_RATE 8000
@@ -100,38 +121,135 @@ struct pcm_config pcm_config_sco = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+/*
+ * Statistics for the dumps. Each is updated with the lock of the object it
+ * belongs to held, except where noted.
+ */
+
+/* Call durations, in power of two buckets from DURATION_HIST_MIN_US */
+#define DURATION_HIST_BUCKETS 10
+#define DURATION_HIST_MIN_US 500
+
+struct duration_hist {
+    uint32_t counts[DURATION_HIST_BUCKETS];
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* Updated by lock_timed() with the lock it describes */
+struct lock_stats {
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+};
+
+struct standby_stats {
+    uint32_t exits;         /* PCM reopened */
+    uint32_t resumes;       /* PCM restarted within the grace period */
+    uint64_t exit_ns;       /* time spent reopening */
+    uint64_t max_exit_ns;
+};
+
+/*
+ * Resamplers are created when a stream is opened and kept by the device, so
+ * leaving standby only has to reset one. Each is created with the entry's
+ * provider, which forwards to the provider of the stream using it.
+ */
+struct cached_resampler {
+    struct resampler_buffer_provider provider; /* must be first */
+    struct resampler_buffer_provider *target;
+    struct resampler_itfe *resampler;
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t channels;
+    bool polyphase; /* from create_polyphase_resampler() */
+    bool in_use;
+    unsigned int last_used;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
+    struct lock_stats lock_stats;
+    unsigned int route_updates;
     unsigned int out_device;
     unsigned int in_device;
     bool standby;
     bool mic_mute;
     struct audio_route *ar;
+    unsigned int routes; /* 1 << ROUTE_* for the paths applied to the mixer */
     int orientation;
     bool screen_off;
+    bool capture_thread; /* ro.audio.capture_thread */
+    /*
+     * ro.audio.pinned_rate: when set the main PCMs always run at this rate,
+     * which is in the SCO rate group, and the streams are converted in
+     * software. 0 when the PCMs follow the streams.
+     */
+    uint32_t pinned_rate;
 
     struct stream_out *active_out;
     struct stream_in *active_in;
+
+    /* Stream buffers and resamplers, so that leaving standby allocates nothing */
+    struct buffer_pool pool;
+    struct cached_resampler resamplers[RESAMPLER_CACHE_SIZE];
+    unsigned int resampler_clock;
+
+    /* Closes the PCMs of streams whose standby grace period has expired */
+    int64_t standby_grace_ns;
+    pthread_t standby_thread;
+    pthread_cond_t standby_cond;
+    bool standby_thread_running;
+    bool standby_thread_exit;
+    /*
+     * Standby requested for active_out or active_in: its PCM is stopped but
+     * kept open until the deadline. Written with both the device and the
+     * stream mutexes held, so the standby thread checks them without
+     * taking a stream mutex and either mutex is enough to read them.
+     */
+    bool out_standby_pending;
+    int64_t out_standby_deadline;
+    bool in_standby_pending;
+    int64_t in_standby_deadline;
 };
 
 struct stream_out {
     struct audio_stream_out stream;
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
+    struct lock_stats lock_stats;
     struct pcm *pcm;
     struct pcm_config *pcm_config;
     bool standby;
     uint64_t written; /* total frames written, not cleared when entering standby */
+    uint64_t start_written; /* value of written when the PCM was last opened */
 
     struct resampler_itfe *resampler;
     int16_t *buffer;
     size_t buffer_frames;
+    /* left channel of the stream audio when the PCM is mono */
+    int16_t *mono_buffer;
+    size_t mono_buffer_frames;
 
+    /*
+     * The kernel buffer always holds OUT_LONG_PERIOD_COUNT periods; out_write()
+     * keeps at most cur_write_threshold frames queued in it. With the screen
+     * off the threshold grows to the whole buffer (OUT_BUFFER_TYPE_LONG) so
+     * the writer can sleep for several periods between batches.
+     */
+    int buffer_type;
     int write_threshold;
     int cur_write_threshold;
 
+    struct duration_hist write_hist;
+    struct standby_stats standby_stats;
+    uint32_t underruns;
+    uint32_t write_errors;
+    uint64_t resampler_cpu_ns;
+
     struct audio_device *dev;
 };
 
@@ -139,6 +257,7 @@ struct stream_in {
     struct audio_stream_in stream;
 
     pthread_mutex_t lock; /* see note below on mutex acquisition order */
+    struct lock_stats lock_stats;
     struct pcm *pcm;
     struct pcm_config *pcm_config;          /* current configuration */
     struct pcm_config *pcm_config_non_sco;  /* configuration to return after SCO is done */
@@ -152,6 +271,27 @@ struct stream_in {
     size_t frames_in;
     int read_status;
 
+    /*
+     * Optional capture thread: it reads the PCM, drops the right channel and
+     * fills ring, so in_read() only copies out and a descheduled reader
+     * loses frames (counted in frames_lost) instead of stalling the driver.
+     */
+    bool capture_running;
+    pthread_t capture_thread;
+    atomic_bool capture_exit;
+    atomic_int capture_status;
+    sem_t capture_sem;
+    int16_t *capture_buffer;
+    struct ring_buffer ring;
+    atomic_uint frames_lost; /* at the PCM rate */
+
+    struct duration_hist read_hist;
+    struct standby_stats standby_stats;
+    uint64_t frames_read;
+    uint32_t read_errors;
+    atomic_uint overruns; /* ring overflows, counted by the capture thread */
+    uint64_t resampler_cpu_ns; /* includes the reads done for the resampler */
+
     struct audio_device *dev;
 };
 
@@ -162,6 +302,30 @@ enum {
     ORIENTATION_UNDEFINED,
 };
 
+/*
+ * Paths from mixer_paths.xml, in the order they are applied: the later ones
+ * override shared controls, e.g. the headphone sets DAC IF1 back to normal.
+ */
+enum {
+    ROUTE_SPEAKER,
+    ROUTE_HEADPHONE,
+    ROUTE_DOCK,
+    ROUTE_MAIN_MIC_TOP,
+    ROUTE_MAIN_MIC_LEFT,
+    ROUTE_COUNT,
+};
+
+static const char * const route_paths[ROUTE_COUNT] = {
+    [ROUTE_SPEAKER] = "speaker",
+    [ROUTE_HEADPHONE] = "headphone",
+    [ROUTE_DOCK] = "dock",
+    [ROUTE_MAIN_MIC_TOP] = "main-mic-top",
+    [ROUTE_MAIN_MIC_LEFT] = "main-mic-left",
+};
+
+/* No routes applied yet */
+#define ROUTES_UNKNOWN (~0u)
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream);
 static size_t out_get_buffer_size(const struct audio_stream *stream);
 static audio_format_t out_get_format(const struct audio_stream *stream);
@@ -181,38 +345,556 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
 
 /* Helper functions */
 
-static void select_devices(struct audio_device *adev)
+static int64_t monotonic_ns(void)
 {
-    int headphone_on;
-    int speaker_on;
-    int docked;
-    int main_mic_on;
+    struct timespec ts;
 
-    headphone_on = adev->out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
-                                    AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
-    speaker_on = adev->out_device & AUDIO_DEVICE_OUT_SPEAKER;
-    docked = adev->out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET;
-    main_mic_on = adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    audio_route_reset(adev->ar);
+static int64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Takes mutex, recording in stats whether and how long it had to wait */
+static void lock_timed(pthread_mutex_t *mutex, struct lock_stats *stats)
+{
+    int64_t start;
+    int64_t wait;
+
+    if (pthread_mutex_trylock(mutex) == 0) {
+        stats->acquired++;
+        return;
+    }
+
+    start = monotonic_ns();
+    pthread_mutex_lock(mutex);
+    wait = monotonic_ns() - start;
+
+    stats->acquired++;
+    stats->contended++;
+    stats->wait_ns += wait;
+    if ((uint64_t)wait > stats->max_wait_ns)
+        stats->max_wait_ns = wait;
+}
+
+static void lock_adev(struct audio_device *adev)
+{
+    lock_timed(&adev->lock, &adev->lock_stats);
+}
+
+static void lock_out(struct stream_out *out)
+{
+    lock_timed(&out->lock, &out->lock_stats);
+}
+
+static void lock_in(struct stream_in *in)
+{
+    lock_timed(&in->lock, &in->lock_stats);
+}
+
+/* must be called with hw device or output stream mutex locked */
+static bool out_standby_pending(const struct stream_out *out)
+{
+    return out->dev->active_out == out && out->dev->out_standby_pending;
+}
+
+/* must be called with hw device or input stream mutex locked */
+static bool in_standby_pending(const struct stream_in *in)
+{
+    return in->dev->active_in == in && in->dev->in_standby_pending;
+}
+
+static void duration_hist_add(struct duration_hist *hist, int64_t ns)
+{
+    int64_t limit = DURATION_HIST_MIN_US * 1000;
+    int i;
+
+    for (i = 0; i < DURATION_HIST_BUCKETS - 1 && ns >= limit; i++)
+        limit *= 2;
+
+    hist->counts[i]++;
+    hist->total_ns += ns;
+    if ((uint64_t)ns > hist->max_ns)
+        hist->max_ns = ns;
+}
+
+static void standby_stats_add_exit(struct standby_stats *stats, int64_t ns)
+{
+    stats->exits++;
+    stats->exit_ns += ns;
+    if ((uint64_t)ns > stats->max_exit_ns)
+        stats->max_exit_ns = ns;
+}
+
+static void dump_duration_hist(int fd, const char *name,
+                               const struct duration_hist *hist)
+{
+    uint32_t calls = 0;
+    int limit = DURATION_HIST_MIN_US;
+    int i;
+
+    for (i = 0; i < DURATION_HIST_BUCKETS; i++)
+        calls += hist->counts[i];
+
+    dprintf(fd, "      %s: %u calls", name, calls);
+    if (calls)
+        dprintf(fd, ", avg %llu us, max %llu us",
+                (unsigned long long)(hist->total_ns / calls / 1000),
+                (unsigned long long)(hist->max_ns / 1000));
+    dprintf(fd, "\n       ");
+
+    for (i = 0; i < DURATION_HIST_BUCKETS - 1; i++) {
+        dprintf(fd, " <%d.%dms:%u", limit / 1000, limit % 1000 / 100,
+                hist->counts[i]);
+        limit *= 2;
+    }
+    dprintf(fd, " more:%u\n", hist->counts[i]);
+}
+
+static void dump_lock_stats(int fd, int indent, const char *name,
+                            const struct lock_stats *stats)
+{
+    dprintf(fd, "%*s%s: %llu acquired, %llu contended, %llu us waited "
+            "(max %llu us)\n", indent, "", name,
+            (unsigned long long)stats->acquired,
+            (unsigned long long)stats->contended,
+            (unsigned long long)(stats->wait_ns / 1000),
+            (unsigned long long)(stats->max_wait_ns / 1000));
+}
+
+static void dump_standby_stats(int fd, const struct standby_stats *stats)
+{
+    dprintf(fd, "      Standby exits: %u", stats->exits);
+    if (stats->exits)
+        dprintf(fd, ", avg %llu us, max %llu us",
+                (unsigned long long)(stats->exit_ns / stats->exits / 1000),
+                (unsigned long long)(stats->max_exit_ns / 1000));
+    dprintf(fd, ", resumed within the grace period: %u\n", stats->resumes);
+}
+
+static void dump_pcm_config(int fd, const struct pcm_config *config)
+{
+    dprintf(fd, "      PCM: %u Hz, %u ch, %u x %u frames\n", config->rate,
+            config->channels, config->period_count, config->period_size);
+}
+
+static int cached_get_next_buffer(struct resampler_buffer_provider *provider,
+                                  struct resampler_buffer *buffer)
+{
+    struct cached_resampler *cr = (struct cached_resampler *)provider;
+
+    if (!cr->target)
+        return -ENODEV;
+
+    return cr->target->get_next_buffer(cr->target, buffer);
+}
+
+static void cached_release_buffer(struct resampler_buffer_provider *provider,
+                                  struct resampler_buffer *buffer)
+{
+    struct cached_resampler *cr = (struct cached_resampler *)provider;
+
+    if (cr->target)
+        cr->target->release_buffer(cr->target, buffer);
+}
+
+static void free_cached_resampler(struct cached_resampler *cr)
+{
+    if (!cr->resampler)
+        return;
+
+    if (cr->polyphase)
+        release_polyphase_resampler(cr->resampler);
+    else
+        release_resampler(cr->resampler);
+    cr->resampler = NULL;
+}
+
+/*
+ * Makes sure a resampler for the given conversion is cached, replacing the
+ * least recently used idle one if needed. Returns NULL if all are in use.
+ * must be called with hw device mutex locked
+ */
+static struct cached_resampler *prepare_resampler(struct audio_device *adev,
+                                                  uint32_t in_rate,
+                                                  uint32_t out_rate,
+                                                  uint32_t channels)
+{
+    struct cached_resampler *victim = NULL;
+    struct cached_resampler *cr;
+    int ret;
+    int i;
+
+    for (i = 0; i < RESAMPLER_CACHE_SIZE; i++) {
+        cr = &adev->resamplers[i];
+        if (cr->in_use)
+            continue;
+        if (cr->resampler && cr->in_rate == in_rate &&
+                cr->out_rate == out_rate && cr->channels == channels)
+            return cr;
+        if (!victim || !cr->resampler ||
+                (victim->resampler && cr->last_used < victim->last_used))
+            victim = cr;
+    }
+
+    if (!victim)
+        return NULL;
+
+    free_cached_resampler(victim);
+
+    victim->provider.get_next_buffer = cached_get_next_buffer;
+    victim->provider.release_buffer = cached_release_buffer;
+    victim->polyphase = adev->pinned_rate != 0;
+    if (victim->polyphase)
+        ret = create_polyphase_resampler(in_rate, out_rate, channels,
+                                         &victim->provider,
+                                         &victim->resampler);
+    else
+        ret = create_resampler(in_rate, out_rate, channels,
+                               RESAMPLER_QUALITY_DEFAULT, &victim->provider,
+                               &victim->resampler);
+    if (ret != 0) {
+        victim->resampler = NULL;
+        return NULL;
+    }
+
+    victim->in_rate = in_rate;
+    victim->out_rate = out_rate;
+    victim->channels = channels;
+    victim->last_used = adev->resampler_clock++;
+
+    return victim;
+}
 
-    if (speaker_on)
-        audio_route_apply_path(adev->ar, "speaker");
-    if (headphone_on)
-        audio_route_apply_path(adev->ar, "headphone");
-    if (docked)
-        audio_route_apply_path(adev->ar, "dock");
-    if (main_mic_on) {
+/* must be called with hw device mutex locked */
+static struct resampler_itfe *get_resampler(struct audio_device *adev,
+                                            uint32_t in_rate,
+                                            uint32_t out_rate,
+                                            uint32_t channels,
+                                            struct resampler_buffer_provider *provider)
+{
+    struct cached_resampler *cr;
+
+    cr = prepare_resampler(adev, in_rate, out_rate, channels);
+    if (!cr)
+        return NULL;
+
+    cr->in_use = true;
+    cr->target = provider;
+    cr->last_used = adev->resampler_clock++;
+    cr->resampler->reset(cr->resampler);
+
+    return cr->resampler;
+}
+
+/* must be called with hw device mutex locked */
+static void put_resampler(struct audio_device *adev,
+                          struct resampler_itfe *resampler)
+{
+    int i;
+
+    for (i = 0; i < RESAMPLER_CACHE_SIZE; i++) {
+        if (adev->resamplers[i].resampler == resampler) {
+            adev->resamplers[i].in_use = false;
+            adev->resamplers[i].target = NULL;
+            return;
+        }
+    }
+}
+
+static void release_resamplers(struct audio_device *adev)
+{
+    int i;
+
+    for (i = 0; i < RESAMPLER_CACHE_SIZE; i++)
+        free_cached_resampler(&adev->resamplers[i]);
+}
+
+/* must be called with hw device mutex locked */
+static unsigned int get_routes(struct audio_device *adev)
+{
+    unsigned int routes = 0;
+
+    if (adev->out_device & AUDIO_DEVICE_OUT_SPEAKER)
+        routes |= 1 << ROUTE_SPEAKER;
+    if (adev->out_device & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
+                            AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
+        routes |= 1 << ROUTE_HEADPHONE;
+    if (adev->out_device & AUDIO_DEVICE_OUT_ANLG_DOCK_HEADSET)
+        routes |= 1 << ROUTE_DOCK;
+
+    /* The orientation only matters to the main mic */
+    if (adev->in_device & AUDIO_DEVICE_IN_BUILTIN_MIC) {
         if (adev->orientation == ORIENTATION_LANDSCAPE)
-            audio_route_apply_path(adev->ar, "main-mic-left");
+            routes |= 1 << ROUTE_MAIN_MIC_LEFT;
         else
-            audio_route_apply_path(adev->ar, "main-mic-top");
+            routes |= 1 << ROUTE_MAIN_MIC_TOP;
     }
 
+    return routes;
+}
+
+/* must be called with hw device mutex locked */
+static void select_devices(struct audio_device *adev)
+{
+    unsigned int routes = get_routes(adev);
+    int i;
+
+    /*
+     * The devices and orientation only select among the paths in
+     * route_paths, so the routing is fully described by that set. If it
+     * did not change there is nothing to write.
+     */
+    if (routes == adev->routes)
+        return;
+
+    /*
+     * Rebuilding the whole state keeps the path overrides right, and
+     * audio_route_update_mixer() only writes the controls whose values
+     * changed.
+     */
+    audio_route_reset(adev->ar);
+    for (i = 0; i < ROUTE_COUNT; i++) {
+        if (routes & (1 << i))
+            audio_route_apply_path(adev->ar, route_paths[i]);
+    }
     audio_route_update_mixer(adev->ar);
+    adev->routes = routes;
+    adev->route_updates++;
+
+    ALOGV("hp=%c speaker=%c dock=%c main-mic=%c",
+          routes & (1 << ROUTE_HEADPHONE) ? 'y' : 'n',
+          routes & (1 << ROUTE_SPEAKER) ? 'y' : 'n',
+          routes & (1 << ROUTE_DOCK) ? 'y' : 'n',
+          routes & (1 << ROUTE_MAIN_MIC_TOP) ? 't' :
+          routes & (1 << ROUTE_MAIN_MIC_LEFT) ? 'l' : 'n');
+}
+
+/* must be called with hw device mutex locked */
+static int get_out_buffer_type(struct audio_device *adev)
+{
+    /*
+     * Only use the long buffer when nothing needs low latency: capture and
+     * SCO would otherwise see the extra output delay in echo cancellation.
+     */
+    if (adev->screen_off && !adev->active_in &&
+            !(adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO))
+        return OUT_BUFFER_TYPE_LONG;
+
+    return OUT_BUFFER_TYPE_SHORT;
+}
+
+/* must be called with output stream mutex locked */
+static void set_out_buffer_type(struct stream_out *out, int buffer_type)
+{
+    unsigned int period_size = out->pcm_config->period_size;
+
+    if (buffer_type == OUT_BUFFER_TYPE_LONG)
+        out->write_threshold = period_size * out->pcm_config->period_count;
+    else
+        out->write_threshold = period_size * OUT_SHORT_PERIOD_COUNT;
+
+    /*
+     * Shrinking takes effect at once, the frames already queued simply
+     * play out. Growing is done one period per write in out_write() so
+     * the mixer is never asked for a burst of several periods at once.
+     */
+    if (out->buffer_type == OUT_BUFFER_TYPE_UNKNOWN ||
+            out->write_threshold < out->cur_write_threshold)
+        out->cur_write_threshold = out->write_threshold;
+
+    ALOGV("out buffer type %d, write threshold %d", buffer_type,
+          out->write_threshold);
+    out->buffer_type = buffer_type;
+}
+
+/*
+ * Blocks until frames more frames fit under the current write threshold.
+ * In long buffer mode a full buffer is left to drain down to the short
+ * threshold before the writer is let through again, so the following
+ * writes refill it back to back and the CPU sleeps between batches
+ * instead of waking up once per period.
+ *
+ * The stream mutex is released while sleeping, which can last most of the
+ * long buffer, so position queries and set_parameters() are not held up.
+ * Returns -EAGAIN if the stream was put in standby meanwhile.
+ *
+ * must be called with output stream mutex locked
+ */
+static int out_wait_write_threshold(struct stream_out *out, size_t frames)
+{
+    unsigned int buffer_size = pcm_get_buffer_size(out->pcm);
+    unsigned int rate = out->pcm_config->rate;
+    unsigned int avail;
+    unsigned int kernel_frames;
+    unsigned int target;
+    struct timespec ts;
+    int64_t sleep_us;
+
+    if (frames >= (size_t)out->cur_write_threshold)
+        return 0;
+
+    for (;;) {
+        /* Fails before the PCM is started, nothing is queued then */
+        if (pcm_get_htimestamp(out->pcm, &avail, &ts) < 0)
+            return 0;
+
+        kernel_frames = avail < buffer_size ? buffer_size - avail : 0;
+        if (kernel_frames + frames <= (unsigned int)out->cur_write_threshold)
+            return 0;
+
+        if (out->buffer_type == OUT_BUFFER_TYPE_LONG)
+            target = out->pcm_config->period_size * OUT_SHORT_PERIOD_COUNT;
+        else
+            target = out->cur_write_threshold - frames;
 
-    ALOGV("hp=%c speaker=%c dock=%c main-mic=%c", headphone_on ? 'y' : 'n',
-          speaker_on ? 'y' : 'n', docked ? 'y' : 'n', main_mic_on ? 'y' : 'n');
+        /* Wake up slightly early rather than late */
+        sleep_us = (int64_t)(kernel_frames - target) * 1000000 / rate - 1000;
+        if (sleep_us <= 0)
+            return 0;
+
+        pthread_mutex_unlock(&out->lock);
+        usleep(sleep_us);
+        lock_out(out);
+        if (out->standby || out_standby_pending(out))
+            return -EAGAIN;
+    }
+}
+
+/*
+ * Resamples frames already in the PCM channel layout and writes them.
+ *
+ * must be called with output stream mutex locked
+ */
+static int out_write_pcm_frames(struct stream_out *out, const int16_t *buffer,
+                                size_t frames)
+{
+    size_t in_frames;
+    size_t out_frames;
+    int64_t cpu;
+    int ret;
+
+    if (!out->resampler)
+        return pcm_write(out->pcm, buffer, pcm_frames_to_bytes(out->pcm, frames));
+
+    while (frames > 0) {
+        in_frames = frames;
+        out_frames = out->buffer_frames;
+        cpu = thread_cpu_ns();
+        /* The resampler only reads its input, the cast is for its prototype */
+        out->resampler->resample_from_input(out->resampler, (int16_t *)buffer,
+                                            &in_frames, out->buffer, &out_frames);
+        out->resampler_cpu_ns += thread_cpu_ns() - cpu;
+        /* A resampler may fill the buffer from its history alone */
+        if (in_frames == 0 && out_frames == 0)
+            break;
+
+        ret = pcm_write(out->pcm, out->buffer,
+                        pcm_frames_to_bytes(out->pcm, out_frames));
+        if (ret != 0)
+            return ret;
+
+        buffer += in_frames * out->pcm_config->channels;
+        frames -= in_frames;
+    }
+
+    return 0;
+}
+
+/*
+ * Converts frames of stream audio to the PCM configuration and writes them.
+ * The stream buffer belongs to the caller, so a mono PCM gets the left
+ * channel copied into mono_buffer a chunk at a time.
+ *
+ * must be called with output stream mutex locked
+ */
+static int out_write_frames(struct stream_out *out, const int16_t *buffer,
+                            size_t frames)
+{
+    size_t chunk;
+    int ret;
+
+    if (out->pcm_config->channels != 1)
+        return out_write_pcm_frames(out, buffer, frames);
+
+    /* Discard right channel */
+    while (frames > 0) {
+        chunk = frames;
+        if (chunk > out->mono_buffer_frames)
+            chunk = out->mono_buffer_frames;
+        audio_extract_channel_s16(out->mono_buffer, buffer, chunk, 0);
+
+        ret = out_write_pcm_frames(out, out->mono_buffer, chunk);
+        if (ret != 0)
+            return ret;
+
+        buffer += chunk * 2;
+        frames -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the number of frames, at the stream rate, written but not yet
+ * presented: those queued in the kernel buffer plus the resampler delay.
+ * timestamp is when the kernel position was sampled, in CLOCK_MONOTONIC.
+ *
+ * must be called with output stream mutex locked
+ */
+static int out_get_pending_frames(struct stream_out *out, uint64_t *frames,
+                                  struct timespec *timestamp)
+{
+    uint32_t rate = out_get_sample_rate(&out->stream.common);
+    unsigned int buffer_size;
+    unsigned int avail;
+    uint64_t pending;
+
+    if (out->standby || !out->pcm)
+        return -ENODEV;
+
+    /* Fails until the PCM has been started */
+    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) < 0)
+        return -ENODATA;
+
+    /* avail exceeds the buffer size after an underrun */
+    buffer_size = pcm_get_buffer_size(out->pcm);
+    pending = avail < buffer_size ? buffer_size - avail : 0;
+    pending = pending * rate / out->pcm_config->rate;
+
+    if (out->resampler)
+        pending += (uint64_t)out->resampler->delay_ns(out->resampler) *
+                   rate / 1000000000;
+
+    *frames = pending;
+    return 0;
+}
+
+/*
+ * Returns the number of frames presented since the stream was opened. The
+ * frames dropped by standby count as presented, as they do in written.
+ *
+ * must be called with output stream mutex locked
+ */
+static int out_get_presented_frames(struct stream_out *out, uint64_t *frames,
+                                    struct timespec *timestamp)
+{
+    uint64_t pending;
+    int ret;
+
+    ret = out_get_pending_frames(out, &pending, timestamp);
+    if (ret < 0)
+        return ret;
+
+    /* Only after a write error could more be pending than was written */
+    *frames = pending < out->written ? out->written - pending : 0;
+    return 0;
 }
 
 /* must be called with hw device and output stream mutexes locked */
@@ -225,15 +907,182 @@ static void do_out_standby(struct stream_out *out)
         out->pcm = NULL;
         adev->active_out = NULL;
         if (out->resampler) {
-            release_resampler(out->resampler);
+            put_resampler(adev, out->resampler);
             out->resampler = NULL;
         }
-        if (out->buffer) {
-            free(out->buffer);
-            out->buffer = NULL;
-        }
+        buffer_pool_put(&adev->pool, out->buffer);
+        out->buffer = NULL;
+        buffer_pool_put(&adev->pool, out->mono_buffer);
+        out->mono_buffer = NULL;
         out->standby = true;
+        adev->out_standby_pending = false;
+    }
+}
+
+static void *capture_thread_loop(void *context)
+{
+    struct stream_in *in = (struct stream_in *)context;
+    size_t frames = in->pcm_config->period_size;
+    unsigned int bytes = pcm_frames_to_bytes(in->pcm, frames);
+    uint32_t written;
+    int ret;
+
+    pthread_setname_np(pthread_self(), "hal_capture");
+
+    /* Not real time if SCHED_FIFO was refused, but still ahead of most */
+    if (sched_getscheduler(0) != SCHED_FIFO)
+        setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+
+    while (!atomic_load(&in->capture_exit)) {
+        ret = pcm_read(in->pcm, in->capture_buffer, bytes);
+        if (ret != 0) {
+            /* stop_capture_thread() stopped the PCM under the read */
+            if (atomic_load(&in->capture_exit))
+                break;
+            ALOGE("capture thread pcm_read error %d", ret);
+            atomic_store(&in->capture_status, ret);
+            sem_post(&in->capture_sem);
+            usleep(frames * 1000000 / in->pcm_config->rate);
+            continue;
+        }
+
+        /* Discard right channel */
+        if (in->pcm_config->channels == 2)
+            audio_extract_channel_s16(in->capture_buffer, in->capture_buffer,
+                                      frames, 0);
+
+        written = ring_buffer_write(&in->ring, in->capture_buffer, frames);
+        if (written < frames) {
+            atomic_fetch_add(&in->frames_lost, frames - written);
+            atomic_fetch_add(&in->overruns, 1);
+        }
+
+        sem_post(&in->capture_sem);
+    }
+
+    return NULL;
+}
+
+/*
+ * must be called with hw device and input stream mutexes locked, after the
+ * PCM is opened
+ */
+static int start_capture_thread(struct stream_in *in)
+{
+    struct buffer_pool *pool = &in->dev->pool;
+    struct sched_param param;
+    pthread_attr_t attr;
+    size_t frames = in->pcm_config->period_size;
+    uint32_t ring_size = 1;
+    int16_t *ring_data;
+    int ret;
+
+    in->capture_buffer = buffer_pool_get(pool,
+            pcm_frames_to_bytes(in->pcm, frames), NULL);
+    if (!in->capture_buffer)
+        return -ENOMEM;
+
+    /* The ring holds mono samples and needs a power of two size */
+    while (ring_size < frames * IN_RING_PERIOD_COUNT)
+        ring_size <<= 1;
+    ring_data = buffer_pool_get(pool, ring_size * sizeof(int16_t), NULL);
+    ret = -ring_buffer_init(&in->ring, ring_data, ring_size);
+    if (ret != 0)
+        goto err_ring;
+
+    sem_init(&in->capture_sem, 0, 0);
+    atomic_store(&in->capture_exit, false);
+    atomic_store(&in->capture_status, 0);
+
+    /* Fall back to an urgent audio nice level if SCHED_FIFO is refused */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    param.sched_priority = CAPTURE_THREAD_PRIORITY;
+    pthread_attr_setschedparam(&attr, &param);
+    ret = pthread_create(&in->capture_thread, &attr, capture_thread_loop, in);
+    pthread_attr_destroy(&attr);
+    if (ret == EPERM) {
+        ALOGW("SCHED_FIFO denied for the capture thread");
+        ret = pthread_create(&in->capture_thread, NULL, capture_thread_loop,
+                             in);
+    }
+    if (ret != 0) {
+        ALOGE("cannot create capture thread: %s", strerror(ret));
+        goto err_thread;
+    }
+
+    in->capture_running = true;
+    return 0;
+
+err_thread:
+    sem_destroy(&in->capture_sem);
+err_ring:
+    buffer_pool_put(pool, ring_data);
+    buffer_pool_put(pool, in->capture_buffer);
+    in->capture_buffer = NULL;
+    return -ret;
+}
+
+/*
+ * Stops the PCM, so that a pcm_read() blocked on a PCM without a clock
+ * (SCO with no Bluetooth link) returns, then waits for the thread.
+ * must be called with hw device and input stream mutexes locked, before the
+ * PCM is closed
+ */
+static void stop_capture_thread(struct stream_in *in)
+{
+    if (!in->capture_running) {
+        pcm_stop(in->pcm);
+        return;
+    }
+
+    /* The thread does not take in->lock, it exits once its read returns */
+    atomic_store(&in->capture_exit, true);
+    pcm_stop(in->pcm);
+    pthread_join(in->capture_thread, NULL);
+    in->capture_running = false;
+
+    /*
+     * A thread that checked capture_exit just before it was set restarts
+     * the PCM in pcm_read(), so stop it again now that nothing reads it.
+     */
+    pcm_stop(in->pcm);
+
+    sem_destroy(&in->capture_sem);
+    buffer_pool_put(&in->dev->pool, in->ring.data);
+    in->ring.data = NULL;
+    buffer_pool_put(&in->dev->pool, in->capture_buffer);
+    in->capture_buffer = NULL;
+}
+
+/*
+ * Waits until the capture thread has queued at least frames frames.
+ * must be called with input stream mutex locked
+ */
+static int wait_capture_frames(struct stream_in *in, size_t frames)
+{
+    int64_t timeout_ns = (int64_t)in->pcm_config->period_size *
+            IN_RING_PERIOD_COUNT * 1000000000 / in->pcm_config->rate;
+    struct timespec ts;
+    int status;
+
+    while (ring_buffer_available(&in->ring) < frames) {
+        status = atomic_exchange(&in->capture_status, 0);
+        if (status != 0)
+            return status;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += timeout_ns % 1000000000;
+        ts.tv_sec += timeout_ns / 1000000000 + ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        if (sem_timedwait(&in->capture_sem, &ts) < 0 && errno == ETIMEDOUT) {
+            ALOGE("capture thread timed out");
+            return -ETIMEDOUT;
+        }
     }
+
+    return 0;
 }
 
 /* must be called with hw device and input stream mutexes locked */
@@ -242,19 +1091,193 @@ static void do_in_standby(struct stream_in *in)
     struct audio_device *adev = in->dev;
 
     if (!in->standby) {
+        stop_capture_thread(in);
         pcm_close(in->pcm);
         in->pcm = NULL;
         adev->active_in = NULL;
         if (in->resampler) {
-            release_resampler(in->resampler);
+            put_resampler(adev, in->resampler);
             in->resampler = NULL;
         }
-        if (in->buffer) {
-            free(in->buffer);
-            in->buffer = NULL;
-        }
+        buffer_pool_put(&adev->pool, in->buffer);
+        in->buffer = NULL;
         in->standby = true;
+        adev->in_standby_pending = false;
+    }
+}
+
+/*
+ * Standby is deferred by adev->standby_grace_ns: the PCM is stopped, which
+ * drops the queued audio just like closing it, but stays open with its
+ * resampler and buffers. A write or read within the grace period restarts
+ * it without pcm_open(); otherwise the standby thread really closes it.
+ */
+
+/* must be called with hw device and output stream mutexes locked */
+static void defer_out_standby(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    if (out->standby || out_standby_pending(out))
+        return;
+
+    if (adev->standby_grace_ns <= 0 || !adev->standby_thread_running) {
+        do_out_standby(out);
+        return;
     }
+
+    pcm_stop(out->pcm);
+    adev->out_standby_pending = true;
+    adev->out_standby_deadline = monotonic_ns() + adev->standby_grace_ns;
+    pthread_cond_signal(&adev->standby_cond);
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void defer_in_standby(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (in->standby || in_standby_pending(in))
+        return;
+
+    if (adev->standby_grace_ns <= 0 || !adev->standby_thread_running) {
+        do_in_standby(in);
+        return;
+    }
+
+    /* Nobody reads the ring until the stream is used again */
+    stop_capture_thread(in);
+    adev->in_standby_pending = true;
+    adev->in_standby_deadline = monotonic_ns() + adev->standby_grace_ns;
+    pthread_cond_signal(&adev->standby_cond);
+}
+
+/*
+ * Closes the active streams whose grace period is over and returns when the
+ * next one is due, or INT64_MAX if no standby is pending. A stream mutex is
+ * only taken to close the stream, never just to look at its deadline, so
+ * the thread does not wait behind a pcm_write() or pcm_read() in progress.
+ * must be called with hw device mutex locked
+ */
+static int64_t expire_standby(struct audio_device *adev, int64_t now)
+{
+    int64_t next = INT64_MAX;
+
+    if (adev->out_standby_pending) {
+        if (now >= adev->out_standby_deadline) {
+            struct stream_out *out = adev->active_out;
+
+            lock_out(out);
+            do_out_standby(out);
+            pthread_mutex_unlock(&out->lock);
+        } else {
+            next = adev->out_standby_deadline;
+        }
+    }
+
+    if (adev->in_standby_pending) {
+        if (now >= adev->in_standby_deadline) {
+            struct stream_in *in = adev->active_in;
+
+            lock_in(in);
+            do_in_standby(in);
+            pthread_mutex_unlock(&in->lock);
+        } else if (adev->in_standby_deadline < next) {
+            next = adev->in_standby_deadline;
+        }
+    }
+
+    return next;
+}
+
+static void *standby_thread_loop(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct timespec ts;
+    int64_t next;
+
+    lock_adev(adev);
+
+    while (!adev->standby_thread_exit) {
+        next = expire_standby(adev, monotonic_ns());
+
+        if (next == INT64_MAX) {
+            pthread_cond_wait(&adev->standby_cond, &adev->lock);
+        } else {
+            ts.tv_sec = next / 1000000000;
+            ts.tv_nsec = next % 1000000000;
+            pthread_cond_timedwait(&adev->standby_cond, &adev->lock, &ts);
+        }
+    }
+
+    pthread_mutex_unlock(&adev->lock);
+
+    return NULL;
+}
+
+static void start_standby_thread(struct audio_device *adev)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    /* Deadlines are CLOCK_MONOTONIC */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&adev->standby_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ret = pthread_create(&adev->standby_thread, NULL, standby_thread_loop,
+                         adev);
+    if (ret != 0) {
+        ALOGE("cannot create standby thread: %s", strerror(ret));
+        return;
+    }
+
+    pthread_setname_np(adev->standby_thread, "hal_standby");
+    adev->standby_thread_running = true;
+}
+
+static void stop_standby_thread(struct audio_device *adev)
+{
+    if (!adev->standby_thread_running)
+        return;
+
+    lock_adev(adev);
+    adev->standby_thread_exit = true;
+    pthread_cond_signal(&adev->standby_cond);
+    pthread_mutex_unlock(&adev->lock);
+
+    pthread_join(adev->standby_thread, NULL);
+    adev->standby_thread_running = false;
+}
+
+/*
+ * Takes a stream out of a deferred standby: the stopped PCM is restarted by
+ * the next pcm_write() or pcm_read().
+ * must be called with hw device and output stream mutexes locked
+ */
+static void resume_out_stream(struct stream_out *out)
+{
+    out->standby_stats.resumes++;
+    out->dev->out_standby_pending = false;
+    out->start_written = out->written;
+    if (out->resampler)
+        out->resampler->reset(out->resampler);
+}
+
+/* must be called with hw device and input stream mutexes locked */
+static void resume_in_stream(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    in->standby_stats.resumes++;
+    adev->in_standby_pending = false;
+    in->frames_in = 0;
+    if (in->resampler)
+        in->resampler->reset(in->resampler);
+
+    if (adev->capture_thread && start_capture_thread(in) != 0)
+        ALOGW("capture thread unavailable, reading synchronously");
 }
 
 /* must be called with hw device and output stream mutexes locked */
@@ -262,7 +1285,6 @@ static int start_output_stream(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
     unsigned int device;
-    int ret;
 
     /*
      * Due to the lack of sample rate converters in the SoC,
@@ -277,6 +1299,7 @@ static int start_output_stream(struct stream_out *out)
         device = PCM_DEVICE;
         out->pcm_config = &pcm_config_out;
     }
+    out->buffer_type = OUT_BUFFER_TYPE_UNKNOWN;
 
     /*
      * All open PCMs can only use a single group of rates at once:
@@ -287,7 +1310,7 @@ static int start_output_stream(struct stream_out *out)
      */
     if (adev->active_in) {
         struct stream_in *in = adev->active_in;
-        pthread_mutex_lock(&in->lock);
+        lock_in(in);
         if (((out->pcm_config->rate % 8000 == 0) &&
                  (in->pcm_config->rate % 8000) != 0) ||
                  ((out->pcm_config->rate % 11025 == 0) &&
@@ -309,18 +1332,45 @@ static int start_output_stream(struct stream_out *out)
      * create a resampler.
      */
     if (out_get_sample_rate(&out->stream.common) != out->pcm_config->rate) {
-        ret = create_resampler(out_get_sample_rate(&out->stream.common),
-                               out->pcm_config->rate,
-                               out->pcm_config->channels,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               NULL,
-                               &out->resampler);
+        out->resampler = get_resampler(adev,
+                                       out_get_sample_rate(&out->stream.common),
+                                       out->pcm_config->rate,
+                                       out->pcm_config->channels,
+                                       NULL);
         out->buffer_frames = (pcm_config_out.period_size * out->pcm_config->rate) /
                 out_get_sample_rate(&out->stream.common) + 1;
 
-        out->buffer = malloc(pcm_frames_to_bytes(out->pcm, out->buffer_frames));
+        out->buffer = buffer_pool_get(&adev->pool,
+                pcm_frames_to_bytes(out->pcm, out->buffer_frames), NULL);
+        if (!out->resampler || !out->buffer) {
+            ALOGE("cannot set up resampling for output");
+            put_resampler(adev, out->resampler);
+            out->resampler = NULL;
+            buffer_pool_put(&adev->pool, out->buffer);
+            out->buffer = NULL;
+            pcm_close(out->pcm);
+            out->pcm = NULL;
+            return -ENOMEM;
+        }
     }
 
+    if (out->pcm_config->channels == 1) {
+        out->mono_buffer_frames = pcm_config_out.period_size;
+        out->mono_buffer = buffer_pool_get(&adev->pool,
+                out->mono_buffer_frames * sizeof(int16_t), NULL);
+        if (!out->mono_buffer) {
+            ALOGE("cannot allocate the mono output buffer");
+            put_resampler(adev, out->resampler);
+            out->resampler = NULL;
+            buffer_pool_put(&adev->pool, out->buffer);
+            out->buffer = NULL;
+            pcm_close(out->pcm);
+            out->pcm = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    out->start_written = out->written;
     adev->active_out = out;
 
     return 0;
@@ -331,7 +1381,6 @@ static int start_input_stream(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
     unsigned int device;
-    int ret;
 
     /*
      * Due to the lack of sample rate converters in the SoC,
@@ -355,7 +1404,7 @@ static int start_input_stream(struct stream_in *in)
      */
     if (adev->active_out) {
         struct stream_out *out = adev->active_out;
-        pthread_mutex_lock(&out->lock);
+        lock_out(out);
         if (((in->pcm_config->rate % 8000 == 0) &&
                  (out->pcm_config->rate % 8000) != 0) ||
                  ((in->pcm_config->rate % 11025 == 0) &&
@@ -380,18 +1429,33 @@ static int start_input_stream(struct stream_in *in)
         in->buf_provider.get_next_buffer = get_next_buffer;
         in->buf_provider.release_buffer = release_buffer;
 
-        ret = create_resampler(in->pcm_config->rate,
-                               in_get_sample_rate(&in->stream.common),
-                               1,
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
+        in->resampler = get_resampler(adev,
+                                      in->pcm_config->rate,
+                                      in_get_sample_rate(&in->stream.common),
+                                      1,
+                                      &in->buf_provider);
     }
     in->buffer_size = pcm_frames_to_bytes(in->pcm,
                                           in->pcm_config->period_size);
-    in->buffer = malloc(in->buffer_size);
+    in->buffer = buffer_pool_get(&adev->pool, in->buffer_size, NULL);
+    if (!in->buffer ||
+            (!in->resampler &&
+             in_get_sample_rate(&in->stream.common) != in->pcm_config->rate)) {
+        ALOGE("cannot set up buffers for input");
+        put_resampler(adev, in->resampler);
+        in->resampler = NULL;
+        buffer_pool_put(&adev->pool, in->buffer);
+        in->buffer = NULL;
+        pcm_close(in->pcm);
+        in->pcm = NULL;
+        return -ENOMEM;
+    }
     in->frames_in = 0;
 
+    /* Without the thread in_read() reads the PCM directly */
+    if (adev->capture_thread && start_capture_thread(in) != 0)
+        ALOGW("capture thread unavailable, reading synchronously");
+
     adev->active_in = in;
 
     return 0;
@@ -415,7 +1479,18 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
         return -ENODEV;
     }
 
-    if (in->frames_in == 0) {
+    if (in->frames_in == 0 && in->capture_running) {
+        /* The capture thread has already dropped the right channel */
+        in->read_status = wait_capture_frames(in,
+                                              in->pcm_config->period_size);
+        if (in->read_status != 0) {
+            buffer->raw = NULL;
+            buffer->frame_count = 0;
+            return in->read_status;
+        }
+        ring_buffer_read(&in->ring, in->buffer, in->pcm_config->period_size);
+        in->frames_in = in->pcm_config->period_size;
+    } else if (in->frames_in == 0) {
         in->read_status = pcm_read(in->pcm,
                                    (void*)in->buffer,
                                    in->buffer_size);
@@ -426,13 +1501,11 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
             return in->read_status;
         }
         in->frames_in = in->pcm_config->period_size;
-        if (in->pcm_config->channels == 2) {
-            unsigned int i;
 
-            /* Discard right channel */
-            for (i = 1; i < in->frames_in; i++)
-                in->buffer[i] = in->buffer[i * 2];
-        }
+        /* Discard right channel */
+        if (in->pcm_config->channels == 2)
+            audio_extract_channel_s16(in->buffer, in->buffer,
+                                      in->frames_in, 0);
     }
 
     buffer->frame_count = (buffer->frame_count > in->frames_in) ?
@@ -466,10 +1539,13 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
     while (frames_wr < frames) {
         size_t frames_rd = frames - frames_wr;
         if (in->resampler != NULL) {
+            int64_t cpu = thread_cpu_ns();
+
             in->resampler->resample_from_provider(in->resampler,
                     (int16_t *)((char *)buffer +
                             frames_wr * audio_stream_in_frame_size(&in->stream)),
                     &frames_rd);
+            in->resampler_cpu_ns += thread_cpu_ns() - cpu;
         } else {
             struct resampler_buffer buf = {
                     { raw : NULL, },
@@ -499,7 +1575,8 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
 
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
-    return pcm_config_out.rate;
+    /* The PCM may run at the pinned rate instead */
+    return OUT_SAMPLING_RATE;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -532,9 +1609,9 @@ static int out_standby(struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
 
-    pthread_mutex_lock(&out->dev->lock);
-    pthread_mutex_lock(&out->lock);
-    do_out_standby(out);
+    lock_adev(out->dev);
+    lock_out(out);
+    defer_out_standby(out);
     pthread_mutex_unlock(&out->lock);
     pthread_mutex_unlock(&out->dev->lock);
 
@@ -543,6 +1620,41 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    uint32_t rate = out_get_sample_rate(stream);
+
+    lock_out(out);
+
+    dprintf(fd, "    Output stream %p: %s\n", out,
+            out->standby ? "standby" :
+            out_standby_pending(out) ? "standby pending" : "active");
+    dump_pcm_config(fd, out->pcm_config);
+    dprintf(fd, "      Buffer: %s, write threshold %d of %d frames\n",
+            out->buffer_type == OUT_BUFFER_TYPE_LONG ? "long" :
+            out->buffer_type == OUT_BUFFER_TYPE_SHORT ? "short" : "unknown",
+            out->cur_write_threshold, out->write_threshold);
+    dprintf(fd, "      Frames written: %llu, underruns: %u, write errors: %u\n",
+            (unsigned long long)out->written, out->underruns,
+            out->write_errors);
+    dump_standby_stats(fd, &out->standby_stats);
+
+    /* CPU load is the time spent per second of audio written */
+    if (out->resampler)
+        dprintf(fd, "      Resampler: %u -> %u Hz", rate, out->pcm_config->rate);
+    else
+        dprintf(fd, "      Resampler: none");
+    dprintf(fd, ", %llu ms CPU",
+            (unsigned long long)(out->resampler_cpu_ns / 1000000));
+    if (out->written)
+        dprintf(fd, " (%.2f%% of a core)",
+                out->resampler_cpu_ns * (double)rate / out->written / 1e7);
+    dprintf(fd, "\n");
+
+    dump_duration_hist(fd, "out_write", &out->write_hist);
+    dump_lock_stats(fd, 6, "Lock", &out->lock_stats);
+
+    pthread_mutex_unlock(&out->lock);
+
     return 0;
 }
 
@@ -559,7 +1671,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
                             value, sizeof(value));
-    pthread_mutex_lock(&adev->lock);
+    lock_adev(adev);
     if (ret >= 0) {
         val = atoi(value);
         if ((adev->out_device != val) && (val != 0)) {
@@ -569,7 +1681,7 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
              */
             if ((val & AUDIO_DEVICE_OUT_ALL_SCO) ^
                     (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO)) {
-                pthread_mutex_lock(&out->lock);
+                lock_out(out);
                 do_out_standby(out);
                 pthread_mutex_unlock(&out->lock);
             }
@@ -595,9 +1707,9 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
     struct audio_device *adev = out->dev;
     size_t period_count;
 
-    pthread_mutex_lock(&adev->lock);
+    lock_adev(adev);
 
-    if (adev->screen_off && !adev->active_in && !(adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO))
+    if (get_out_buffer_type(adev) == OUT_BUFFER_TYPE_LONG)
         period_count = OUT_LONG_PERIOD_COUNT;
     else
         period_count = OUT_SHORT_PERIOD_COUNT;
@@ -616,9 +1728,14 @@ static int out_set_volume(struct audio_stream_out *stream, float left,
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
-    int ret;
+    int ret = 0;
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
+    size_t frames = bytes / audio_stream_out_frame_size(stream);
+    size_t pcm_frames;
+    int buffer_type;
+    int64_t start = monotonic_ns();
+    int64_t now;
 
     /*
      * acquiring hw device mutex systematically is useful if a low
@@ -626,21 +1743,55 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
      * executing out_set_parameters() while holding the hw device
      * mutex
      */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&out->lock);
-    if (out->standby) {
+restart:
+    lock_adev(adev);
+    lock_out(out);
+    if (out_standby_pending(out)) {
+        resume_out_stream(out);
+    } else if (out->standby) {
+        now = monotonic_ns();
         ret = start_output_stream(out);
         if (ret != 0) {
             pthread_mutex_unlock(&adev->lock);
             goto exit;
         }
         out->standby = false;
+        standby_stats_add_exit(&out->standby_stats, monotonic_ns() - now);
     }
+    buffer_type = get_out_buffer_type(adev);
     pthread_mutex_unlock(&adev->lock);
 
-    pcm_write(out->pcm, (void *)buffer, bytes);
+    if (buffer_type != out->buffer_type)
+        set_out_buffer_type(out, buffer_type);
+
+    if (out->cur_write_threshold < out->write_threshold) {
+        out->cur_write_threshold += out->pcm_config->period_size;
+        if (out->cur_write_threshold > out->write_threshold)
+            out->cur_write_threshold = out->write_threshold;
+    }
+
+    pcm_frames = frames * out->pcm_config->rate /
+            out_get_sample_rate(&stream->common);
+    if (out_wait_write_threshold(out, pcm_frames) != 0) {
+        pthread_mutex_unlock(&out->lock);
+        goto restart;
+    }
+
+    ret = out_write_frames(out, buffer, frames);
+
+    /* The PCM is opened with PCM_NORESTART, so underruns surface here */
+    if (ret != 0 && errno == EPIPE)
+        out->underruns++;
 
 exit:
+    /*
+     * Count the frames even if they could not be written: the caller
+     * does, and the error path below sleeps for their duration.
+     */
+    out->written += frames;
+    if (ret != 0)
+        out->write_errors++;
+    duration_hist_add(&out->write_hist, monotonic_ns() - start);
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
@@ -654,7 +1805,22 @@ exit:
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec timestamp;
+    uint64_t frames;
+    int ret;
+
+    lock_out(out);
+
+    /* Frames rendered since the output last exited standby */
+    ret = out_get_presented_frames(out, &frames, &timestamp);
+    if (ret == 0)
+        *dsp_frames = frames > out->start_written ?
+                      (uint32_t)(frames - out->start_written) : 0;
+
+    pthread_mutex_unlock(&out->lock);
+
+    return ret < 0 ? -EINVAL : 0;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -670,32 +1836,38 @@ static int out_remove_audio_effect(const struct audio_stream *stream, effect_han
 static int out_get_next_write_timestamp(const struct audio_stream_out *stream,
                                         int64_t *timestamp)
 {
-    return -EINVAL;
+    struct stream_out *out = (struct stream_out *)stream;
+    struct timespec ts;
+    uint64_t pending;
+    int ret;
+
+    lock_out(out);
+
+    /*
+     * The next write is presented once everything pending has played, in
+     * microseconds of CLOCK_MONOTONIC.
+     */
+    ret = out_get_pending_frames(out, &pending, &ts);
+    if (ret == 0)
+        *timestamp = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 +
+                     pending * 1000000 / out_get_sample_rate(&stream->common);
+
+    pthread_mutex_unlock(&out->lock);
+
+    return ret < 0 ? -EINVAL : 0;
 }
 
 static int out_get_presentation_position(const struct audio_stream_out *stream,
                                    uint64_t *frames, struct timespec *timestamp)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    int ret = -1;
-
-    pthread_mutex_lock(&out->lock);
-
-    size_t avail;
-    if (pcm_get_htimestamp(out->pcm, &avail, timestamp) == 0) {
-        size_t kernel_buffer_size = out->pcm_config->period_size * out->pcm_config->period_count;
-        // FIXME This calculation is incorrect if there is buffering after app processor
-        int64_t signed_frames = out->written - kernel_buffer_size + avail;
-        // It would be unusual for this value to be negative, but check just in case ...
-        if (signed_frames >= 0) {
-            *frames = signed_frames;
-            ret = 0;
-        }
-    }
+    int ret;
 
+    lock_out(out);
+    ret = out_get_presented_frames(out, frames, timestamp);
     pthread_mutex_unlock(&out->lock);
 
-    return ret;
+    return ret < 0 ? -1 : 0;
 }
 
 /** audio_stream_in implementation **/
@@ -747,9 +1919,9 @@ static int in_standby(struct audio_stream *stream)
 {
     struct stream_in *in = (struct stream_in *)stream;
 
-    pthread_mutex_lock(&in->dev->lock);
-    pthread_mutex_lock(&in->lock);
-    do_in_standby(in);
+    lock_adev(in->dev);
+    lock_in(in);
+    defer_in_standby(in);
     pthread_mutex_unlock(&in->lock);
     pthread_mutex_unlock(&in->dev->lock);
 
@@ -758,6 +1930,39 @@ static int in_standby(struct audio_stream *stream)
 
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+
+    lock_in(in);
+
+    dprintf(fd, "    Input stream %p: %s%s\n", in,
+            in->standby ? "standby" :
+            in_standby_pending(in) ? "standby pending" : "active",
+            in->capture_running ? ", capture thread" : "");
+    dump_pcm_config(fd, in->pcm_config);
+    dprintf(fd, "      Frames read: %llu, overruns: %u, read errors: %u\n",
+            (unsigned long long)in->frames_read, atomic_load(&in->overruns),
+            in->read_errors);
+    dump_standby_stats(fd, &in->standby_stats);
+
+    /* This includes the PCM reads made while resampling */
+    if (in->resampler)
+        dprintf(fd, "      Resampler: %u -> %u Hz", in->pcm_config->rate,
+                in->requested_rate);
+    else
+        dprintf(fd, "      Resampler: none");
+    dprintf(fd, ", %llu ms CPU",
+            (unsigned long long)(in->resampler_cpu_ns / 1000000));
+    if (in->frames_read)
+        dprintf(fd, " (%.2f%% of a core)",
+                in->resampler_cpu_ns * (double)in->requested_rate /
+                in->frames_read / 1e7);
+    dprintf(fd, "\n");
+
+    dump_duration_hist(fd, "in_read", &in->read_hist);
+    dump_lock_stats(fd, 6, "Lock", &in->lock_stats);
+
+    pthread_mutex_unlock(&in->lock);
+
     return 0;
 }
 
@@ -774,7 +1979,7 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
                             value, sizeof(value));
-    pthread_mutex_lock(&adev->lock);
+    lock_adev(adev);
     if (ret >= 0) {
         val = atoi(value) & ~AUDIO_DEVICE_BIT_IN;
         if ((adev->in_device != val) && (val != 0)) {
@@ -784,7 +1989,7 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
              */
             if ((val & AUDIO_DEVICE_IN_ALL_SCO) ^
                     (adev->in_device & AUDIO_DEVICE_IN_ALL_SCO)) {
-                pthread_mutex_lock(&in->lock);
+                lock_in(in);
                 do_in_standby(in);
                 pthread_mutex_unlock(&in->lock);
             }
@@ -817,6 +2022,8 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_in_frame_size(stream);
+    int64_t start = monotonic_ns();
+    int64_t now;
 
     /*
      * acquiring hw device mutex systematically is useful if a low
@@ -824,12 +2031,17 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
      * executing in_set_parameters() while holding the hw device
      * mutex
      */
-    pthread_mutex_lock(&adev->lock);
-    pthread_mutex_lock(&in->lock);
-    if (in->standby) {
+    lock_adev(adev);
+    lock_in(in);
+    if (in_standby_pending(in)) {
+        resume_in_stream(in);
+    } else if (in->standby) {
+        now = monotonic_ns();
         ret = start_input_stream(in);
-        if (ret == 0)
+        if (ret == 0) {
             in->standby = 0;
+            standby_stats_add_exit(&in->standby_stats, monotonic_ns() - now);
+        }
     }
     pthread_mutex_unlock(&adev->lock);
 
@@ -838,21 +2050,19 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
 
     /*if (in->num_preprocessors != 0) {
         ret = process_frames(in, buffer, frames_rq);
-    } else */if (in->resampler != NULL) {
+    } else */if (in->resampler != NULL || in->capture_running) {
         ret = read_frames(in, buffer, frames_rq);
     } else if (in->pcm_config->channels == 2) {
         /*
          * If the PCM is stereo, capture twice as many frames and
          * discard the right channel.
          */
-        unsigned int i;
-        int16_t *in_buffer = (int16_t *)buffer;
-
         ret = pcm_read(in->pcm, in->buffer, bytes * 2);
 
         /* Discard right channel */
-        for (i = 0; i < frames_rq; i++)
-            in_buffer[i] = in->buffer[i * 2];
+        if (ret == 0)
+            audio_extract_channel_s16((int16_t *)buffer, in->buffer,
+                                      frames_rq, 0);
     } else {
         ret = pcm_read(in->pcm, buffer, bytes);
     }
@@ -868,17 +2078,31 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         memset(buffer, 0, bytes);
 
 exit:
-    if (ret < 0)
+    if (ret < 0) {
+        in->read_errors++;
         usleep(bytes * 1000000 / audio_stream_in_frame_size(stream) /
                in_get_sample_rate(&stream->common));
+    } else {
+        in->frames_read += frames_rq;
+    }
 
+    duration_hist_add(&in->read_hist, monotonic_ns() - start);
     pthread_mutex_unlock(&in->lock);
     return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t lost;
+
+    /* Only the capture thread can lose frames, and reports them once */
+    lost = atomic_exchange(&in->frames_lost, 0);
+    if (lost == 0)
+        return 0;
+
+    return (uint64_t)lost * in_get_sample_rate(&stream->common) /
+           in->pcm_config->rate;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream,
@@ -938,6 +2162,15 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->standby = true;
     /* out->written = 0; by calloc() */
 
+    /* Create the resamplers start_output_stream() may need now */
+    lock_adev(adev);
+    if (out_get_sample_rate(&out->stream.common) != pcm_config_out.rate)
+        prepare_resampler(adev, out_get_sample_rate(&out->stream.common),
+                          pcm_config_out.rate, pcm_config_out.channels);
+    prepare_resampler(adev, out_get_sample_rate(&out->stream.common),
+                      pcm_config_sco.rate, pcm_config_sco.channels);
+    pthread_mutex_unlock(&adev->lock);
+
     *stream_out = &out->stream;
     return 0;
 
@@ -950,7 +2183,16 @@ err_open:
 static void adev_close_output_stream(struct audio_hw_device *dev,
                                      struct audio_stream_out *stream)
 {
-    out_standby(&stream->common);
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    /* No grace period, the standby thread must not see the stream again */
+    lock_adev(adev);
+    lock_out(out);
+    do_out_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+
     free(stream);
 }
 
@@ -976,7 +2218,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         else
             orientation = ORIENTATION_UNDEFINED;
 
-        pthread_mutex_lock(&adev->lock);
+        lock_adev(adev);
         if (orientation != adev->orientation) {
             adev->orientation = orientation;
             /*
@@ -993,10 +2235,13 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
+        /* The active output picks the new buffer type up on its next write */
+        lock_adev(adev);
         if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
             adev->screen_off = false;
         else
             adev->screen_off = true;
+        pthread_mutex_unlock(&adev->lock);
     }
 
     str_parms_destroy(parms);
@@ -1113,6 +2358,14 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
             &pcm_config_in_low_latency : &pcm_config_in;
     in->pcm_config_non_sco = in->pcm_config;
 
+    /* Create the resamplers start_input_stream() may need now */
+    lock_adev(adev);
+    if (in->requested_rate != in->pcm_config->rate)
+        prepare_resampler(adev, in->pcm_config->rate, in->requested_rate, 1);
+    if (in->requested_rate != pcm_config_sco.rate)
+        prepare_resampler(adev, pcm_config_sco.rate, in->requested_rate, 1);
+    pthread_mutex_unlock(&adev->lock);
+
     *stream_in = &in->stream;
     return 0;
 }
@@ -1120,14 +2373,66 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 static void adev_close_input_stream(struct audio_hw_device *dev,
                                    struct audio_stream_in *stream)
 {
+    struct audio_device *adev = (struct audio_device *)dev;
     struct stream_in *in = (struct stream_in *)stream;
 
-    in_standby(&stream->common);
+    /* No grace period, the standby thread must not see the stream again */
+    lock_adev(adev);
+    lock_in(in);
+    do_in_standby(in);
+    pthread_mutex_unlock(&in->lock);
+    pthread_mutex_unlock(&adev->lock);
+
     free(stream);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+    struct cached_resampler *cr;
+    uint64_t frames;
+    uint64_t cpu_ns;
+    int i;
+
+    lock_adev(adev);
+
+    if (adev->pinned_rate)
+        dprintf(fd, "  PCM rate pinned to %u Hz\n", adev->pinned_rate);
+
+    dprintf(fd, "  Resamplers:\n");
+    for (i = 0; i < RESAMPLER_CACHE_SIZE; i++) {
+        cr = &adev->resamplers[i];
+        if (!cr->resampler)
+            continue;
+
+        dprintf(fd, "    %u -> %u Hz, %u ch, %s%s", cr->in_rate, cr->out_rate,
+                cr->channels, cr->polyphase ? "polyphase" : "speex",
+                cr->in_use ? ", in use" : "");
+
+        /* CPU load is the time spent per second of audio produced */
+        if (cr->polyphase) {
+            polyphase_resampler_get_stats(cr->resampler, &frames, &cpu_ns);
+            dprintf(fd, ", %llu frames, %llu ms CPU",
+                    (unsigned long long)frames,
+                    (unsigned long long)(cpu_ns / 1000000));
+            if (frames)
+                dprintf(fd, " (%.2f%% of a core)",
+                        cpu_ns * (double)cr->out_rate / frames / 1e7);
+        }
+        dprintf(fd, "\n");
+    }
+
+    dprintf(fd, "  Routes:");
+    for (i = 0; i < ROUTE_COUNT; i++) {
+        if (adev->routes != ROUTES_UNKNOWN && (adev->routes & (1 << i)))
+            dprintf(fd, " %s", route_paths[i]);
+    }
+    dprintf(fd, ", %u mixer updates\n", adev->route_updates);
+    dprintf(fd, "  Buffer pool fallbacks: %u\n", adev->pool.fallbacks);
+    dump_lock_stats(fd, 2, "Device lock", &adev->lock_stats);
+
+    pthread_mutex_unlock(&adev->lock);
+
     return 0;
 }
 
@@ -1135,7 +2440,10 @@ static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
 
+    stop_standby_thread(adev);
     audio_route_free(adev->ar);
+    release_resamplers(adev);
+    buffer_pool_release(&adev->pool);
 
     free(device);
     return 0;
@@ -1154,6 +2462,11 @@ static int adev_open(const hw_module_t* module, const char* name,
     if (!adev)
         return -ENOMEM;
 
+    if (buffer_pool_init(&adev->pool) != 0) {
+        free(adev);
+        return -ENOMEM;
+    }
+
     adev->hw_device.common.tag = HARDWARE_DEVICE_TAG;
     adev->hw_device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
     adev->hw_device.common.module = (struct hw_module_t *) module;
@@ -1174,8 +2487,32 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.close_input_stream = adev_close_input_stream;
     adev->hw_device.dump = adev_dump;
 
+    adev->capture_thread = property_get_bool("ro.audio.capture_thread", false);
+
+    /*
+     * Pinning the main PCMs to a rate of the SCO group means opening one
+     * PCM never forces the other into standby, so playback survives a
+     * voice call and capture can run during media playback.
+     */
+    adev->pinned_rate = property_get_int32("ro.audio.pinned_rate", 0);
+    if (adev->pinned_rate % SCO_SAMPLING_RATE != 0) {
+        ALOGW("ignoring pinned rate %u, not a multiple of %u Hz",
+              adev->pinned_rate, SCO_SAMPLING_RATE);
+        adev->pinned_rate = 0;
+    }
+    if (adev->pinned_rate) {
+        pcm_config_out.rate = adev->pinned_rate;
+        pcm_config_in.rate = adev->pinned_rate;
+        pcm_config_in_low_latency.rate = adev->pinned_rate;
+    }
+    adev->standby_grace_ns = (int64_t)property_get_int32(
+            "ro.audio.standby_grace_ms", STANDBY_GRACE_MS_DEFAULT) * 1000000;
+    if (adev->standby_grace_ns > 0)
+        start_standby_thread(adev);
+
     adev->ar = audio_route_init(MIXER_CARD, NULL);
     adev->orientation = ORIENTATION_UNDEFINED;
+    adev->routes = ROUTES_UNKNOWN;
     adev->out_device = AUDIO_DEVICE_OUT_SPEAKER;
     adev->in_device = AUDIO_DEVICE_IN_BUILTIN_MIC & ~AUDIO_DEVICE_BIT_IN;
 
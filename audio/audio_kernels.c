@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "audio_kernels.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NEON_FRAMES 8
+#endif
+
+/*
+ * Each kernel runs its NEON loop over whole vectors and finishes the tail
+ * with the scalar loop, which is also the whole implementation without
+ * NEON. The scalar loops must match the NEON rounding exactly.
+ */
+
+void audio_extract_channel_s16(int16_t *dst, const int16_t *src,
+                               size_t frames, unsigned int channel)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    /*
+     * In place is safe: each iteration loads before it stores, and stores
+     * below the position the next iteration loads from.
+     */
+    for (; i + NEON_FRAMES <= frames; i += NEON_FRAMES) {
+        int16x8x2_t v = vld2q_s16(src + i * 2);
+        vst1q_s16(dst + i, channel ? v.val[1] : v.val[0]);
+    }
+#endif
+
+    for (; i < frames; i++)
+        dst[i] = src[i * 2 + channel];
+}
+
+void audio_downmix_s16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + NEON_FRAMES <= frames; i += NEON_FRAMES) {
+        int16x8x2_t v = vld2q_s16(src + i * 2);
+        vst1q_s16(dst + i, vhaddq_s16(v.val[0], v.val[1]));
+    }
+#endif
+
+    /* Same truncation as vhadd */
+    for (; i < frames; i++)
+        dst[i] = (src[i * 2] + src[i * 2 + 1]) >> 1;
+}
+
+void audio_deinterleave_s16(int16_t *left, int16_t *right,
+                            const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + NEON_FRAMES <= frames; i += NEON_FRAMES) {
+        int16x8x2_t v = vld2q_s16(src + i * 2);
+        vst1q_s16(left + i, v.val[0]);
+        vst1q_s16(right + i, v.val[1]);
+    }
+#endif
+
+    for (; i < frames; i++) {
+        left[i] = src[i * 2];
+        right[i] = src[i * 2 + 1];
+    }
+}
+
+void audio_s16_to_float(float *dst, const int16_t *src, size_t count)
+{
+    const float scale = 1.0f / 32768;
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + NEON_FRAMES <= count; i += NEON_FRAMES) {
+        int16x8_t v = vld1q_s16(src + i);
+        int32x4_t lo = vmovl_s16(vget_low_s16(v));
+        int32x4_t hi = vmovl_s16(vget_high_s16(v));
+
+        vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(lo), scale));
+        vst1q_f32(dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(hi), scale));
+    }
+#endif
+
+    for (; i < count; i++)
+        dst[i] = src[i] * scale;
+}
+
+void audio_float_to_s16(int16_t *dst, const float *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t pos_half = vdupq_n_f32(0.5f);
+    const float32x4_t neg_half = vdupq_n_f32(-0.5f);
+
+    for (; i + NEON_FRAMES <= count; i += NEON_FRAMES) {
+        float32x4_t lo = vmulq_n_f32(vld1q_f32(src + i), 32768.0f);
+        float32x4_t hi = vmulq_n_f32(vld1q_f32(src + i + 4), 32768.0f);
+
+        /* Round half away from zero, then truncate and saturate */
+        lo = vaddq_f32(lo, vbslq_f32(vcltq_f32(lo, zero), neg_half, pos_half));
+        hi = vaddq_f32(hi, vbslq_f32(vcltq_f32(hi, zero), neg_half, pos_half));
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(lo)),
+                                        vqmovn_s32(vcvtq_s32_f32(hi))));
+    }
+#endif
+
+    for (; i < count; i++) {
+        float v = src[i] * 32768.0f;
+
+        v += v < 0 ? -0.5f : 0.5f;
+        if (v >= 32767.0f)
+            dst[i] = 32767;
+        else if (v <= -32768.0f)
+            dst[i] = -32768;
+        else if (v != v)
+            dst[i] = 0;
+        else
+            dst[i] = (int16_t)v;
+    }
+}
+
+void audio_apply_gain_s16(int16_t *buf, size_t count, float gain)
+{
+    int32_t q;
+    int32_t v;
+    size_t i = 0;
+
+    if (!(gain > 0.0f))
+        q = 0;
+    else if (gain >= 32767.0f / 4096)
+        q = 32767;
+    else
+        q = (int32_t)(gain * 4096 + 0.5f);
+
+    if (q == 4096)
+        return;
+
+#if defined(__ARM_NEON__)
+    for (; i + NEON_FRAMES <= count; i += NEON_FRAMES) {
+        int16x8_t s = vld1q_s16(buf + i);
+        int32x4_t lo = vmull_n_s16(vget_low_s16(s), q);
+        int32x4_t hi = vmull_n_s16(vget_high_s16(s), q);
+
+        vst1q_s16(buf + i, vcombine_s16(vqrshrn_n_s32(lo, 12),
+                                        vqrshrn_n_s32(hi, 12)));
+    }
+#endif
+
+    /* Same rounding and saturation as vqrshrn */
+    for (; i < count; i++) {
+        v = (buf[i] * q + (1 << 11)) >> 12;
+        if (v > 32767)
+            v = 32767;
+        else if (v < -32768)
+            v = -32768;
+        buf[i] = v;
+    }
+}
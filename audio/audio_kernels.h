@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_KERNELS_H
+#define AUDIO_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sample format kernels for the audio HAL, using NEON when built for ARMv7
+ * with NEON and plain C otherwise. Both versions give identical results.
+ *
+ * Buffers are interleaved 16 bit samples unless noted; frames counts stereo
+ * frames for the two channel kernels and samples otherwise.
+ */
+
+/*
+ * Copies one channel of a stereo buffer into a mono buffer. dst may be the
+ * same buffer as src, which is how the capture path drops the right channel.
+ */
+void audio_extract_channel_s16(int16_t *dst, const int16_t *src,
+                               size_t frames, unsigned int channel);
+
+/* Averages both channels of a stereo buffer. dst may be the same as src. */
+void audio_downmix_s16(int16_t *dst, const int16_t *src, size_t frames);
+
+/* Splits a stereo buffer into two mono buffers */
+void audio_deinterleave_s16(int16_t *left, int16_t *right,
+                            const int16_t *src, size_t frames);
+
+/* Converts to floats in [-1.0, 1.0) */
+void audio_s16_to_float(float *dst, const int16_t *src, size_t count);
+
+/* Converts from floats, rounding to nearest and clamping to the s16 range */
+void audio_float_to_s16(int16_t *dst, const float *src, size_t count);
+
+/*
+ * Scales samples in place with saturation. The gain is applied in Q12, so
+ * it is limited to [0, 8) with a resolution of 1/4096.
+ */
+void audio_apply_gain_s16(int16_t *buf, size_t count, float gain);
+
+#endif // AUDIO_KERNELS_H
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * audio_hw_bench: runs audio_hw.c on the host against the fake PCMs of
+ * fake_tinyalsa.c, in real time, and reports what the HAL calls cost.
+ *
+ * audio_hw.c is included rather than linked so its properties can be set
+ * from the command line and its state read directly: the property getters
+ * are redirected to the versions below. The HAL dumps follow the report.
+ *
+ * usage: audio_hw_bench [-d seconds] [-n] [-i rate] [-b frames] [-s ms]
+ *                       [-S] [-B] [-P] [-R] [-m us] [-p name=value]...
+ *   -d  run time, default 2 seconds
+ *   -n  no playback
+ *   -i  also capture at this rate
+ *   -b  frames per write and read, default the stream buffer size
+ *   -s  stall the writer this long once a second, to force underruns
+ *   -S  screen off, for the deep buffer
+ *   -B  route both directions to BT SCO
+ *   -P  poll the presentation position every 5 ms, as AudioFlinger does
+ *   -R  switch the output device and the orientation every 250 ms
+ *   -m  time a mixer update takes
+ *   -p  set a property, e.g. -p ro.audio.pinned_rate=48000
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <cutils/properties.h>
+
+static int8_t bench_property_get_bool(const char *key, int8_t default_value);
+static int32_t bench_property_get_int32(const char *key, int32_t default_value);
+
+#define property_get_bool bench_property_get_bool
+#define property_get_int32 bench_property_get_int32
+
+#include "../audio_hw.c"
+
+#undef property_get_bool
+#undef property_get_int32
+
+#include "fakes.h"
+
+#define MAX_PROPERTIES 16
+
+struct call_stats {
+    const char *name;
+    uint32_t *latency_us;
+    size_t count;
+    size_t size;
+    uint64_t cpu_ns;
+    uint64_t max_cpu_ns;
+};
+
+static struct call_stats write_stats = { .name = "write" };
+static struct call_stats read_stats = { .name = "read" };
+static struct call_stats position_stats = { .name = "position" };
+
+static struct {
+    char name[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+} properties[MAX_PROPERTIES];
+static int num_properties;
+
+static double duration = 2;
+static bool playback = true;
+static unsigned int capture_rate;
+static size_t block_frames;
+static size_t write_block;
+static size_t read_block;
+static unsigned int stall_ms;
+static bool screen_off;
+static bool sco;
+static bool poll_position;
+static bool reroute;
+
+static struct audio_hw_device *hw_dev;
+static atomic_bool stop;
+static unsigned int position_errors;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *find_property(const char *key)
+{
+    int i;
+
+    for (i = 0; i < num_properties; i++) {
+        if (strcmp(properties[i].name, key) == 0)
+            return properties[i].value;
+    }
+    return NULL;
+}
+
+static int8_t bench_property_get_bool(const char *key, int8_t default_value)
+{
+    const char *value = find_property(key);
+
+    if (!value)
+        return default_value;
+    if (!strcmp(value, "1") || !strcmp(value, "true") || !strcmp(value, "y"))
+        return 1;
+    if (!strcmp(value, "0") || !strcmp(value, "false") || !strcmp(value, "n"))
+        return 0;
+    return default_value;
+}
+
+static int32_t bench_property_get_int32(const char *key, int32_t default_value)
+{
+    const char *value = find_property(key);
+
+    return value ? (int32_t)strtol(value, NULL, 0) : default_value;
+}
+
+static void record(struct call_stats *cs, uint64_t wall_ns, uint64_t cpu)
+{
+    if (cs->count == cs->size) {
+        cs->size = cs->size ? cs->size * 2 : 1024;
+        cs->latency_us = realloc(cs->latency_us,
+                                 cs->size * sizeof(*cs->latency_us));
+        if (!cs->latency_us)
+            abort();
+    }
+
+    cs->latency_us[cs->count++] = wall_ns / 1000;
+    cs->cpu_ns += cpu;
+    if (cpu > cs->max_cpu_ns)
+        cs->max_cpu_ns = cpu;
+}
+
+static void *writer_loop(void *context)
+{
+    struct audio_stream_out *stream = context;
+    size_t bytes = write_block * audio_stream_out_frame_size(stream);
+    int16_t *buffer = malloc(bytes);
+    uint64_t next_stall = now_ns() + 1000000000;
+    uint64_t start;
+    uint64_t cpu;
+    size_t i;
+
+    for (i = 0; i < write_block * 2; i++)
+        buffer[i] = 8192 * sin(2 * M_PI * 440 * (i / 2) / OUT_SAMPLING_RATE);
+
+    while (!atomic_load(&stop)) {
+        if (stall_ms && now_ns() >= next_stall) {
+            usleep(stall_ms * 1000);
+            next_stall += 1000000000;
+        }
+
+        start = now_ns();
+        cpu = cpu_ns();
+        stream->write(stream, buffer, bytes);
+        record(&write_stats, now_ns() - start, cpu_ns() - cpu);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void *reader_loop(void *context)
+{
+    struct audio_stream_in *stream = context;
+    size_t bytes = read_block * audio_stream_in_frame_size(stream);
+    void *buffer = malloc(bytes);
+    uint64_t start;
+    uint64_t cpu;
+
+    while (!atomic_load(&stop)) {
+        start = now_ns();
+        cpu = cpu_ns();
+        stream->read(stream, buffer, bytes);
+        record(&read_stats, now_ns() - start, cpu_ns() - cpu);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void *poller_loop(void *context)
+{
+    struct audio_stream_out *stream = context;
+    uint64_t last = 0;
+    uint64_t frames;
+    struct timespec ts;
+    uint64_t start;
+    uint64_t cpu;
+    int ret;
+
+    while (!atomic_load(&stop)) {
+        start = now_ns();
+        cpu = cpu_ns();
+        ret = stream->get_presentation_position(stream, &frames, &ts);
+        record(&position_stats, now_ns() - start, cpu_ns() - cpu);
+
+        if (ret == 0) {
+            if (frames < last)
+                position_errors++;
+            last = frames;
+        }
+        usleep(5000);
+    }
+
+    return NULL;
+}
+
+static void *router_loop(void *context)
+{
+    struct audio_stream_out *stream = context;
+    static const audio_devices_t devices[] = {
+        AUDIO_DEVICE_OUT_SPEAKER,
+        AUDIO_DEVICE_OUT_WIRED_HEADPHONE,
+    };
+    char kvpairs[64];
+    int i = 0;
+
+    while (!atomic_load(&stop)) {
+        usleep(250000);
+        i++;
+
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                 devices[i % 2]);
+        stream->common.set_parameters(&stream->common, kvpairs);
+        hw_dev->set_parameters(hw_dev, i % 4 < 2 ? "orientation=landscape" :
+                                                   "orientation=portrait");
+    }
+
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report_calls(struct call_stats *cs)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    if (!cs->count)
+        return;
+
+    for (i = 0; i < cs->count; i++)
+        total += cs->latency_us[i];
+
+    /* Order the samples for the percentiles */
+    qsort(cs->latency_us, cs->count, sizeof(*cs->latency_us), compare_u32);
+
+    printf("  %-10s %7zu %9llu %7u %7u %7u %9.1f %7llu\n", cs->name,
+           cs->count, (unsigned long long)(total / cs->count),
+           cs->latency_us[cs->count / 2],
+           cs->latency_us[cs->count * 99 / 100],
+           cs->latency_us[cs->count - 1],
+           cs->cpu_ns / 1000.0 / cs->count,
+           (unsigned long long)(cs->max_cpu_ns / 1000));
+}
+
+static void report_lock(const char *name, const struct lock_stats *ls)
+{
+    printf("  %-10s %9llu %9llu %12.3f %9llu\n", name,
+           (unsigned long long)ls->acquired,
+           (unsigned long long)ls->contended, ls->wait_ns / 1e6,
+           (unsigned long long)(ls->max_wait_ns / 1000));
+}
+
+static void report(struct audio_device *adev, struct stream_out *out,
+                   struct stream_in *in)
+{
+
+    printf("audio_hw_bench: %.1f s", duration);
+    if (out)
+        printf(", output %u Hz on a %u Hz PCM", OUT_SAMPLING_RATE,
+               out->pcm_config->rate);
+    if (in)
+        printf(", input %u Hz on a %u Hz PCM", in->requested_rate,
+               in->pcm_config->rate);
+    printf("\n\n");
+
+    printf("  %-10s %7s %9s %7s %7s %7s %9s %7s\n", "call", "count",
+           "avg us", "p50", "p99", "max", "cpu avg", "max");
+    report_calls(&write_stats);
+    report_calls(&read_stats);
+    report_calls(&position_stats);
+
+    printf("\n  %u underruns, %u overruns, %u PCM opens, %u mixer updates",
+           atomic_load(&fake_stats.underruns),
+           atomic_load(&fake_stats.overruns),
+           atomic_load(&fake_stats.pcm_opens),
+           atomic_load(&fake_stats.mixer_updates));
+    if (poll_position)
+        printf(", %u position errors", position_errors);
+    printf("\n\n");
+
+    printf("  %-10s %9s %9s %12s %9s\n", "lock", "acquired", "contended",
+           "wait ms", "max us");
+    report_lock("adev->lock", &adev->lock_stats);
+    if (out)
+        report_lock("out->lock", &out->lock_stats);
+    if (in)
+        report_lock("in->lock", &in->lock_stats);
+
+    printf("\nHAL dump:\n");
+    fflush(stdout);
+    adev->hw_device.dump(&adev->hw_device, STDOUT_FILENO);
+    if (out)
+        out->stream.common.dump(&out->stream.common, STDOUT_FILENO);
+    if (in)
+        in->stream.common.dump(&in->stream.common, STDOUT_FILENO);
+}
+
+static int add_property(const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+
+    if (!eq || num_properties == MAX_PROPERTIES ||
+            eq - arg >= PROPERTY_KEY_MAX)
+        return -1;
+
+    memcpy(properties[num_properties].name, arg, eq - arg);
+    strncpy(properties[num_properties].value, eq + 1,
+            PROPERTY_VALUE_MAX - 1);
+    num_properties++;
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d seconds] [-n] [-i rate] [-b frames] "
+            "[-s ms] [-S] [-B] [-P] [-R] [-m us] [-p name=value]...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct audio_hw_device *dev;
+    struct audio_device *adev;
+    struct audio_stream_out *out_stream = NULL;
+    struct audio_stream_in *in_stream = NULL;
+    struct audio_config config;
+    pthread_t threads[4];
+    int num_threads = 0;
+    hw_device_t *device;
+    char kvpairs[64];
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "d:ni:b:s:SBPRm:p:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'n':
+            playback = false;
+            break;
+        case 'i':
+            capture_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            block_frames = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            stall_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            screen_off = true;
+            break;
+        case 'B':
+            sco = true;
+            break;
+        case 'P':
+            poll_position = true;
+            break;
+        case 'R':
+            reroute = true;
+            break;
+        case 'm':
+            fake_mixer_update_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            if (add_property(optarg) == 0)
+                break;
+            /* fall through */
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!playback && !capture_rate) {
+        fprintf(stderr, "nothing to do\n");
+        return 1;
+    }
+
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            AUDIO_HARDWARE_INTERFACE, &device) != 0) {
+        fprintf(stderr, "cannot open the HAL\n");
+        return 1;
+    }
+    dev = (struct audio_hw_device *)device;
+    adev = (struct audio_device *)device;
+    hw_dev = dev;
+
+    if (screen_off)
+        dev->set_parameters(dev, "screen_state=off");
+
+    if (playback) {
+        memset(&config, 0, sizeof(config));
+        if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_SPEAKER,
+                                    AUDIO_OUTPUT_FLAG_PRIMARY, &config,
+                                    &out_stream, NULL) != 0) {
+            fprintf(stderr, "cannot open the output stream\n");
+            return 1;
+        }
+
+        if (sco) {
+            snprintf(kvpairs, sizeof(kvpairs), "%s=%d",
+                     AUDIO_PARAMETER_STREAM_ROUTING,
+                     AUDIO_DEVICE_OUT_BLUETOOTH_SCO);
+            out_stream->common.set_parameters(&out_stream->common, kvpairs);
+        }
+    }
+
+    if (capture_rate) {
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = capture_rate;
+        config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        if (dev->open_input_stream(dev, 1, AUDIO_DEVICE_IN_BUILTIN_MIC,
+                                   &config, &in_stream, AUDIO_INPUT_FLAG_NONE,
+                                   NULL, AUDIO_SOURCE_MIC) != 0) {
+            fprintf(stderr, "cannot open the input stream\n");
+            return 1;
+        }
+
+        if (sco) {
+            snprintf(kvpairs, sizeof(kvpairs), "%s=%d",
+                     AUDIO_PARAMETER_STREAM_ROUTING,
+                     AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET);
+            in_stream->common.set_parameters(&in_stream->common, kvpairs);
+        }
+    }
+
+    if (out_stream) {
+        write_block = block_frames;
+        if (!write_block)
+            write_block = out_stream->common.get_buffer_size(
+                    &out_stream->common) /
+                    audio_stream_out_frame_size(out_stream);
+        pthread_create(&threads[num_threads++], NULL, writer_loop, out_stream);
+    }
+    if (in_stream) {
+        read_block = block_frames;
+        if (!read_block)
+            read_block = in_stream->common.get_buffer_size(
+                    &in_stream->common) /
+                    audio_stream_in_frame_size(in_stream);
+        pthread_create(&threads[num_threads++], NULL, reader_loop, in_stream);
+    }
+
+    /* Both need the output running */
+    if (out_stream && (poll_position || reroute)) {
+        usleep(100000);
+        if (poll_position)
+            pthread_create(&threads[num_threads++], NULL, poller_loop,
+                           out_stream);
+        if (reroute)
+            pthread_create(&threads[num_threads++], NULL, router_loop,
+                           out_stream);
+    }
+
+    usleep(duration * 1000000);
+    atomic_store(&stop, true);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    report(adev, (struct stream_out *)out_stream,
+           (struct stream_in *)in_stream);
+
+    if (in_stream)
+        dev->close_input_stream(dev, in_stream);
+    if (out_stream)
+        dev->close_output_stream(dev, out_stream);
+    device->close(device);
+
+    return 0;
+}
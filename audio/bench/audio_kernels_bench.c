@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * audio_kernels_bench: checks the audio_kernels.c kernels against plain
+ * reference loops and times both. The "loop" rows are the per-sample loops
+ * the capture path used before the kernels. Built for the host the scalar
+ * fallbacks are measured; built for the device the NEON versions are.
+ *
+ * usage: audio_kernels_bench [-f frames] [-n iterations]
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio_kernels.h"
+
+static size_t frames = 1024;
+static int iterations = 20000;
+
+static int16_t *stereo;
+static int16_t *mono;
+static int16_t *mono2;
+static int16_t *ref;
+static float *fbuf;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the timed loops */
+static volatile int16_t sink;
+
+static void report(const char *name, uint64_t ns, double base_ns)
+{
+    double per_frame = (double)ns / iterations / frames;
+
+    if (base_ns > 0)
+        printf("  %-24s %8.3f ns/frame  %5.2fx\n", name, per_frame,
+               base_ns / per_frame);
+    else
+        printf("  %-24s %8.3f ns/frame\n", name, per_frame);
+}
+
+#define TIME(expr) ({                           \
+    uint64_t __t = now_ns();                    \
+    for (int __i = 0; __i < iterations; __i++) { \
+        expr;                                   \
+        sink = mono[__i % frames];              \
+    }                                           \
+    now_ns() - __t;                             \
+})
+
+static int check(const char *name, const int16_t *a, const int16_t *b,
+                 size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            fprintf(stderr, "%s: mismatch at %zu: %d != %d\n", name, i,
+                    a[i], b[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The loops from audio_hw.c before the kernels, kept as the baseline */
+static void loop_discard_right(int16_t *dst, const int16_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = src[i * 2];
+}
+
+static void loop_discard_right_in_place(int16_t *buf, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+        buf[i] = buf[i * 2];
+}
+
+static int verify(void)
+{
+    size_t n = frames;
+    int err = 0;
+
+    /* Channel extraction, out of place and in place */
+    loop_discard_right(ref, stereo, n);
+    audio_extract_channel_s16(mono, stereo, n, 0);
+    err |= check("extract", mono, ref, n);
+
+    memcpy(mono2, stereo, n * 2 * sizeof(int16_t));
+    audio_extract_channel_s16(mono2, mono2, n, 0);
+    err |= check("extract in place", mono2, ref, n);
+
+    for (size_t i = 0; i < n; i++)
+        ref[i] = stereo[i * 2 + 1];
+    audio_extract_channel_s16(mono, stereo, n, 1);
+    err |= check("extract right", mono, ref, n);
+
+    /* Downmix */
+    for (size_t i = 0; i < n; i++)
+        ref[i] = (stereo[i * 2] + stereo[i * 2 + 1]) >> 1;
+    audio_downmix_s16(mono, stereo, n);
+    err |= check("downmix", mono, ref, n);
+
+    /* Deinterleave */
+    audio_deinterleave_s16(mono, mono2, stereo, n);
+    loop_discard_right(ref, stereo, n);
+    err |= check("deinterleave left", mono, ref, n);
+    for (size_t i = 0; i < n; i++)
+        ref[i] = stereo[i * 2 + 1];
+    err |= check("deinterleave right", mono2, ref, n);
+
+    /* s16 -> float -> s16 is lossless */
+    audio_s16_to_float(fbuf, stereo, n);
+    audio_float_to_s16(mono, fbuf, n);
+    err |= check("float round trip", mono, stereo, n);
+
+    /* Clamping and rounding of out of range floats */
+    {
+        static const float in[] = { 1.5f, -1.5f, 0.99999f, -1.0f,
+                                    0.5f / 32768, -0.5f / 32768,
+                                    0.49f / 32768, 2.0f / 32768 };
+        static const int16_t out[] = { 32767, -32768, 32767, -32768,
+                                       1, -1, 0, 2 };
+        float f[16];
+        int16_t s[16];
+
+        /* Twice, so both the vector and the tail loop see the cases */
+        memcpy(f, in, sizeof(in));
+        memcpy(f + 8, in, sizeof(in));
+        audio_float_to_s16(s, f, 16);
+        err |= check("float clamp", s, out, 8);
+        err |= check("float clamp tail", s + 8, out, 8);
+    }
+
+    /* Gain */
+    memcpy(mono, stereo, n * sizeof(int16_t));
+    audio_apply_gain_s16(mono, n, 0.5f);
+    for (size_t i = 0; i < n; i++)
+        ref[i] = (stereo[i] * 2048 + 2048) >> 12;
+    err |= check("gain 0.5", mono, ref, n);
+
+    memcpy(mono, stereo, n * sizeof(int16_t));
+    audio_apply_gain_s16(mono, n, 4.0f);
+    for (size_t i = 0; i < n; i++) {
+        int v = stereo[i] * 4;
+        ref[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+    }
+    err |= check("gain 4.0", mono, ref, n);
+
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t ns;
+    double base;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f frames] [-n iterations]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (frames < 16 || iterations < 1) {
+        fprintf(stderr, "need at least 16 frames and 1 iteration\n");
+        return 1;
+    }
+
+    stereo = malloc(frames * 2 * sizeof(int16_t));
+    mono = malloc(frames * 2 * sizeof(int16_t));
+    mono2 = malloc(frames * 2 * sizeof(int16_t));
+    ref = malloc(frames * 2 * sizeof(int16_t));
+    fbuf = malloc(frames * 2 * sizeof(float));
+    if (!stereo || !mono || !mono2 || !ref || !fbuf)
+        return 1;
+
+    srand(1);
+    for (size_t i = 0; i < frames * 2; i++)
+        stereo[i] = (int16_t)rand();
+    /* Make sure the extremes are covered */
+    stereo[0] = -32768;
+    stereo[1] = 32767;
+
+    if (verify()) {
+        fprintf(stderr, "verification failed\n");
+        return 1;
+    }
+
+#if defined(__ARM_NEON__)
+    printf("audio kernels (NEON), %zu frames x %d\n", frames, iterations);
+#else
+    printf("audio kernels (scalar), %zu frames x %d\n", frames, iterations);
+#endif
+
+    printf("stereo to mono\n");
+    ns = TIME(loop_discard_right(mono, stereo, frames));
+    base = (double)ns / iterations / frames;
+    report("loop", ns, 0);
+    ns = TIME(audio_extract_channel_s16(mono, stereo, frames, 0));
+    report("extract_channel", ns, base);
+    ns = TIME(audio_downmix_s16(mono, stereo, frames));
+    report("downmix", ns, base);
+
+    printf("stereo to mono in place\n");
+    ns = TIME(memcpy(mono2, stereo, frames * 4);
+              loop_discard_right_in_place(mono2, frames));
+    base = (double)ns / iterations / frames;
+    report("memcpy + loop", ns, 0);
+    ns = TIME(memcpy(mono2, stereo, frames * 4);
+              audio_extract_channel_s16(mono2, mono2, frames, 0));
+    report("memcpy + extract_channel", ns, base);
+
+    printf("deinterleave\n");
+    ns = TIME(audio_deinterleave_s16(mono, mono2, stereo, frames));
+    report("deinterleave", ns, 0);
+
+    printf("format conversion\n");
+    ns = TIME(audio_s16_to_float(fbuf, stereo, frames));
+    report("s16_to_float", ns, 0);
+    ns = TIME(audio_float_to_s16(mono, fbuf, frames));
+    report("float_to_s16", ns, 0);
+
+    printf("gain\n");
+    memcpy(mono, stereo, frames * sizeof(int16_t));
+    ns = TIME(audio_apply_gain_s16(mono, frames, 0.999f));
+    report("apply_gain", ns, 0);
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <audio_route/audio_route.h>
+#include <audio_utils/resampler.h>
+
+#include "fakes.h"
+#include "polyphase_resampler.h"
+
+unsigned int fake_mixer_update_us;
+
+struct audio_route {
+    int unused;
+};
+
+struct audio_route *audio_route_init(unsigned int card, const char *xml_path)
+{
+    return calloc(1, sizeof(struct audio_route));
+}
+
+void audio_route_free(struct audio_route *ar)
+{
+    free(ar);
+}
+
+void audio_route_reset(struct audio_route *ar)
+{
+}
+
+int audio_route_apply_path(struct audio_route *ar, const char *name)
+{
+    return 0;
+}
+
+int audio_route_update_mixer(struct audio_route *ar)
+{
+    atomic_fetch_add(&fake_stats.mixer_updates, 1);
+    if (fake_mixer_update_us)
+        usleep(fake_mixer_update_us);
+    return 0;
+}
+
+/* The speex resampler is not built for the host, use the polyphase one */
+int create_resampler(uint32_t inSampleRate, uint32_t outSampleRate,
+                     uint32_t channelCount, uint32_t quality,
+                     struct resampler_buffer_provider *provider,
+                     struct resampler_itfe **resampler)
+{
+    return create_polyphase_resampler(inSampleRate, outSampleRate,
+                                      channelCount, provider, resampler);
+}
+
+void release_resampler(struct resampler_itfe *resampler)
+{
+    release_polyphase_resampler(resampler);
+}
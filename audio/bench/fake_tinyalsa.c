@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "fakes.h"
+
+struct fake_stats fake_stats;
+
+struct pcm {
+    unsigned int flags;
+    struct pcm_config config;
+    unsigned int buffer_size;
+    unsigned int start_threshold;
+    bool running;
+    bool xrun;          /* reported by the next write, as the driver does */
+    uint64_t start_ns;  /* when the hardware pointer was at hw_base */
+    uint64_t hw_base;
+    uint64_t appl_ptr;  /* frames written or read by the application */
+    double tone_phase;  /* capture produces a 1 kHz tone */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t hw_ptr(struct pcm *pcm, uint64_t now)
+{
+    if (!pcm->running)
+        return pcm->hw_base;
+
+    return pcm->hw_base +
+           (now - pcm->start_ns) * pcm->config.rate / 1000000000;
+}
+
+static void sleep_frames(struct pcm *pcm, uint64_t frames)
+{
+    usleep(frames * 1000000 / pcm->config.rate + 1);
+}
+
+/* Stops the PCM and drops whatever is buffered */
+static void reset(struct pcm *pcm)
+{
+    pcm->running = false;
+    pcm->hw_base = pcm->appl_ptr;
+}
+
+static void start(struct pcm *pcm, uint64_t now)
+{
+    pcm->running = true;
+    pcm->start_ns = now;
+}
+
+/* Playback runs dry once the hardware has played everything written */
+static bool check_underrun(struct pcm *pcm, uint64_t now)
+{
+    if (!pcm->running || hw_ptr(pcm, now) < pcm->appl_ptr)
+        return false;
+
+    atomic_fetch_add(&fake_stats.underruns, 1);
+    reset(pcm);
+    pcm->xrun = true;
+    return true;
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm = calloc(1, sizeof(*pcm));
+
+    if (!pcm)
+        return NULL;
+
+    pcm->flags = flags;
+    pcm->config = *config;
+    pcm->buffer_size = config->period_size * config->period_count;
+    pcm->start_threshold = config->start_threshold;
+    if (pcm->start_threshold == 0 || pcm->start_threshold > pcm->buffer_size)
+        pcm->start_threshold = (flags & PCM_IN) ? 1 : pcm->buffer_size;
+
+    atomic_fetch_add(&fake_stats.pcm_opens, 1);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL;
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return "";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->config.channels * sizeof(int16_t);
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / (pcm->config.channels * sizeof(int16_t));
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    reset(pcm);
+    pcm->xrun = false;
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    if (!pcm->running)
+        start(pcm, now_ns());
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    reset(pcm);
+    pcm->xrun = false;
+    return 0;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail,
+                       struct timespec *tstamp)
+{
+    uint64_t now = now_ns();
+    uint64_t hw;
+
+    if (!(pcm->flags & PCM_IN) && check_underrun(pcm, now))
+        return -1;
+    if (!pcm->running)
+        return -1;
+
+    hw = hw_ptr(pcm, now);
+    if (pcm->flags & PCM_IN)
+        *avail = hw - pcm->appl_ptr;
+    else
+        *avail = pcm->buffer_size - (pcm->appl_ptr - hw);
+
+    tstamp->tv_sec = now / 1000000000;
+    tstamp->tv_nsec = now % 1000000000;
+    return 0;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    uint64_t frames = pcm_bytes_to_frames(pcm, count);
+    uint64_t now;
+    uint64_t queued;
+    uint64_t space;
+    uint64_t n;
+
+    if (pcm->flags & PCM_IN)
+        return -EINVAL;
+
+    while (frames > 0) {
+        now = now_ns();
+        check_underrun(pcm, now);
+        if (pcm->xrun) {
+            pcm->xrun = false;
+            if (pcm->flags & PCM_NORESTART) {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+
+        queued = pcm->appl_ptr - hw_ptr(pcm, now);
+        space = pcm->buffer_size - queued;
+        if (space == 0) {
+            /* Blocks like the driver until a period has been played */
+            sleep_frames(pcm, frames < pcm->config.period_size ?
+                              frames : pcm->config.period_size);
+            continue;
+        }
+
+        n = frames < space ? frames : space;
+        pcm->appl_ptr += n;
+        frames -= n;
+        atomic_fetch_add(&fake_stats.frames_written, n);
+
+        if (!pcm->running && queued + n >= pcm->start_threshold)
+            start(pcm, now);
+    }
+
+    return 0;
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    uint64_t frames = pcm_bytes_to_frames(pcm, count);
+    int16_t *samples = data;
+    uint64_t now;
+    uint64_t avail;
+    uint64_t i;
+    unsigned int c;
+
+    if (!(pcm->flags & PCM_IN))
+        return -EINVAL;
+
+    for (;;) {
+        now = now_ns();
+        if (!pcm->running)
+            start(pcm, now);
+
+        avail = hw_ptr(pcm, now) - pcm->appl_ptr;
+        if (avail > pcm->buffer_size) {
+            /* Overrun: tinyalsa restarts the stream unless told not to */
+            atomic_fetch_add(&fake_stats.overruns, 1);
+            reset(pcm);
+            if (pcm->flags & PCM_NORESTART) {
+                errno = EPIPE;
+                return -1;
+            }
+            continue;
+        }
+
+        if (avail >= frames)
+            break;
+        sleep_frames(pcm, frames - avail);
+    }
+
+    for (i = 0; i < frames; i++) {
+        int16_t v = 8192 * sin(pcm->tone_phase);
+
+        for (c = 0; c < pcm->config.channels; c++)
+            samples[i * pcm->config.channels + c] = v;
+        pcm->tone_phase += 2 * M_PI * 1000 / pcm->config.rate;
+    }
+    pcm->tone_phase = fmod(pcm->tone_phase, 2 * M_PI);
+
+    pcm->appl_ptr += frames;
+    atomic_fetch_add(&fake_stats.frames_read, frames);
+
+    return 0;
+}
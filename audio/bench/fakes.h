@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_BENCH_FAKES_H
+#define AUDIO_BENCH_FAKES_H
+
+#include <stdatomic.h>
+
+/*
+ * Host stand-ins for tinyalsa, audio_route and the libaudioutils resampler
+ * used by audio_hw_bench.
+ *
+ * The fake PCMs run on CLOCK_MONOTONIC: the hardware pointer advances at
+ * the configured rate from the moment a PCM starts, writes and reads block
+ * until there is room or data, and a playback PCM that runs dry or a
+ * capture PCM that overflows counts an xrun the way the kernel would.
+ */
+struct fake_stats {
+    atomic_uint pcm_opens;
+    atomic_uint underruns;
+    atomic_uint overruns;
+    atomic_ullong frames_written; /* at the PCM rate */
+    atomic_ullong frames_read;
+    atomic_uint mixer_updates;
+};
+
+extern struct fake_stats fake_stats;
+
+/* Time each audio_route_update_mixer() call takes, as codec writes would */
+extern unsigned int fake_mixer_update_us;
+
+#endif // AUDIO_BENCH_FAKES_H
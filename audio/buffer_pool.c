@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+
+#define CLASS_SIZE(c) ((size_t)1 << (BUFFER_POOL_MIN_SHIFT + (c)))
+
+/* Offset of the first slot of a class: all smaller classes come before it */
+#define CLASS_OFFSET(c) \
+    (BUFFER_POOL_SLOTS * (CLASS_SIZE(c) - CLASS_SIZE(0)))
+
+#define ALL_SLOTS ((1u << BUFFER_POOL_SLOTS) - 1)
+
+int buffer_pool_init(struct buffer_pool *pool)
+{
+    int c;
+
+    memset(pool, 0, sizeof(*pool));
+
+    pool->length = CLASS_OFFSET(BUFFER_POOL_CLASSES);
+    pool->base = malloc(pool->length);
+    if (!pool->base)
+        return -ENOMEM;
+
+    for (c = 0; c < BUFFER_POOL_CLASSES; c++)
+        pool->free_slots[c] = ALL_SLOTS;
+
+    return 0;
+}
+
+void buffer_pool_release(struct buffer_pool *pool)
+{
+    free(pool->base);
+    pool->base = NULL;
+    pool->length = 0;
+}
+
+void *buffer_pool_get(struct buffer_pool *pool, size_t bytes, size_t *size)
+{
+    void *buf;
+    int slot;
+    int c;
+
+    for (c = 0; c < BUFFER_POOL_CLASSES; c++) {
+        if (CLASS_SIZE(c) < bytes || !pool->free_slots[c])
+            continue;
+
+        slot = __builtin_ctz(pool->free_slots[c]);
+        pool->free_slots[c] &= ~(1u << slot);
+        if (size)
+            *size = CLASS_SIZE(c);
+
+        return pool->base + CLASS_OFFSET(c) + slot * CLASS_SIZE(c);
+    }
+
+    buf = malloc(bytes);
+    if (!buf)
+        return NULL;
+
+    pool->fallbacks++;
+    if (size)
+        *size = bytes;
+
+    return buf;
+}
+
+void buffer_pool_put(struct buffer_pool *pool, void *buf)
+{
+    size_t offset;
+    int c;
+
+    if (!buf)
+        return;
+
+    if ((uint8_t *)buf < pool->base ||
+            (uint8_t *)buf >= pool->base + pool->length) {
+        free(buf);
+        return;
+    }
+
+    offset = (uint8_t *)buf - pool->base;
+    for (c = BUFFER_POOL_CLASSES - 1; offset < CLASS_OFFSET(c); c--)
+        ;
+    pool->free_slots[c] |= 1u << ((offset - CLASS_OFFSET(c)) / CLASS_SIZE(c));
+}
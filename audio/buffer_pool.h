@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_BUFFER_POOL_H
+#define AUDIO_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed pool of stream buffers, allocated once with the device.
+ *
+ * Buffers come in power of two size classes with a few slots each, so a
+ * request gets the smallest free slot that fits, rounded up to a power of
+ * two. When a class is exhausted or a request is larger than the biggest
+ * class the buffer is malloc()ed instead and counted in fallbacks; put()
+ * tells the two apart by address.
+ *
+ * The pool has no lock, callers serialize on the device mutex.
+ */
+#define BUFFER_POOL_MIN_SHIFT 8 /* 256 bytes */
+#define BUFFER_POOL_CLASSES 6   /* up to 8 KiB */
+#define BUFFER_POOL_SLOTS 4
+
+struct buffer_pool {
+    uint8_t *base;
+    size_t length;
+    uint32_t free_slots[BUFFER_POOL_CLASSES]; /* bit set when free */
+    unsigned int fallbacks;
+};
+
+int buffer_pool_init(struct buffer_pool *pool);
+void buffer_pool_release(struct buffer_pool *pool);
+
+/*
+ * Returns a buffer of at least bytes bytes, or NULL if it cannot be had.
+ * If size is not NULL it is set to the usable size of the buffer.
+ */
+void *buffer_pool_get(struct buffer_pool *pool, size_t bytes, size_t *size);
+
+/* Gives back a buffer from buffer_pool_get(), NULL is ignored */
+void buffer_pool_put(struct buffer_pool *pool, void *buf);
+
+#endif // AUDIO_BUFFER_POOL_H
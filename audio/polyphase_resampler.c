@@ -0,0 +1,391 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "polyphase_resampler.h"
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Filter design: a Kaiser windowed sinc spanning ZERO_CROSSINGS zero
+ * crossings on each side, cut off at CUTOFF of the lower Nyquist frequency
+ * so the transition band ends at Nyquist.
+ */
+#define ZERO_CROSSINGS 32
+#define CUTOFF 0.925
+#define KAISER_BETA 8.0
+
+/* Input frames buffered beyond the filter length */
+#define HISTORY_CHUNK 256
+
+struct polyphase_resampler {
+    struct resampler_itfe itfe; /* must be first */
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t channels;
+    uint32_t l;         /* phases, the interpolation factor */
+    uint32_t m;         /* the decimation factor */
+    uint32_t taps;      /* per phase, a multiple of 4 */
+    float *coefs;       /* l phases of taps */
+    float *history[2];  /* deinterleaved input, capacity frames each */
+    uint32_t capacity;
+    uint32_t frames;    /* valid frames in history */
+    uint32_t pos;       /* first frame of the next output's window */
+    uint32_t phase;
+    uint64_t frames_out;
+    uint64_t cpu_ns;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    uint32_t t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    int k;
+
+    for (k = 1; term > sum * 1e-12; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void design_filter(struct polyphase_resampler *pr, double cutoff)
+{
+    double center = pr->taps / 2 - 1;
+    double half = ZERO_CROSSINGS / cutoff;
+    double norm = bessel_i0(KAISER_BETA);
+    double sum;
+    double t;
+    double w;
+    double h;
+    float *coefs;
+    uint32_t p;
+    uint32_t k;
+
+    for (p = 0; p < pr->l; p++) {
+        coefs = pr->coefs + p * pr->taps;
+        sum = 0;
+
+        for (k = 0; k < pr->taps; k++) {
+            /* Distance in input frames from the output instant */
+            t = k - center - (double)p / pr->l;
+            if (fabs(t) >= half) {
+                coefs[k] = 0;
+                continue;
+            }
+            w = bessel_i0(KAISER_BETA * sqrt(1 - (t / half) * (t / half))) /
+                    norm;
+            h = t == 0 ? cutoff : sin(M_PI * cutoff * t) / (M_PI * t);
+            coefs[k] = h * w;
+            sum += coefs[k];
+        }
+
+        /* Unity gain at DC for every phase */
+        for (k = 0; k < pr->taps; k++)
+            coefs[k] /= sum;
+    }
+}
+
+static float dot(const float *x, const float *h, uint32_t n)
+{
+    float sum = 0;
+    uint32_t i = 0;
+
+#if defined(__ARM_NEON__)
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    float32x2_t s;
+
+    /* Two accumulators hide the multiply-accumulate latency */
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x + i), vld1q_f32(h + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(x + i + 4), vld1q_f32(h + i + 4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    for (; i + 4 <= n; i += 4)
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x + i), vld1q_f32(h + i));
+    s = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    sum = vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+
+    for (; i < n; i++)
+        sum += x[i] * h[i];
+
+    return sum;
+}
+
+static int16_t to_s16(float v)
+{
+    v += v < 0 ? -0.5f : 0.5f;
+    if (v >= 32767.0f)
+        return 32767;
+    if (v <= -32768.0f)
+        return -32768;
+    return (int16_t)v;
+}
+
+/* Makes room in the history and returns the number of frames that fit */
+static uint32_t history_space(struct polyphase_resampler *pr)
+{
+    uint32_t c;
+
+    if (pr->frames == pr->capacity) {
+        for (c = 0; c < pr->channels; c++)
+            memmove(pr->history[c], pr->history[c] + pr->pos,
+                    (pr->frames - pr->pos) * sizeof(float));
+        pr->frames -= pr->pos;
+        pr->pos = 0;
+    }
+
+    return pr->capacity - pr->frames;
+}
+
+static void history_append(struct polyphase_resampler *pr, const int16_t *src,
+                           uint32_t frames)
+{
+    uint32_t i;
+    uint32_t c;
+
+    for (c = 0; c < pr->channels; c++) {
+        float *dst = pr->history[c] + pr->frames;
+
+        for (i = 0; i < frames; i++)
+            dst[i] = src[i * pr->channels + c];
+    }
+    pr->frames += frames;
+}
+
+/* Produces output frames while the history holds a full window */
+static size_t filter_frames(struct polyphase_resampler *pr, int16_t *out,
+                            size_t count)
+{
+    size_t n = 0;
+    uint32_t c;
+
+    while (n < count && pr->pos + pr->taps <= pr->frames) {
+        const float *h = pr->coefs + pr->phase * pr->taps;
+
+        for (c = 0; c < pr->channels; c++)
+            out[n * pr->channels + c] =
+                    to_s16(dot(pr->history[c] + pr->pos, h, pr->taps));
+        n++;
+
+        pr->phase += pr->m;
+        pr->pos += pr->phase / pr->l;
+        pr->phase %= pr->l;
+    }
+
+    return n;
+}
+
+static void pr_reset(struct resampler_itfe *resampler)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+    uint32_t c;
+
+    /* Start with the first input frame at the center of the window */
+    pr->frames = pr->taps / 2 - 1;
+    pr->pos = 0;
+    pr->phase = 0;
+    for (c = 0; c < pr->channels; c++)
+        memset(pr->history[c], 0, pr->frames * sizeof(float));
+}
+
+static int pr_resample_from_input(struct resampler_itfe *resampler,
+                                  int16_t *in, size_t *in_count,
+                                  int16_t *out, size_t *out_count)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+    uint64_t start = thread_cpu_ns();
+    size_t consumed = 0;
+    size_t produced = 0;
+    size_t n;
+
+    if (!in || !in_count || !out || !out_count)
+        return -EINVAL;
+
+    for (;;) {
+        produced += filter_frames(pr, out + produced * pr->channels,
+                                  *out_count - produced);
+        if (produced == *out_count || consumed == *in_count)
+            break;
+
+        n = history_space(pr);
+        if (n > *in_count - consumed)
+            n = *in_count - consumed;
+        history_append(pr, in + consumed * pr->channels, n);
+        consumed += n;
+    }
+
+    *in_count = consumed;
+    *out_count = produced;
+    pr->frames_out += produced;
+    pr->cpu_ns += thread_cpu_ns() - start;
+
+    return 0;
+}
+
+static int pr_resample_from_provider(struct resampler_itfe *resampler,
+                                     int16_t *out, size_t *out_count)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+    struct resampler_buffer buf;
+    uint64_t start = thread_cpu_ns();
+    size_t produced = 0;
+    int ret = 0;
+
+    if (!pr->provider || !out || !out_count)
+        return -EINVAL;
+
+    for (;;) {
+        produced += filter_frames(pr, out + produced * pr->channels,
+                                  *out_count - produced);
+        if (produced == *out_count)
+            break;
+
+        buf.frame_count = history_space(pr);
+        ret = pr->provider->get_next_buffer(pr->provider, &buf);
+        if (ret != 0 || buf.raw == NULL || buf.frame_count == 0)
+            break;
+
+        history_append(pr, buf.i16, buf.frame_count);
+        pr->provider->release_buffer(pr->provider, &buf);
+    }
+
+    *out_count = produced;
+    pr->frames_out += produced;
+    pr->cpu_ns += thread_cpu_ns() - start;
+
+    return ret;
+}
+
+static int32_t pr_delay_ns(struct resampler_itfe *resampler)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+
+    /* Input frames buffered past the instant of the next output frame */
+    int64_t pending = (int64_t)pr->frames - pr->pos - (pr->taps / 2 - 1);
+
+    if (pending < 0)
+        pending = 0;
+
+    return pending * 1000000000 / pr->in_rate;
+}
+
+int create_polyphase_resampler(uint32_t in_rate, uint32_t out_rate,
+                               uint32_t channels,
+                               struct resampler_buffer_provider *provider,
+                               struct resampler_itfe **resampler)
+{
+    struct polyphase_resampler *pr;
+    double cutoff;
+    uint32_t g;
+    uint32_t c;
+
+    if (!resampler || in_rate == 0 || out_rate == 0 ||
+            channels < 1 || channels > 2)
+        return -EINVAL;
+
+    pr = calloc(1, sizeof(*pr));
+    if (!pr)
+        return -ENOMEM;
+
+    g = gcd(in_rate, out_rate);
+    pr->l = out_rate / g;
+    pr->m = in_rate / g;
+    pr->in_rate = in_rate;
+    pr->channels = channels;
+    pr->provider = provider;
+
+    /* Downsampling moves the cutoff below the output Nyquist frequency */
+    cutoff = CUTOFF * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+    pr->taps = 2 * (uint32_t)ceil(ZERO_CROSSINGS / cutoff);
+    pr->taps = (pr->taps + 3) & ~3u;
+    pr->capacity = pr->taps + HISTORY_CHUNK;
+
+    pr->coefs = malloc(pr->l * pr->taps * sizeof(float));
+    if (!pr->coefs)
+        goto err;
+    for (c = 0; c < channels; c++) {
+        pr->history[c] = malloc(pr->capacity * sizeof(float));
+        if (!pr->history[c])
+            goto err;
+    }
+
+    design_filter(pr, cutoff);
+
+    pr->itfe.reset = pr_reset;
+    pr->itfe.resample_from_provider = pr_resample_from_provider;
+    pr->itfe.resample_from_input = pr_resample_from_input;
+    pr->itfe.delay_ns = pr_delay_ns;
+    pr_reset(&pr->itfe);
+
+    *resampler = &pr->itfe;
+    return 0;
+
+err:
+    release_polyphase_resampler(&pr->itfe);
+    return -ENOMEM;
+}
+
+void release_polyphase_resampler(struct resampler_itfe *resampler)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+
+    if (!pr)
+        return;
+
+    free(pr->history[0]);
+    free(pr->history[1]);
+    free(pr->coefs);
+    free(pr);
+}
+
+void polyphase_resampler_get_stats(struct resampler_itfe *resampler,
+                                   uint64_t *frames, uint64_t *cpu_ns)
+{
+    struct polyphase_resampler *pr = (struct polyphase_resampler *)resampler;
+
+    *frames = pr->frames_out;
+    *cpu_ns = pr->cpu_ns;
+}
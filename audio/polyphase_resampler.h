@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_POLYPHASE_RESAMPLER_H
+#define AUDIO_POLYPHASE_RESAMPLER_H
+
+#include <stdint.h>
+
+#include <audio_utils/resampler.h>
+
+/*
+ * Windowed sinc polyphase resampler for 16 bit audio with one or two
+ * channels, behind the libaudioutils resampler interface so it can be used
+ * in place of the speex based one.
+ *
+ * The ratio is reduced to L/M and the filter is stored as L phases of
+ * taps, so each output frame is a single dot product per channel, done with
+ * NEON when available. The response is flat to 80% of the lower Nyquist
+ * frequency and aliases are attenuated by more than 85 dB.
+ */
+
+int create_polyphase_resampler(uint32_t in_rate, uint32_t out_rate,
+                               uint32_t channels,
+                               struct resampler_buffer_provider *provider,
+                               struct resampler_itfe **resampler);
+
+void release_polyphase_resampler(struct resampler_itfe *resampler);
+
+/* Output frames produced and thread CPU time spent since creation */
+void polyphase_resampler_get_stats(struct resampler_itfe *resampler,
+                                   uint64_t *frames, uint64_t *cpu_ns);
+
+#endif // AUDIO_POLYPHASE_RESAMPLER_H
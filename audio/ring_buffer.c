@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "ring_buffer.h"
+
+int ring_buffer_init(struct ring_buffer *rb, int16_t *data, uint32_t size)
+{
+    if (!data || size == 0 || (size & (size - 1)))
+        return -EINVAL;
+
+    rb->data = data;
+    rb->size = size;
+    ring_buffer_reset(rb);
+
+    return 0;
+}
+
+void ring_buffer_reset(struct ring_buffer *rb)
+{
+    atomic_store(&rb->rd, 0);
+    atomic_store(&rb->wr, 0);
+}
+
+uint32_t ring_buffer_available(struct ring_buffer *rb)
+{
+    return atomic_load_explicit(&rb->wr, memory_order_acquire) -
+           atomic_load_explicit(&rb->rd, memory_order_acquire);
+}
+
+/* Copies count samples between the ring at index pos and buf */
+static void ring_copy(struct ring_buffer *rb, uint32_t pos, int16_t *buf,
+                      uint32_t count, int to_ring)
+{
+    uint32_t offset = pos & (rb->size - 1);
+    uint32_t first = rb->size - offset;
+
+    if (first > count)
+        first = count;
+
+    if (to_ring) {
+        memcpy(rb->data + offset, buf, first * sizeof(int16_t));
+        memcpy(rb->data, buf + first, (count - first) * sizeof(int16_t));
+    } else {
+        memcpy(buf, rb->data + offset, first * sizeof(int16_t));
+        memcpy(buf + first, rb->data, (count - first) * sizeof(int16_t));
+    }
+}
+
+uint32_t ring_buffer_write(struct ring_buffer *rb, const int16_t *src,
+                           uint32_t count)
+{
+    uint32_t wr = atomic_load_explicit(&rb->wr, memory_order_relaxed);
+    uint32_t rd = atomic_load_explicit(&rb->rd, memory_order_acquire);
+    uint32_t space = rb->size - (wr - rd);
+
+    if (count > space)
+        count = space;
+
+    ring_copy(rb, wr, (int16_t *)src, count, 1);
+
+    /* Publish the samples only after they have been copied */
+    atomic_store_explicit(&rb->wr, wr + count, memory_order_release);
+
+    return count;
+}
+
+uint32_t ring_buffer_read(struct ring_buffer *rb, int16_t *dst,
+                          uint32_t count)
+{
+    uint32_t rd = atomic_load_explicit(&rb->rd, memory_order_relaxed);
+    uint32_t wr = atomic_load_explicit(&rb->wr, memory_order_acquire);
+    uint32_t avail = wr - rd;
+
+    if (count > avail)
+        count = avail;
+
+    ring_copy(rb, rd, dst, count, 0);
+
+    /* Hand the space back only after the samples have been copied out */
+    atomic_store_explicit(&rb->rd, rd + count, memory_order_release);
+
+    return count;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_RING_BUFFER_H
+#define AUDIO_RING_BUFFER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Single producer, single consumer ring of 16 bit samples.
+ *
+ * One thread may write and one other thread may read concurrently without
+ * a lock. The indices run freely and are masked on access, so the size must
+ * be a power of two and the full size is usable.
+ */
+struct ring_buffer {
+    int16_t *data;
+    uint32_t size;
+    atomic_uint_least32_t rd;
+    atomic_uint_least32_t wr;
+};
+
+/* Sets up a ring over storage owned by the caller, size is in samples */
+int ring_buffer_init(struct ring_buffer *rb, int16_t *data, uint32_t size);
+
+/* Empties the ring; neither side may be using it */
+void ring_buffer_reset(struct ring_buffer *rb);
+
+/* Number of samples that can be read */
+uint32_t ring_buffer_available(struct ring_buffer *rb);
+
+/* Producer side: writes up to count samples, returns the number written */
+uint32_t ring_buffer_write(struct ring_buffer *rb, const int16_t *src,
+                           uint32_t count);
+
+/* Consumer side: reads up to count samples, returns the number read */
+uint32_t ring_buffer_read(struct ring_buffer *rb, int16_t *dst,
+                          uint32_t count);
+
+#endif // AUDIO_RING_BUFFER_H
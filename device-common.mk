@@ -57,7 +57,8 @@ PRODUCT_COPY_FILES += \
 PRODUCT_PACKAGES += \
     keystore.grouper \
     lights.grouper \
-    power.grouper
+    power.grouper \
+    power_profiles.bin
 
 # HW-specific features
 PRODUCT_COPY_FILES += \
@@ -38,5 +38,33 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+
+# Host benchmark of the HAL against a software PKCS#11, see bench/keymaster_bench.cpp
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := keymaster_bench
+
+LOCAL_SRC_FILES := \
+	bench/keymaster_bench.cpp \
+	bench/soft_pkcs11.cpp
+
+LOCAL_C_INCLUDES := \
+	libcore/include \
+	$(LOCAL_PATH)/../security/tf_sdk/include
+
+# The HAL packs sizes into 32 bit CK_ULONGs, and s_type.h only takes the
+# integer types from <stdint.h> when building for Android
+LOCAL_MULTILIB := 32
+LOCAL_CFLAGS := -DANDROID -Wall
+
+LOCAL_SHARED_LIBRARIES := libcrypto-host
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
 endif
 endif
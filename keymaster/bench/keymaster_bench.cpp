@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * keymaster_bench: runs keymaster_grouper.cpp on the host against the
+ * OpenSSL backed PKCS#11 of soft_pkcs11.cpp, and reports how many keymaster
+ * calls of each kind complete per second with 1 up to N threads calling.
+ *
+ * keymaster_grouper.cpp is included rather than linked, as audio_hw_bench
+ * does with audio_hw.c, so its properties can be set from the command line
+ * and its key cache read directly.
+ *
+ * usage: keymaster_bench [-t threads] [-d seconds] [-l us] [-P] [-b bits]
+ *                        [-e] [-o ops] [-p name=value]...
+ *   -t  run with 1 up to this many threads, default 4
+ *   -d  run time of each operation and thread count, default 1 second
+ *   -l  world switch time of each PKCS#11 call, default 20 us
+ *   -P  let PKCS#11 calls run in parallel rather than one at a time
+ *   -b  RSA modulus size, default 2048
+ *   -e  use P-256 keys instead of RSA
+ *   -o  comma separated operations, default generate,import,sign,verify,export
+ *   -p  set a property, e.g. -p ro.keymaster.rsa_stock=2
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <vector>
+
+#include <cutils/properties.h>
+
+static int32_t bench_property_get_int32(const char* key, int32_t default_value);
+
+#define property_get_int32 bench_property_get_int32
+
+// The HAL logs every call verbosely, which would be measured along with it
+#define LOG_NDEBUG 0
+#define LOG_TAG "TEEKeyMaster"
+#include <cutils/log.h>
+#undef ALOGV
+#define ALOGV(...) do { if (0) { ALOG(LOG_VERBOSE, LOG_TAG, __VA_ARGS__); } } while (0)
+
+#include "../keymaster_grouper.cpp"
+
+#undef property_get_int32
+
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+#include "soft_pkcs11.h"
+
+#define MAX_PROPERTIES 16
+#define MAX_THREADS 64
+
+enum bench_op {
+    OP_GENERATE,
+    OP_IMPORT,
+    OP_SIGN,
+    OP_VERIFY,
+    OP_EXPORT,
+    OP_COUNT,
+};
+
+static const char* const op_names[OP_COUNT] = {
+    "generate", "import", "sign", "verify", "export",
+};
+
+struct BIGNUM_Delete {
+    void operator()(BIGNUM* p) const {
+        BN_free(p);
+    }
+};
+typedef UniquePtr<BIGNUM, BIGNUM_Delete> Unique_BIGNUM;
+
+struct key_blob {
+    uint8_t* data;
+    size_t length;
+};
+
+struct worker {
+    pthread_t thread;
+    bench_op op;
+    uint64_t ops;
+    uint64_t failures;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    std::vector<key_blob> created;
+};
+
+static keymaster0_device_t* km;
+static double duration = 1.0;
+static bool use_ec;
+static uint32_t modulus_bits = 2048;
+static std::atomic<bool> stop;
+
+/* What the timed calls work with, prepared before they start */
+static key_blob key;
+static std::vector<uint8_t> pkcs8;
+static std::vector<uint8_t> data;
+static std::vector<uint8_t> signature;
+
+static struct {
+    char name[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+} properties[MAX_PROPERTIES];
+static int num_properties;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int32_t bench_property_get_int32(const char* key, int32_t default_value) {
+    for (int i = 0; i < num_properties; i++) {
+        if (strcmp(properties[i].name, key) == 0) {
+            return (int32_t) strtol(properties[i].value, NULL, 0);
+        }
+    }
+    return default_value;
+}
+
+static int add_property(const char* arg) {
+    const char* eq = strchr(arg, '=');
+
+    if (eq == NULL || num_properties == MAX_PROPERTIES || eq - arg >= PROPERTY_KEY_MAX) {
+        return -1;
+    }
+
+    memcpy(properties[num_properties].name, arg, eq - arg);
+    strncpy(properties[num_properties].value, eq + 1, PROPERTY_VALUE_MAX - 1);
+    num_properties++;
+    return 0;
+}
+
+static int generate(key_blob* blob) {
+    if (use_ec) {
+        keymaster_ec_keygen_params_t params = { 256 };
+        return km->generate_keypair(km, TYPE_EC, &params, &blob->data, &blob->length);
+    }
+
+    keymaster_rsa_keygen_params_t params = { modulus_bits, RSA_F4 };
+    return km->generate_keypair(km, TYPE_RSA, &params, &blob->data, &blob->length);
+}
+
+static int sign(uint8_t** out, size_t* out_length) {
+    keymaster_rsa_sign_params_t rsa_params = { DIGEST_NONE, PADDING_NONE };
+    keymaster_ec_sign_params_t ec_params = { DIGEST_NONE };
+    const void* params = use_ec ? (const void*) &ec_params : (const void*) &rsa_params;
+
+    return km->sign_data(km, params, key.data, key.length, &data[0], data.size(),
+            out, out_length);
+}
+
+static int run_op(worker* w) {
+    key_blob blob;
+    uint8_t* out;
+    size_t out_length;
+    int ret;
+
+    switch (w->op) {
+    case OP_GENERATE:
+        ret = generate(&blob);
+        if (ret == 0) {
+            w->created.push_back(blob);
+        }
+        return ret;
+    case OP_IMPORT:
+        ret = km->import_keypair(km, &pkcs8[0], pkcs8.size(), &blob.data, &blob.length);
+        if (ret == 0) {
+            w->created.push_back(blob);
+        }
+        return ret;
+    case OP_SIGN:
+        ret = sign(&out, &out_length);
+        if (ret == 0) {
+            delete[] out;
+        }
+        return ret;
+    case OP_VERIFY: {
+        keymaster_rsa_sign_params_t rsa_params = { DIGEST_NONE, PADDING_NONE };
+        keymaster_ec_sign_params_t ec_params = { DIGEST_NONE };
+        const void* params = use_ec ? (const void*) &ec_params : (const void*) &rsa_params;
+        return km->verify_data(km, params, key.data, key.length, &data[0], data.size(),
+                &signature[0], signature.size());
+    }
+    case OP_EXPORT:
+        ret = km->get_keypair_public(km, key.data, key.length, &out, &out_length);
+        if (ret == 0) {
+            free(out);
+        }
+        return ret;
+    default:
+        return -1;
+    }
+}
+
+static void* worker_loop(void* arg) {
+    worker* w = static_cast<worker*>(arg);
+
+    while (!stop) {
+        uint64_t start = now_ns();
+        int ret = run_op(w);
+        uint64_t elapsed = now_ns() - start;
+
+        if (ret != 0) {
+            w->failures++;
+            continue;
+        }
+        w->ops++;
+        w->total_ns += elapsed;
+        if (elapsed > w->max_ns) {
+            w->max_ns = elapsed;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t total_calls() {
+    uint64_t calls[SOFT_C_COUNT];
+    uint64_t total = 0;
+
+    soft_pkcs11_get_calls(calls);
+    for (int i = 0; i < SOFT_C_COUNT; i++) {
+        total += calls[i];
+    }
+    return total;
+}
+
+static void run(bench_op op, int num_threads) {
+    worker workers[MAX_THREADS];
+    uint64_t ops = 0, failures = 0, total_ns = 0, max_ns = 0;
+
+    uint64_t calls = total_calls();
+    uint64_t start = now_ns();
+    stop = false;
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].op = op;
+        workers[i].ops = 0;
+        workers[i].failures = 0;
+        workers[i].total_ns = 0;
+        workers[i].max_ns = 0;
+        pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+    }
+
+    usleep(duration * 1000000);
+    stop = true;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    // The calls in flight at the stop finish late; count the time they took
+    double elapsed = (now_ns() - start) / 1e9;
+    calls = total_calls() - calls;
+
+    for (int i = 0; i < num_threads; i++) {
+        ops += workers[i].ops;
+        failures += workers[i].failures;
+        total_ns += workers[i].total_ns;
+        if (workers[i].max_ns > max_ns) {
+            max_ns = workers[i].max_ns;
+        }
+
+        // Outside the counts above, so the token does not grow from run to run
+        for (size_t j = 0; j < workers[i].created.size(); j++) {
+            key_blob& blob = workers[i].created[j];
+            km->delete_keypair(km, blob.data, blob.length);
+            delete[] blob.data;
+        }
+    }
+
+    printf("  %7d %10.1f %9.3f %9.3f %10.1f", num_threads, ops / elapsed,
+            ops ? total_ns / 1e6 / ops : 0.0, max_ns / 1e6,
+            ops ? (double) calls / ops : 0.0);
+    if (failures) {
+        printf("  (%llu failed)", (unsigned long long) failures);
+    }
+    printf("\n");
+}
+
+/** Prepares a key, the data to sign and a signature, and a key to import */
+static int prepare() {
+    if (generate(&key) != 0) {
+        fprintf(stderr, "cannot generate the key to use\n");
+        return -1;
+    }
+
+    Unique_EVP_PKEY pkey(EVP_PKEY_new());
+    if (use_ec) {
+        Unique_EC_KEY ec(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+        if (ec.get() == NULL || !EC_KEY_generate_key(ec.get())
+                || !EVP_PKEY_assign_EC_KEY(pkey.get(), ec.get())) {
+            return -1;
+        }
+        OWNERSHIP_TRANSFERRED(ec);
+        data.resize(P256_LENGTH);
+    } else {
+        Unique_RSA rsa(RSA_new());
+        Unique_BIGNUM exponent(BN_new());
+        if (rsa.get() == NULL || exponent.get() == NULL || !BN_set_word(exponent.get(), RSA_F4)
+                || !RSA_generate_key_ex(rsa.get(), modulus_bits, exponent.get(), NULL)
+                || !EVP_PKEY_assign_RSA(pkey.get(), rsa.get())) {
+            return -1;
+        }
+        OWNERSHIP_TRANSFERRED(rsa);
+        data.resize(modulus_bits / 8);
+    }
+
+    Unique_PKCS8_PRIV_KEY_INFO info(EVP_PKEY2PKCS8(pkey.get()));
+    int len = i2d_PKCS8_PRIV_KEY_INFO(info.get(), NULL);
+    if (len <= 0) {
+        return -1;
+    }
+    pkcs8.resize(len);
+    unsigned char* p = &pkcs8[0];
+    i2d_PKCS8_PRIV_KEY_INFO(info.get(), &p);
+
+    // Raw RSA signs a padded digest, which must be smaller than the modulus
+    RAND_bytes(&data[0], data.size());
+    data[0] = 0;
+
+    uint8_t* out;
+    size_t out_length;
+    if (sign(&out, &out_length) != 0) {
+        fprintf(stderr, "cannot sign with the key\n");
+        return -1;
+    }
+    signature.assign(out, out + out_length);
+    delete[] out;
+
+    return 0;
+}
+
+static int parse_ops(const char* arg, bool ops[OP_COUNT]) {
+    char* copy = strdup(arg);
+    char* saveptr;
+
+    memset(ops, 0, OP_COUNT * sizeof(ops[0]));
+    for (char* name = strtok_r(copy, ",", &saveptr); name != NULL;
+            name = strtok_r(NULL, ",", &saveptr)) {
+        int i;
+        for (i = 0; i < OP_COUNT; i++) {
+            if (strcmp(name, op_names[i]) == 0) {
+                ops[i] = true;
+                break;
+            }
+        }
+        if (i == OP_COUNT) {
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-l us] [-P] [-b bits] [-e] "
+            "[-o ops] [-p name=value]...\n", name);
+}
+
+int main(int argc, char** argv) {
+    bool ops[OP_COUNT] = { true, true, true, true, true };
+    int max_threads = 4;
+    hw_device_t* device;
+    int opt;
+
+    soft_pkcs11_switch_us = 20;
+
+    while ((opt = getopt(argc, argv, "t:d:l:Pb:eo:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'l':
+            soft_pkcs11_switch_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            soft_pkcs11_serialize = false;
+            break;
+        case 'b':
+            modulus_bits = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            use_ec = true;
+            break;
+        case 'o':
+            if (parse_ops(optarg, ops) == 0)
+                break;
+            usage(argv[0]);
+            return 1;
+        case 'p':
+            if (add_property(optarg) == 0)
+                break;
+            // fall through
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (max_threads < 1 || max_threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+
+    if (HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            KEYSTORE_KEYMASTER, &device) != 0) {
+        fprintf(stderr, "cannot open the HAL\n");
+        return 1;
+    }
+    km = reinterpret_cast<keymaster0_device_t*>(device);
+
+    if (prepare() != 0) {
+        fprintf(stderr, "cannot prepare the keys\n");
+        device->close(device);
+        return 1;
+    }
+
+    printf("%s keys, %u us per PKCS#11 call, %s\n",
+            use_ec ? "P-256" : "RSA", soft_pkcs11_switch_us,
+            soft_pkcs11_serialize ? "serialized" : "in parallel");
+    if (!use_ec) {
+        printf("modulus %u bits\n", modulus_bits);
+    }
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!ops[op]) {
+            continue;
+        }
+        printf("\n%s\n  threads      ops/s   mean ms    max ms   calls/op\n", op_names[op]);
+        for (int threads = 1; threads <= max_threads; threads++) {
+            run(static_cast<bench_op>(op), threads);
+        }
+    }
+
+    uint64_t hits, misses;
+    get_context(km)->keys.getStats(&hits, &misses);
+    printf("\nkey cache: %llu hits, %llu misses\n", (unsigned long long) hits,
+            (unsigned long long) misses);
+
+    uint64_t calls[SOFT_C_COUNT];
+    soft_pkcs11_get_calls(calls);
+    printf("PKCS#11 calls:");
+    for (int i = 0; i < SOFT_C_COUNT; i++) {
+        printf(" %s=%llu", soft_pkcs11_call_names[i], (unsigned long long) calls[i]);
+    }
+    printf("\n");
+
+    km->delete_keypair(km, key.data, key.length);
+    delete[] key.data;
+    device->close(device);
+
+    printf("objects left: %u\n", soft_pkcs11_get_objects());
+
+    return 0;
+}
@@ -0,0 +1,1059 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rsa.h>
+
+#include <cryptoki.h>
+#include <pkcs11.h>
+
+#include "soft_pkcs11.h"
+
+const char* const soft_pkcs11_call_names[SOFT_C_COUNT] = {
+    "OpenSession",
+    "CloseSession",
+    "CreateObject",
+    "CopyObject",
+    "DestroyObject",
+    "CloseObjectHandle",
+    "GetAttributeValue",
+    "FindObjects",
+    "GenerateKeyPair",
+    "Sign",
+    "Verify",
+    "other",
+};
+
+unsigned int soft_pkcs11_switch_us = 0;
+bool soft_pkcs11_serialize = true;
+
+/** The DER encoded OID of prime256v1, the only curve supported */
+static const CK_BYTE P256_PARAMS[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07,
+};
+
+#define P256_LENGTH 32
+
+typedef std::vector<CK_BYTE> Bytes;
+
+/** Key material, shared by the objects of a keypair and their copies */
+struct Key {
+    RSA* rsa;
+    EC_KEY* ec;
+};
+
+static void key_ref(const Key& key) {
+    if (key.rsa != NULL) {
+        RSA_up_ref(key.rsa);
+    }
+    if (key.ec != NULL) {
+        EC_KEY_up_ref(key.ec);
+    }
+}
+
+static void key_unref(const Key& key) {
+    RSA_free(key.rsa);
+    EC_KEY_free(key.ec);
+}
+
+struct Object {
+    CK_OBJECT_CLASS objClass;
+    CK_KEY_TYPE keyType;
+    CK_BBOOL token;
+    /** The primary session a session object dies with */
+    CK_SESSION_HANDLE owner;
+    Bytes id;
+    Key key;
+};
+
+struct Operation {
+    bool active;
+    CK_MECHANISM_TYPE mechanism;
+    CK_ULONG object;
+};
+
+struct Session {
+    /** Itself for a primary session */
+    CK_SESSION_HANDLE primary;
+    bool finding;
+    std::vector<CK_ULONG> found;
+    Operation sign;
+    Operation verify;
+};
+
+struct Handle {
+    CK_SESSION_HANDLE primary;
+    CK_ULONG object;
+};
+
+/** Held for a whole call when calls are serialized */
+static pthread_mutex_t gWorldLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Guards the state below; never held across key generation or signing */
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool gInitialized;
+static std::map<CK_ULONG, Object> gObjects;
+static std::map<CK_OBJECT_HANDLE, Handle> gHandles;
+static std::map<CK_SESSION_HANDLE, Session> gSessions;
+/** Objects, handles and sessions share one counter, so none is reused */
+static CK_ULONG gNextId = 1;
+static uint64_t gCalls[SOFT_C_COUNT];
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Accounts for one call and models the world switch. The switch keeps the
+ * core busy, so it spins rather than sleeps.
+ */
+class WorldSwitch {
+public:
+    WorldSwitch(soft_pkcs11_call call) : mSerialized(soft_pkcs11_serialize) {
+        if (mSerialized) {
+            pthread_mutex_lock(&gWorldLock);
+        }
+
+        uint64_t end = now_ns() + soft_pkcs11_switch_us * 1000ULL;
+        while (now_ns() < end) {
+        }
+
+        pthread_mutex_lock(&gLock);
+        gCalls[call]++;
+        pthread_mutex_unlock(&gLock);
+    }
+
+    ~WorldSwitch() {
+        if (mSerialized) {
+            pthread_mutex_unlock(&gWorldLock);
+        }
+    }
+
+private:
+    bool mSerialized;
+};
+
+/** Holds gLock for a scope */
+class StateLock {
+public:
+    StateLock() {
+        pthread_mutex_lock(&gLock);
+    }
+
+    ~StateLock() {
+        pthread_mutex_unlock(&gLock);
+    }
+};
+
+void soft_pkcs11_get_calls(uint64_t calls[SOFT_C_COUNT]) {
+    StateLock lock;
+    memcpy(calls, gCalls, sizeof(gCalls));
+}
+
+unsigned int soft_pkcs11_get_objects() {
+    StateLock lock;
+    return gObjects.size();
+}
+
+/*
+ * State lookups; gLock must be held.
+ */
+static Session* find_session(CK_SESSION_HANDLE hSession) {
+    std::map<CK_SESSION_HANDLE, Session>::iterator it = gSessions.find(hSession);
+    return it == gSessions.end() ? NULL : &it->second;
+}
+
+static bool is_open_handle(const Session* session, CK_OBJECT_HANDLE hObject) {
+    std::map<CK_OBJECT_HANDLE, Handle>::iterator it = gHandles.find(hObject);
+    return it != gHandles.end() && it->second.primary == session->primary;
+}
+
+/** Returns the object behind a handle, or 0 if either is gone */
+static CK_ULONG find_object(const Session* session, CK_OBJECT_HANDLE hObject) {
+    if (!is_open_handle(session, hObject)) {
+        return 0;
+    }
+    CK_ULONG object = gHandles[hObject].object;
+    return gObjects.count(object) != 0 ? object : 0;
+}
+
+static CK_OBJECT_HANDLE new_handle(const Session* session, CK_ULONG object) {
+    CK_OBJECT_HANDLE handle = gNextId++;
+    Handle& h = gHandles[handle];
+    h.primary = session->primary;
+    h.object = object;
+    return handle;
+}
+
+static CK_ULONG new_object(const Session* session, const Object& object) {
+    CK_ULONG id = gNextId++;
+    Object& o = gObjects[id];
+    o = object;
+    o.owner = object.token ? 0 : session->primary;
+    return id;
+}
+
+/**
+ * Destroys an object. Its handles stay allocated until they are closed, as
+ * the HAL closes the handles of the objects it deletes.
+ */
+static void destroy_object(CK_ULONG id) {
+    key_unref(gObjects[id].key);
+    gObjects.erase(id);
+}
+
+/** Closes a primary session with its sub-sessions, handles and session objects */
+static void close_primary(CK_SESSION_HANDLE primary) {
+    std::map<CK_SESSION_HANDLE, Session>::iterator it = gSessions.begin();
+    while (it != gSessions.end()) {
+        if (it->second.primary == primary) {
+            gSessions.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    std::map<CK_OBJECT_HANDLE, Handle>::iterator h = gHandles.begin();
+    while (h != gHandles.end()) {
+        if (h->second.primary == primary) {
+            gHandles.erase(h++);
+        } else {
+            ++h;
+        }
+    }
+
+    std::vector<CK_ULONG> owned;
+    for (std::map<CK_ULONG, Object>::iterator o = gObjects.begin(); o != gObjects.end(); ++o) {
+        if (o->second.owner == primary) {
+            owned.push_back(o->first);
+        }
+    }
+    for (size_t i = 0; i < owned.size(); i++) {
+        destroy_object(owned[i]);
+    }
+}
+
+/*
+ * Templates and attributes
+ */
+static const CK_ATTRIBUTE* find_attribute(const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount,
+        CK_ATTRIBUTE_TYPE type) {
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        if (pTemplate[i].type == type) {
+            return &pTemplate[i];
+        }
+    }
+    return NULL;
+}
+
+static BIGNUM* attribute_to_bignum(const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount,
+        CK_ATTRIBUTE_TYPE type) {
+    const CK_ATTRIBUTE* attribute = find_attribute(pTemplate, ulCount, type);
+    if (attribute == NULL) {
+        return NULL;
+    }
+    return BN_bin2bn(static_cast<const unsigned char*>(attribute->pValue),
+            attribute->ulValueLen, NULL);
+}
+
+/** Applies the CKA_ID and CKA_TOKEN of a template */
+static void apply_common(const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount, Object* object) {
+    const CK_ATTRIBUTE* id = find_attribute(pTemplate, ulCount, CKA_ID);
+    if (id != NULL) {
+        const CK_BYTE* p = static_cast<const CK_BYTE*>(id->pValue);
+        object->id.assign(p, p + id->ulValueLen);
+    }
+
+    const CK_ATTRIBUTE* token = find_attribute(pTemplate, ulCount, CKA_TOKEN);
+    if (token != NULL && token->ulValueLen == sizeof(CK_BBOOL)) {
+        object->token = *static_cast<const CK_BBOOL*>(token->pValue);
+    }
+}
+
+static bool is_p256(const CK_ATTRIBUTE* params) {
+    return params != NULL && params->ulValueLen == sizeof(P256_PARAMS)
+            && memcmp(params->pValue, P256_PARAMS, sizeof(P256_PARAMS)) == 0;
+}
+
+static void append_bignum(const BIGNUM* bn, Bytes* value) {
+    size_t offset = value->size();
+    value->resize(offset + BN_num_bytes(bn));
+    BN_bn2bin(bn, &(*value)[offset]);
+}
+
+template <typename T>
+static void append_scalar(const T& scalar, Bytes* value) {
+    const CK_BYTE* p = reinterpret_cast<const CK_BYTE*>(&scalar);
+    value->insert(value->end(), p, p + sizeof(scalar));
+}
+
+/** Encodes an attribute of an object as C_GetAttributeValue returns it */
+static CK_RV get_attribute(const Object& object, CK_ATTRIBUTE_TYPE type, Bytes* value) {
+    bool isPublic = object.objClass == CKO_PUBLIC_KEY;
+
+    value->clear();
+    switch (type) {
+    case CKA_CLASS:
+        append_scalar(object.objClass, value);
+        return CKR_OK;
+    case CKA_KEY_TYPE:
+        append_scalar(object.keyType, value);
+        return CKR_OK;
+    case CKA_TOKEN:
+        append_scalar(object.token, value);
+        return CKR_OK;
+    case CKA_ID:
+        *value = object.id;
+        return CKR_OK;
+    case CKA_MODULUS:
+    case CKA_PUBLIC_EXPONENT:
+        if (object.keyType != CKK_RSA) {
+            break;
+        }
+        append_bignum(type == CKA_MODULUS ? object.key.rsa->n : object.key.rsa->e, value);
+        return CKR_OK;
+    case CKA_EC_PARAMS:
+        if (object.keyType != CKK_EC) {
+            break;
+        }
+        value->assign(P256_PARAMS, P256_PARAMS + sizeof(P256_PARAMS));
+        return CKR_OK;
+    case CKA_EC_POINT: {
+        if (object.keyType != CKK_EC || !isPublic) {
+            break;
+        }
+        // A DER OCTET STRING around the uncompressed point
+        value->resize(2 + 1 + 2 * P256_LENGTH);
+        (*value)[0] = 0x04;
+        (*value)[1] = value->size() - 2;
+        EC_POINT_point2oct(EC_KEY_get0_group(object.key.ec),
+                EC_KEY_get0_public_key(object.key.ec), POINT_CONVERSION_UNCOMPRESSED,
+                &(*value)[2], value->size() - 2, NULL);
+        return CKR_OK;
+    }
+    case CKA_PRIVATE_EXPONENT:
+    case CKA_PRIME_1:
+    case CKA_PRIME_2:
+    case CKA_EXPONENT_1:
+    case CKA_EXPONENT_2:
+    case CKA_COEFFICIENT:
+    case CKA_VALUE:
+        if (isPublic) {
+            break;
+        }
+        return CKR_ATTRIBUTE_SENSITIVE;
+    }
+    return CKR_ATTRIBUTE_TYPE_INVALID;
+}
+
+static bool matches(const Object& object, const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount) {
+    Bytes value;
+
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        if (get_attribute(object, pTemplate[i].type, &value) != CKR_OK
+                || value.size() != pTemplate[i].ulValueLen
+                || memcmp(&value[0], pTemplate[i].pValue, value.size()) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Key construction, outside gLock
+ */
+static CK_RV create_rsa(const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount, bool isPrivate,
+        Key* key) {
+    RSA* rsa = RSA_new();
+    if (rsa == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    rsa->n = attribute_to_bignum(pTemplate, ulCount, CKA_MODULUS);
+    rsa->e = attribute_to_bignum(pTemplate, ulCount, CKA_PUBLIC_EXPONENT);
+    if (isPrivate) {
+        rsa->d = attribute_to_bignum(pTemplate, ulCount, CKA_PRIVATE_EXPONENT);
+        rsa->p = attribute_to_bignum(pTemplate, ulCount, CKA_PRIME_1);
+        rsa->q = attribute_to_bignum(pTemplate, ulCount, CKA_PRIME_2);
+        rsa->dmp1 = attribute_to_bignum(pTemplate, ulCount, CKA_EXPONENT_1);
+        rsa->dmq1 = attribute_to_bignum(pTemplate, ulCount, CKA_EXPONENT_2);
+        rsa->iqmp = attribute_to_bignum(pTemplate, ulCount, CKA_COEFFICIENT);
+    }
+
+    if (rsa->n == NULL || rsa->e == NULL || (isPrivate && rsa->d == NULL)) {
+        RSA_free(rsa);
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+
+    key->rsa = rsa;
+    return CKR_OK;
+}
+
+static CK_RV create_ec(const CK_ATTRIBUTE* pTemplate, CK_ULONG ulCount, bool isPrivate,
+        Key* key) {
+    if (!is_p256(find_attribute(pTemplate, ulCount, CKA_EC_PARAMS))) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    EC_KEY* ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (ec == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+    const EC_GROUP* group = EC_KEY_get0_group(ec);
+
+    CK_RV rv = CKR_OK;
+    if (isPrivate) {
+        BIGNUM* value = attribute_to_bignum(pTemplate, ulCount, CKA_VALUE);
+        EC_POINT* point = EC_POINT_new(group);
+        if (value == NULL) {
+            rv = CKR_TEMPLATE_INCOMPLETE;
+        } else if (point == NULL
+                || !EC_POINT_mul(group, point, value, NULL, NULL, NULL)
+                || !EC_KEY_set_private_key(ec, value)
+                || !EC_KEY_set_public_key(ec, point)) {
+            rv = CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        EC_POINT_free(point);
+        BN_clear_free(value);
+    } else {
+        const CK_ATTRIBUTE* point = find_attribute(pTemplate, ulCount, CKA_EC_POINT);
+        if (point == NULL) {
+            rv = CKR_TEMPLATE_INCOMPLETE;
+        } else {
+            const unsigned char* p = static_cast<const unsigned char*>(point->pValue);
+            long length = point->ulValueLen;
+            if (length > 2 && p[0] == 0x04 && p[1] == length - 2) {
+                p += 2;
+                length -= 2;
+            }
+            if (o2i_ECPublicKey(&ec, &p, length) == NULL) {
+                rv = CKR_ATTRIBUTE_VALUE_INVALID;
+            }
+        }
+    }
+
+    if (rv != CKR_OK) {
+        EC_KEY_free(ec);
+        return rv;
+    }
+    key->ec = ec;
+    return CKR_OK;
+}
+
+/*
+ * General purpose
+ */
+CK_RV PKCS11_EXPORT C_Initialize(void* pInitArgs) {
+    WorldSwitch call(SOFT_C_OTHER);
+    StateLock lock;
+
+    if (gInitialized) {
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+    gInitialized = true;
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_Finalize(void* pReserved) {
+    WorldSwitch call(SOFT_C_OTHER);
+    StateLock lock;
+
+    if (!gInitialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    while (!gSessions.empty()) {
+        close_primary(gSessions.begin()->second.primary);
+    }
+    gInitialized = false;
+    return CKR_OK;
+}
+
+static void copy_padded(CK_UTF8CHAR* dst, size_t size, const char* src) {
+    memset(dst, ' ', size);
+    memcpy(dst, src, strlen(src) < size ? strlen(src) : size);
+}
+
+CK_RV PKCS11_EXPORT C_GetInfo(CK_INFO* pInfo) {
+    WorldSwitch call(SOFT_C_OTHER);
+
+    if (pInfo == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->cryptokiVersion.major = 2;
+    pInfo->cryptokiVersion.minor = 20;
+    copy_padded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "LineageOS");
+    copy_padded(pInfo->libraryDescription, sizeof(pInfo->libraryDescription),
+            "soft_pkcs11 benchmark stand-in");
+    pInfo->libraryVersion.major = 1;
+    return CKR_OK;
+}
+
+/*
+ * Sessions
+ */
+CK_RV PKCS11_EXPORT C_OpenSession(
+        CK_SLOT_ID slotID,
+        CK_FLAGS flags,
+        void* pApplication,
+        CK_NOTIFY Notify,
+        CK_SESSION_HANDLE* phSession) {
+    WorldSwitch call(SOFT_C_OPEN_SESSION);
+    StateLock lock;
+
+    if (!gInitialized) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (slotID != CKV_TOKEN_USER) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (phSession == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_SESSION_HANDLE primary = CK_INVALID_HANDLE;
+    if (flags & CKVF_OPEN_SUB_SESSION) {
+        Session* parent = find_session(*phSession);
+        if (parent == NULL || parent->primary != *phSession) {
+            return CKR_SESSION_HANDLE_INVALID;
+        }
+        primary = *phSession;
+    }
+
+    CK_SESSION_HANDLE handle = gNextId++;
+    Session& session = gSessions[handle];
+    memset(&session.sign, 0, sizeof(session.sign));
+    memset(&session.verify, 0, sizeof(session.verify));
+    session.finding = false;
+    session.primary = primary == CK_INVALID_HANDLE ? handle : primary;
+
+    *phSession = handle;
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_CloseSession(CK_SESSION_HANDLE hSession) {
+    WorldSwitch call(SOFT_C_CLOSE_SESSION);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    if (session->primary == hSession) {
+        close_primary(hSession);
+    } else {
+        gSessions.erase(hSession);
+    }
+    return CKR_OK;
+}
+
+/*
+ * Objects
+ */
+CK_RV PKCS11_EXPORT C_CreateObject(
+        CK_SESSION_HANDLE hSession,
+        const CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulCount,
+        CK_OBJECT_HANDLE* phObject) {
+    WorldSwitch call(SOFT_C_CREATE_OBJECT);
+
+    const CK_ATTRIBUTE* objClass = find_attribute(pTemplate, ulCount, CKA_CLASS);
+    const CK_ATTRIBUTE* keyType = find_attribute(pTemplate, ulCount, CKA_KEY_TYPE);
+    if (objClass == NULL || keyType == NULL) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+
+    Object object;
+    memset(&object.key, 0, sizeof(object.key));
+    object.objClass = *static_cast<const CK_OBJECT_CLASS*>(objClass->pValue);
+    object.keyType = *static_cast<const CK_KEY_TYPE*>(keyType->pValue);
+    object.token = CK_FALSE;
+    object.owner = 0;
+    apply_common(pTemplate, ulCount, &object);
+
+    if (object.objClass != CKO_PUBLIC_KEY && object.objClass != CKO_PRIVATE_KEY) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    bool isPrivate = object.objClass == CKO_PRIVATE_KEY;
+
+    CK_RV rv;
+    if (object.keyType == CKK_RSA) {
+        rv = create_rsa(pTemplate, ulCount, isPrivate, &object.key);
+    } else if (object.keyType == CKK_EC) {
+        rv = create_ec(pTemplate, ulCount, isPrivate, &object.key);
+    } else {
+        rv = CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    StateLock lock;
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        key_unref(object.key);
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    *phObject = new_handle(session, new_object(session, object));
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_CopyObject(
+        CK_SESSION_HANDLE hSession,
+        CK_OBJECT_HANDLE hObject,
+        const CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulAttributeCount,
+        CK_OBJECT_HANDLE* phNewObject) {
+    WorldSwitch call(SOFT_C_COPY_OBJECT);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    CK_ULONG id = find_object(session, hObject);
+    if (id == 0) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    Object copy = gObjects[id];
+    apply_common(pTemplate, ulAttributeCount, &copy);
+    key_ref(copy.key);
+
+    *phNewObject = new_handle(session, new_object(session, copy));
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_DestroyObject(
+        CK_SESSION_HANDLE hSession,
+        CK_OBJECT_HANDLE hObject) {
+    WorldSwitch call(SOFT_C_DESTROY_OBJECT);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    CK_ULONG id = find_object(session, hObject);
+    if (id == 0) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    destroy_object(id);
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_CloseObjectHandle(
+        CK_SESSION_HANDLE hSession,
+        CK_OBJECT_HANDLE hObject) {
+    WorldSwitch call(SOFT_C_CLOSE_OBJECT_HANDLE);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (!is_open_handle(session, hObject)) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    gHandles.erase(hObject);
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_GetAttributeValue(
+        CK_SESSION_HANDLE hSession,
+        CK_OBJECT_HANDLE hObject,
+        CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulCount) {
+    WorldSwitch call(SOFT_C_GET_ATTRIBUTE_VALUE);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    CK_ULONG id = find_object(session, hObject);
+    if (id == 0) {
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+    const Object& object = gObjects[id];
+
+    // As PKCS#11 asks, every attribute is processed and the last error returned
+    CK_RV result = CKR_OK;
+    Bytes value;
+    for (CK_ULONG i = 0; i < ulCount; i++) {
+        CK_RV rv = get_attribute(object, pTemplate[i].type, &value);
+        if (rv != CKR_OK) {
+            pTemplate[i].ulValueLen = (CK_ULONG) -1;
+            result = rv;
+        } else if (pTemplate[i].pValue == NULL) {
+            pTemplate[i].ulValueLen = value.size();
+        } else if (pTemplate[i].ulValueLen < value.size()) {
+            pTemplate[i].ulValueLen = (CK_ULONG) -1;
+            result = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(pTemplate[i].pValue, &value[0], value.size());
+            pTemplate[i].ulValueLen = value.size();
+        }
+    }
+    return result;
+}
+
+CK_RV PKCS11_EXPORT C_FindObjectsInit(
+        CK_SESSION_HANDLE hSession,
+        const CK_ATTRIBUTE* pTemplate,
+        CK_ULONG ulCount) {
+    WorldSwitch call(SOFT_C_FIND_OBJECTS);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (session->finding) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    session->found.clear();
+    for (std::map<CK_ULONG, Object>::iterator it = gObjects.begin(); it != gObjects.end(); ++it) {
+        const Object& object = it->second;
+        if ((object.token || object.owner == session->primary)
+                && matches(object, pTemplate, ulCount)) {
+            session->found.push_back(it->first);
+        }
+    }
+    session->finding = true;
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_FindObjects(
+        CK_SESSION_HANDLE hSession,
+        CK_OBJECT_HANDLE* phObject,
+        CK_ULONG ulMaxObjectCount,
+        CK_ULONG* pulObjectCount) {
+    WorldSwitch call(SOFT_C_FIND_OBJECTS);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (!session->finding) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    CK_ULONG count = 0;
+    while (count < ulMaxObjectCount && !session->found.empty()) {
+        CK_ULONG id = session->found.front();
+        session->found.erase(session->found.begin());
+        if (gObjects.count(id) != 0) {
+            phObject[count++] = new_handle(session, id);
+        }
+    }
+    *pulObjectCount = count;
+    return CKR_OK;
+}
+
+CK_RV PKCS11_EXPORT C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
+    WorldSwitch call(SOFT_C_FIND_OBJECTS);
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (!session->finding) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    session->finding = false;
+    session->found.clear();
+    return CKR_OK;
+}
+
+/*
+ * Key generation
+ */
+CK_RV PKCS11_EXPORT C_GenerateKeyPair(
+        CK_SESSION_HANDLE hSession,
+        const CK_MECHANISM* pMechanism,
+        const CK_ATTRIBUTE* pPublicKeyTemplate,
+        CK_ULONG ulPublicKeyAttributeCount,
+        const CK_ATTRIBUTE* pPrivateKeyTemplate,
+        CK_ULONG ulPrivateKeyAttributeCount,
+        CK_OBJECT_HANDLE* phPublicKey,
+        CK_OBJECT_HANDLE* phPrivateKey) {
+    WorldSwitch call(SOFT_C_GENERATE_KEY_PAIR);
+
+    Object publicKey;
+    memset(&publicKey.key, 0, sizeof(publicKey.key));
+    publicKey.objClass = CKO_PUBLIC_KEY;
+    publicKey.token = CK_FALSE;
+    publicKey.owner = 0;
+
+    if (pMechanism->mechanism == CKM_RSA_PKCS_KEY_PAIR_GEN) {
+        const CK_ATTRIBUTE* bits = find_attribute(pPublicKeyTemplate,
+                ulPublicKeyAttributeCount, CKA_MODULUS_BITS);
+        BIGNUM* exponent = attribute_to_bignum(pPublicKeyTemplate, ulPublicKeyAttributeCount,
+                CKA_PUBLIC_EXPONENT);
+        if (bits == NULL || exponent == NULL) {
+            BN_free(exponent);
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+
+        RSA* rsa = RSA_new();
+        if (rsa == NULL || !RSA_generate_key_ex(rsa,
+                *static_cast<const CK_ULONG*>(bits->pValue), exponent, NULL)) {
+            RSA_free(rsa);
+            BN_free(exponent);
+            return CKR_KEY_SIZE_RANGE;
+        }
+        BN_free(exponent);
+        publicKey.keyType = CKK_RSA;
+        publicKey.key.rsa = rsa;
+    } else if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
+        if (!is_p256(find_attribute(pPublicKeyTemplate, ulPublicKeyAttributeCount,
+                CKA_EC_PARAMS))) {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+
+        EC_KEY* ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        if (ec == NULL || !EC_KEY_generate_key(ec)) {
+            EC_KEY_free(ec);
+            return CKR_DEVICE_ERROR;
+        }
+        publicKey.keyType = CKK_EC;
+        publicKey.key.ec = ec;
+    } else {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    Object privateKey = publicKey;
+    privateKey.objClass = CKO_PRIVATE_KEY;
+    key_ref(privateKey.key);
+
+    apply_common(pPublicKeyTemplate, ulPublicKeyAttributeCount, &publicKey);
+    apply_common(pPrivateKeyTemplate, ulPrivateKeyAttributeCount, &privateKey);
+
+    StateLock lock;
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        key_unref(publicKey.key);
+        key_unref(privateKey.key);
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    *phPublicKey = new_handle(session, new_object(session, publicKey));
+    *phPrivateKey = new_handle(session, new_object(session, privateKey));
+    return CKR_OK;
+}
+
+/*
+ * Signing: raw RSA and ECDSA with raw r || s signatures
+ */
+
+/** Starts a sign or verify operation on the session */
+static CK_RV operation_init(CK_SESSION_HANDLE hSession, const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey, CK_OBJECT_CLASS objClass, bool sign) {
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    Operation* op = sign ? &session->sign : &session->verify;
+    if (op->active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    CK_ULONG id = find_object(session, hKey);
+    if (id == 0) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    const Object& object = gObjects[id];
+    if (object.objClass != objClass) {
+        return CKR_KEY_FUNCTION_NOT_PERMITTED;
+    }
+
+    if (pMechanism->mechanism == CKM_RSA_X_509) {
+        if (object.keyType != CKK_RSA) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+    } else if (pMechanism->mechanism == CKM_ECDSA) {
+        if (object.keyType != CKK_EC) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+    } else {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    op->active = true;
+    op->mechanism = pMechanism->mechanism;
+    op->object = id;
+    return CKR_OK;
+}
+
+/**
+ * Takes a reference to the key of the active operation. Unless keep is set
+ * the operation ends, as every call that produces a result ends it.
+ */
+static CK_RV operation_key(CK_SESSION_HANDLE hSession, bool sign, bool keep, Key* key) {
+    StateLock lock;
+
+    Session* session = find_session(hSession);
+    if (session == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    Operation* op = sign ? &session->sign : &session->verify;
+    if (!op->active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    op->active = keep;
+
+    std::map<CK_ULONG, Object>::iterator it = gObjects.find(op->object);
+    if (it == gObjects.end()) {
+        op->active = false;
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    *key = it->second.key;
+    key_ref(*key);
+    return CKR_OK;
+}
+
+static void bignum_to_padded(const BIGNUM* bn, CK_BYTE* out, size_t length) {
+    size_t size = BN_num_bytes(bn);
+    memset(out, 0, length - size);
+    BN_bn2bin(bn, out + length - size);
+}
+
+CK_RV PKCS11_EXPORT C_SignInit(
+        CK_SESSION_HANDLE hSession,
+        const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    WorldSwitch call(SOFT_C_SIGN);
+    return operation_init(hSession, pMechanism, hKey, CKO_PRIVATE_KEY, true);
+}
+
+CK_RV PKCS11_EXPORT C_Sign(
+        CK_SESSION_HANDLE hSession,
+        const CK_BYTE* pData,
+        CK_ULONG ulDataLen,
+        CK_BYTE* pSignature,
+        CK_ULONG* pulSignatureLen) {
+    WorldSwitch call(SOFT_C_SIGN);
+
+    Key key;
+    CK_RV rv = operation_key(hSession, true, pSignature == NULL, &key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG length = key.rsa != NULL ? RSA_size(key.rsa) : 2 * P256_LENGTH;
+    if (pSignature == NULL) {
+        *pulSignatureLen = length;
+    } else if (*pulSignatureLen < length) {
+        *pulSignatureLen = length;
+        rv = CKR_BUFFER_TOO_SMALL;
+    } else if (key.rsa != NULL) {
+        if (ulDataLen != length) {
+            rv = CKR_DATA_LEN_RANGE;
+        } else if (RSA_private_encrypt(ulDataLen, pData, pSignature, key.rsa,
+                RSA_NO_PADDING) != (int) length) {
+            rv = CKR_DATA_INVALID;
+        } else {
+            *pulSignatureLen = length;
+        }
+    } else {
+        ECDSA_SIG* sig = ECDSA_do_sign(pData, ulDataLen, key.ec);
+        if (sig == NULL) {
+            rv = CKR_DEVICE_ERROR;
+        } else {
+            bignum_to_padded(sig->r, pSignature, P256_LENGTH);
+            bignum_to_padded(sig->s, pSignature + P256_LENGTH, P256_LENGTH);
+            *pulSignatureLen = length;
+            ECDSA_SIG_free(sig);
+        }
+    }
+
+    key_unref(key);
+    return rv;
+}
+
+CK_RV PKCS11_EXPORT C_VerifyInit(
+        CK_SESSION_HANDLE hSession,
+        const CK_MECHANISM* pMechanism,
+        CK_OBJECT_HANDLE hKey) {
+    WorldSwitch call(SOFT_C_VERIFY);
+    return operation_init(hSession, pMechanism, hKey, CKO_PUBLIC_KEY, false);
+}
+
+CK_RV PKCS11_EXPORT C_Verify(
+        CK_SESSION_HANDLE hSession,
+        const CK_BYTE* pData,
+        CK_ULONG ulDataLen,
+        CK_BYTE* pSignature,
+        CK_ULONG ulSignatureLen) {
+    WorldSwitch call(SOFT_C_VERIFY);
+
+    Key key;
+    CK_RV rv = operation_key(hSession, false, false, &key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (key.rsa != NULL) {
+        CK_ULONG length = RSA_size(key.rsa);
+        std::vector<CK_BYTE> recovered(length);
+        if (ulSignatureLen != length) {
+            rv = CKR_SIGNATURE_LEN_RANGE;
+        } else if (ulDataLen != length) {
+            rv = CKR_DATA_LEN_RANGE;
+        } else if (RSA_public_decrypt(ulSignatureLen, pSignature, &recovered[0], key.rsa,
+                RSA_NO_PADDING) != (int) length
+                || memcmp(&recovered[0], pData, length) != 0) {
+            rv = CKR_SIGNATURE_INVALID;
+        }
+    } else {
+        ECDSA_SIG* sig = ECDSA_SIG_new();
+        if (ulSignatureLen != 2 * P256_LENGTH) {
+            rv = CKR_SIGNATURE_LEN_RANGE;
+        } else if (sig == NULL
+                || BN_bin2bn(pSignature, P256_LENGTH, sig->r) == NULL
+                || BN_bin2bn(pSignature + P256_LENGTH, P256_LENGTH, sig->s) == NULL) {
+            rv = CKR_HOST_MEMORY;
+        } else if (ECDSA_do_verify(pData, ulDataLen, sig, key.ec) != 1) {
+            rv = CKR_SIGNATURE_INVALID;
+        }
+        ECDSA_SIG_free(sig);
+    }
+
+    key_unref(key);
+    return rv;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KEYMASTER_BENCH_SOFT_PKCS11_H
+#define KEYMASTER_BENCH_SOFT_PKCS11_H
+
+#include <stdint.h>
+
+/*
+ * A host stand-in for libtf_crypto_sst: the C_* calls keymaster_grouper.cpp
+ * makes, with the keys held by OpenSSL in memory instead of in the secure
+ * world.
+ *
+ * Every call first spins for soft_pkcs11_switch_us, the time the SMC into
+ * and out of the secure world takes. Trusted Foundations runs one request
+ * at a time, so by default the calls are serialized as well; clear
+ * soft_pkcs11_serialize to model a secure world that scales with cores.
+ *
+ * Token objects outlive C_Finalize(), session objects die with their
+ * session, and object handles are valid across the sub-sessions of a
+ * primary session, as they are on the device.
+ */
+
+enum soft_pkcs11_call {
+    SOFT_C_OPEN_SESSION,
+    SOFT_C_CLOSE_SESSION,
+    SOFT_C_CREATE_OBJECT,
+    SOFT_C_COPY_OBJECT,
+    SOFT_C_DESTROY_OBJECT,
+    SOFT_C_CLOSE_OBJECT_HANDLE,
+    SOFT_C_GET_ATTRIBUTE_VALUE,
+    SOFT_C_FIND_OBJECTS,        /* Init, the search and Final each count */
+    SOFT_C_GENERATE_KEY_PAIR,
+    SOFT_C_SIGN,                /* SignInit and Sign each count */
+    SOFT_C_VERIFY,              /* VerifyInit and Verify each count */
+    SOFT_C_OTHER,
+    SOFT_C_COUNT,
+};
+
+extern const char* const soft_pkcs11_call_names[SOFT_C_COUNT];
+
+/* Time each call spends crossing into and out of the secure world */
+extern unsigned int soft_pkcs11_switch_us;
+
+/* Run one call at a time, as the secure world does */
+extern bool soft_pkcs11_serialize;
+
+/* Copies the number of calls made so far, by kind */
+void soft_pkcs11_get_calls(uint64_t calls[SOFT_C_COUNT]);
+
+/* The number of objects held, token and session */
+unsigned int soft_pkcs11_get_objects();
+
+#endif // KEYMASTER_BENCH_SOFT_PKCS11_H
@@ -14,8 +14,12 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 
 // For debugging
 #define LOG_NDEBUG 0
@@ -23,11 +27,14 @@
 // TEE is the Trusted Execution Environment
 #define LOG_TAG "TEEKeyMaster"
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/keymaster0.h>
 
 #include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -45,6 +52,31 @@
 /** The current stored key version. */
 const static uint32_t KEY_VERSION = 1;
 
+/** The size of a P-256 private key, and of each half of a raw signature */
+#define P256_LENGTH 32
+
+/** CKA_EC_PARAMS of P-256 keys: the DER encoded OID of prime256v1 */
+static const CK_BYTE P256_PARAMS[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07,
+};
+
+/** The number of idle sub-sessions kept open for reuse */
+#define SESSION_POOL_SIZE 4
+
+/** The number of keys whose object handles are kept open */
+#define KEY_CACHE_SIZE 8
+
+/** The most RSA keys generated ahead of time per key size */
+#define KEY_STOCK_MAX 4
+
+/** Stocked keys are generated only after this long without a call */
+#define KEY_STOCK_QUIET_MS 2000
+
+/** ... and on battery, only after this long */
+#define KEY_STOCK_IDLE_MS (5 * 60 * 1000)
+
+#define BATTERY_STATUS_PATH "/sys/class/power_supply/battery/status"
+
 
 struct EVP_PKEY_Delete {
     void operator()(EVP_PKEY* p) const {
@@ -60,6 +92,20 @@ struct RSA_Delete {
 };
 typedef UniquePtr<RSA, RSA_Delete> Unique_RSA;
 
+struct EC_KEY_Delete {
+    void operator()(EC_KEY* p) const {
+        EC_KEY_free(p);
+    }
+};
+typedef UniquePtr<EC_KEY, EC_KEY_Delete> Unique_EC_KEY;
+
+struct ECDSA_SIG_Delete {
+    void operator()(ECDSA_SIG* p) const {
+        ECDSA_SIG_free(p);
+    }
+};
+typedef UniquePtr<ECDSA_SIG, ECDSA_SIG_Delete> Unique_ECDSA_SIG;
+
 struct PKCS8_PRIV_KEY_INFO_Delete {
     void operator()(PKCS8_PRIV_KEY_INFO* p) const {
         PKCS8_PRIV_KEY_INFO_free(p);
@@ -114,32 +160,720 @@ private:
 };
 typedef UniquePtr<ByteArray> Unique_ByteArray;
 
-class CryptoSession {
+/**
+ * Sub-sessions of the primary session, kept open between calls.
+ *
+ * Opening and closing a sub-session are a secure world round trip each, so
+ * the entry points check one out and give it back instead. A sub-session
+ * that saw an error is closed rather than reused, as it may have been left
+ * with an operation active. The TEE has no call to probe a session, so that
+ * is the only health check. After C_Finalize() the handles are gone, and
+ * invalidate() drops them without closing.
+ */
+class SessionPool {
 public:
-    CryptoSession(CK_SESSION_HANDLE masterHandle) :
-            mHandle(masterHandle), mSubsession(CK_INVALID_HANDLE) {
-        CK_SESSION_HANDLE subsessionHandle = mHandle;
+    SessionPool(CK_SESSION_HANDLE primary) :
+            mPrimary(primary), mIdleCount(0), mValid(true) {
+        pthread_mutex_init(&mLock, NULL);
+    }
+
+    ~SessionPool() {
+        closeIdle();
+        pthread_mutex_destroy(&mLock);
+    }
+
+    CK_SESSION_HANDLE checkout() {
+        CK_SESSION_HANDLE handle = CK_INVALID_HANDLE;
+
+        pthread_mutex_lock(&mLock);
+        if (!mValid) {
+            pthread_mutex_unlock(&mLock);
+            return CK_INVALID_HANDLE;
+        }
+        if (mIdleCount > 0) {
+            handle = mIdle[--mIdleCount];
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (handle != CK_INVALID_HANDLE) {
+            return handle;
+        }
+
+        handle = mPrimary;
         CK_RV openSessionRV = C_OpenSession(CKV_TOKEN_USER,
                 CKF_SERIAL_SESSION | CKF_RW_SESSION | CKVF_OPEN_SUB_SESSION,
                 NULL,
                 NULL,
-                &subsessionHandle);
+                &handle);
 
-        if (openSessionRV != CKR_OK || subsessionHandle == CK_INVALID_HANDLE) {
+        if (openSessionRV != CKR_OK || handle == CK_INVALID_HANDLE) {
+            invalidate();
             (void) C_Finalize(NULL_PTR);
             ALOGE("Error opening secondary session with TEE: 0x%x", openSessionRV);
+            return CK_INVALID_HANDLE;
+        }
+
+        ALOGV("Opening subsession 0x%x", handle);
+        return handle;
+    }
+
+    void checkin(CK_SESSION_HANDLE handle, bool healthy) {
+        if (handle == CK_INVALID_HANDLE) {
+            return;
+        }
+
+        pthread_mutex_lock(&mLock);
+        if (!mValid) {
+            pthread_mutex_unlock(&mLock);
+            return;
+        }
+        if (healthy && mIdleCount < SESSION_POOL_SIZE) {
+            mIdle[mIdleCount++] = handle;
+            handle = CK_INVALID_HANDLE;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (handle != CK_INVALID_HANDLE) {
+            CK_RV rv = C_CloseSession(handle);
+            ALOGV("Closing subsession 0x%x: 0x%x", handle, rv);
+        }
+    }
+
+    /** Opens sub-sessions ahead of the first calls */
+    void fill(size_t count) {
+        CK_SESSION_HANDLE handles[SESSION_POOL_SIZE];
+        size_t opened;
+
+        if (count > SESSION_POOL_SIZE) {
+            count = SESSION_POOL_SIZE;
+        }
+        for (opened = 0; opened < count; opened++) {
+            handles[opened] = checkout();
+            if (handles[opened] == CK_INVALID_HANDLE) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < opened; i++) {
+            checkin(handles[i], true);
+        }
+    }
+
+    /** Forgets all sub-sessions, they died with C_Finalize() */
+    void invalidate() {
+        pthread_mutex_lock(&mLock);
+        mValid = false;
+        mIdleCount = 0;
+        pthread_mutex_unlock(&mLock);
+    }
+
+    /** Closes the idle sub-sessions, before the primary session is closed */
+    void closeIdle() {
+        CK_SESSION_HANDLE handles[SESSION_POOL_SIZE];
+        size_t count;
+
+        pthread_mutex_lock(&mLock);
+        count = mIdleCount;
+        memcpy(handles, mIdle, count * sizeof(handles[0]));
+        mIdleCount = 0;
+        pthread_mutex_unlock(&mLock);
+
+        for (size_t i = 0; i < count; i++) {
+            CK_RV rv = C_CloseSession(handles[i]);
+            ALOGV("Closing subsession 0x%x: 0x%x", handles[i], rv);
+        }
+    }
+
+    CK_SESSION_HANDLE getPrimary() const {
+        return mPrimary;
+    }
+
+private:
+    pthread_mutex_t mLock;
+    CK_SESSION_HANDLE mPrimary;
+    CK_SESSION_HANDLE mIdle[SESSION_POOL_SIZE];
+    size_t mIdleCount;
+    bool mValid;
+};
+
+/**
+ * Object handles of recently used keys, by key ID.
+ *
+ * Resolving a key blob takes two object searches of three TEE calls each.
+ * The handles found stay valid until closed, so the most recently used keys
+ * keep theirs open here. A user holds an entry from acquire() or insert()
+ * until release(); an entry that is removed or evicted while in use is only
+ * marked stale, and its handles are closed by the last release().
+ */
+class KeyCache {
+public:
+    KeyCache(CK_SESSION_HANDLE primary) :
+            mPrimary(primary), mClock(0), mHits(0), mMisses(0) {
+        pthread_mutex_init(&mLock, NULL);
+        memset(mEntries, 0, sizeof(mEntries));
+    }
+
+    ~KeyCache() {
+        pthread_mutex_destroy(&mLock);
+    }
+
+    /** Returns the slot of a cached key, its handles and type, or -1 */
+    int acquire(const uint8_t* id, CK_OBJECT_HANDLE* publicKey, CK_OBJECT_HANDLE* privateKey,
+            CK_KEY_TYPE* keyType) {
+        int slot = -1;
+
+        pthread_mutex_lock(&mLock);
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (entry->used && !entry->stale && memcmp(entry->id, id, ID_LENGTH) == 0) {
+                entry->users++;
+                entry->lastUsed = ++mClock;
+                *publicKey = entry->publicKey;
+                *privateKey = entry->privateKey;
+                *keyType = entry->keyType;
+                slot = i;
+                break;
+            }
+        }
+        if (slot >= 0) {
+            mHits++;
         } else {
-            ALOGV("Opening subsession 0x%x", subsessionHandle);
-            mSubsession = subsessionHandle;
+            mMisses++;
         }
+        pthread_mutex_unlock(&mLock);
+
+        return slot;
     }
 
-    ~CryptoSession() {
-        if (mSubsession != CK_INVALID_HANDLE) {
-            CK_RV rv = C_CloseSession(mSubsession);
-            ALOGV("Closing subsession 0x%x: 0x%x", mSubsession, rv);
-            mSubsession = CK_INVALID_HANDLE;
+    /**
+     * Takes over the handles of a key just looked up, evicting the least
+     * recently used idle entry if needed. Returns the slot, held by the
+     * caller, or -1 if the handles stay the caller's.
+     */
+    int insert(const uint8_t* id, CK_OBJECT_HANDLE publicKey, CK_OBJECT_HANDLE privateKey,
+            CK_KEY_TYPE keyType) {
+        Entry evicted;
+        int slot = -1;
+
+        evicted.used = false;
+
+        pthread_mutex_lock(&mLock);
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (entry->used && !entry->stale && memcmp(entry->id, id, ID_LENGTH) == 0) {
+                // Another caller cached it first
+                pthread_mutex_unlock(&mLock);
+                return -1;
+            }
+            if (!entry->used) {
+                slot = i;
+            } else if (entry->users == 0 && !entry->stale && (slot < 0 || (mEntries[slot].used
+                    && entry->lastUsed < mEntries[slot].lastUsed))) {
+                slot = i;
+            }
+        }
+
+        if (slot >= 0) {
+            Entry* entry = &mEntries[slot];
+            if (entry->used) {
+                evicted = *entry;
+            }
+            memcpy(entry->id, id, ID_LENGTH);
+            entry->publicKey = publicKey;
+            entry->privateKey = privateKey;
+            entry->keyType = keyType;
+            entry->lastUsed = ++mClock;
+            entry->users = 1;
+            entry->used = true;
+            entry->stale = false;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (evicted.used) {
+            closeHandles(&evicted);
+        }
+
+        return slot;
+    }
+
+    void release(int slot) {
+        Entry closed;
+
+        closed.used = false;
+
+        pthread_mutex_lock(&mLock);
+        Entry* entry = &mEntries[slot];
+        entry->users--;
+        if (entry->users == 0 && entry->stale) {
+            closed = *entry;
+            entry->used = false;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (closed.used) {
+            closeHandles(&closed);
+        }
+    }
+
+    /** Drops a key, e.g. because it is being deleted */
+    void remove(const uint8_t* id) {
+        Entry closed;
+
+        closed.used = false;
+
+        pthread_mutex_lock(&mLock);
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (entry->used && !entry->stale && memcmp(entry->id, id, ID_LENGTH) == 0) {
+                entry->stale = true;
+                if (entry->users == 0) {
+                    closed = *entry;
+                    entry->used = false;
+                }
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        if (closed.used) {
+            closeHandles(&closed);
+        }
+    }
+
+    /**
+     * Drops a key whose handles turned out to be unusable. Only the caller's
+     * own slot is touched: if it is already stale, the key may have been
+     * cached again by someone else since.
+     */
+    void remove(int slot) {
+        Entry closed;
+
+        closed.used = false;
+
+        pthread_mutex_lock(&mLock);
+        Entry* entry = &mEntries[slot];
+        if (entry->used && !entry->stale) {
+            entry->stale = true;
+            if (entry->users == 0) {
+                closed = *entry;
+                entry->used = false;
+            }
         }
+        pthread_mutex_unlock(&mLock);
+
+        if (closed.used) {
+            closeHandles(&closed);
+        }
+    }
+
+    /**
+     * Drops every key. The handles are closed only if the session they
+     * belong to is still open.
+     */
+    void clear(bool close) {
+        Entry closed[KEY_CACHE_SIZE];
+        int count = 0;
+
+        pthread_mutex_lock(&mLock);
+        for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+            Entry* entry = &mEntries[i];
+            if (!entry->used || entry->stale) {
+                continue;
+            }
+            entry->stale = true;
+            if (entry->users == 0) {
+                closed[count++] = *entry;
+                entry->used = false;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        for (int i = 0; close && i < count; i++) {
+            closeHandles(&closed[i]);
+        }
+    }
+
+    void getStats(uint64_t* hits, uint64_t* misses) {
+        pthread_mutex_lock(&mLock);
+        *hits = mHits;
+        *misses = mMisses;
+        pthread_mutex_unlock(&mLock);
+    }
+
+private:
+    struct Entry {
+        uint8_t id[ID_LENGTH];
+        CK_OBJECT_HANDLE publicKey;
+        CK_OBJECT_HANDLE privateKey;
+        CK_KEY_TYPE keyType;
+        uint64_t lastUsed;
+        int users;
+        bool used;
+        bool stale;     // removed, closed when the last user is done
+    };
+
+    void closeHandles(const Entry* entry) {
+        CK_RV rv = C_CloseObjectHandle(mPrimary, entry->publicKey);
+        if (rv != CKR_OK) {
+            ALOGW("Couldn't close object handle 0x%x: 0x%x", entry->publicKey, rv);
+        }
+        rv = C_CloseObjectHandle(mPrimary, entry->privateKey);
+        if (rv != CKR_OK) {
+            ALOGW("Couldn't close object handle 0x%x: 0x%x", entry->privateKey, rv);
+        }
+    }
+
+    pthread_mutex_t mLock;
+    CK_SESSION_HANDLE mPrimary;
+    Entry mEntries[KEY_CACHE_SIZE];
+    uint64_t mClock;
+    uint64_t mHits;
+    uint64_t mMisses;
+};
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_charging() {
+    char status[16];
+
+    int fd = open(BATTERY_STATUS_PATH, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t len = read(fd, status, sizeof(status) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    status[len] = '\0';
+
+    return strncmp(status, "Charging", 8) == 0 || strncmp(status, "Full", 4) == 0;
+}
+
+/**
+ * RSA keypairs generated ahead of time, so that generate_keypair() does not
+ * have to wait seconds for the TEE.
+ *
+ * The number of keys kept per common key size is read from
+ * ro.keymaster.rsa_stock, and 0 disables the stock. The keys are session
+ * objects of a sub-session owned by the generator, so nothing is left in
+ * the token if the stock is dropped; a claimed key is copied into the token
+ * under its new key ID. To stay out of the way of the entry points, which
+ * would wait for the TEE behind a generation, keys are only generated after
+ * a quiet period, and on battery only once the keymaster has been idle for
+ * a while.
+ */
+class KeyStock {
+public:
+    KeyStock(CK_SESSION_HANDLE primary) :
+            mPrimary(primary), mSession(CK_INVALID_HANDLE), mTarget(0),
+            mLastActivity(0), mRunning(false), mExit(false) {
+        pthread_condattr_t attr;
+
+        pthread_mutex_init(&mLock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&mCond, &attr);
+        pthread_condattr_destroy(&attr);
+        memset(mCount, 0, sizeof(mCount));
+    }
+
+    ~KeyStock() {
+        stop();
+        pthread_cond_destroy(&mCond);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    void start() {
+        int target = property_get_int32("ro.keymaster.rsa_stock", 0);
+        if (target <= 0) {
+            return;
+        }
+        if (target > KEY_STOCK_MAX) {
+            target = KEY_STOCK_MAX;
+        }
+
+        CK_SESSION_HANDLE handle = mPrimary;
+        CK_RV rv = C_OpenSession(CKV_TOKEN_USER,
+                CKF_SERIAL_SESSION | CKF_RW_SESSION | CKVF_OPEN_SUB_SESSION,
+                NULL,
+                NULL,
+                &handle);
+        if (rv != CKR_OK || handle == CK_INVALID_HANDLE) {
+            ALOGW("Could not open a session for the key stock: 0x%x", rv);
+            return;
+        }
+
+        mSession = handle;
+        mTarget = target;
+        mLastActivity = monotonic_ms();
+
+        int ret = pthread_create(&mThread, NULL, threadLoop, this);
+        if (ret != 0) {
+            ALOGW("Could not start the key stock thread: %s", strerror(ret));
+            C_CloseSession(mSession);
+            mSession = CK_INVALID_HANDLE;
+            return;
+        }
+        mRunning = true;
+    }
+
+    void stop() {
+        if (!mRunning) {
+            return;
+        }
+
+        pthread_mutex_lock(&mLock);
+        mExit = true;
+        pthread_cond_signal(&mCond);
+        pthread_mutex_unlock(&mLock);
+        pthread_join(mThread, NULL);
+        mRunning = false;
+
+        // Closing the session destroys the keys still in stock
+        C_CloseSession(mSession);
+        mSession = CK_INVALID_HANDLE;
+    }
+
+    /** Called on every entry point, generation waits for a quiet period */
+    void touch() {
+        if (!mRunning) {
+            return;
+        }
+
+        pthread_mutex_lock(&mLock);
+        mLastActivity = monotonic_ms();
+        pthread_mutex_unlock(&mLock);
+    }
+
+    /**
+     * Takes a stocked keypair of the given size, if there is one. The caller
+     * copies the objects and destroys these.
+     */
+    bool claim(CK_ULONG modulusBits, uint64_t publicExponent,
+            CK_OBJECT_HANDLE* publicKey, CK_OBJECT_HANDLE* privateKey) {
+        bool claimed = false;
+
+        if (!mRunning) {
+            return false;
+        }
+
+        pthread_mutex_lock(&mLock);
+        for (size_t i = 0; i < NUM_STOCKED_SIZES && mTarget > 0; i++) {
+            if (kStockedSizes[i].modulusBits == modulusBits
+                    && kStockedSizes[i].publicExponent == publicExponent && mCount[i] > 0) {
+                mCount[i]--;
+                *publicKey = mKeys[i][mCount[i]].publicKey;
+                *privateKey = mKeys[i][mCount[i]].privateKey;
+                claimed = true;
+                pthread_cond_signal(&mCond);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        return claimed;
+    }
+
+    /**
+     * Stops stocking keys, for when a claimed keypair could not be used, or
+     * when the library was finalized and the stock's sub-session with it:
+     * the generator would otherwise keep failing in the TEE.
+     */
+    void disable(const char* reason) {
+        pthread_mutex_lock(&mLock);
+        if (mTarget > 0) {
+            ALOGW("%s, no longer stocking keys", reason);
+            mTarget = 0;
+            pthread_cond_signal(&mCond);
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+private:
+    struct KeySize {
+        CK_ULONG modulusBits;
+        uint64_t publicExponent;
+    };
+
+    struct Keypair {
+        CK_OBJECT_HANDLE publicKey;
+        CK_OBJECT_HANDLE privateKey;
+    };
+
+    static const KeySize kStockedSizes[];
+    static const size_t NUM_STOCKED_SIZES = 2;
+
+    static void* threadLoop(void* context) {
+        reinterpret_cast<KeyStock*>(context)->run();
+        return NULL;
+    }
+
+    /** Returns how long to wait before generating, 0 if it may start now */
+    int64_t delayMs(int64_t now) const {
+        int64_t quiet = now - mLastActivity;
+
+        if (quiet < KEY_STOCK_QUIET_MS) {
+            return KEY_STOCK_QUIET_MS - quiet;
+        }
+        if (quiet < KEY_STOCK_IDLE_MS && !is_charging()) {
+            // Check the charger again from time to time
+            int64_t delay = KEY_STOCK_IDLE_MS - quiet;
+            return delay < KEY_STOCK_QUIET_MS * 15 ? delay : KEY_STOCK_QUIET_MS * 15;
+        }
+        return 0;
+    }
+
+    void waitMs(int64_t ms) {
+        int64_t deadline = monotonic_ms() + ms;
+        struct timespec ts;
+
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+        pthread_cond_timedwait(&mCond, &mLock, &ts);
+    }
+
+    void run() {
+        pthread_mutex_lock(&mLock);
+
+        while (!mExit && mTarget > 0) {
+            size_t size;
+            for (size = 0; size < NUM_STOCKED_SIZES; size++) {
+                if (mCount[size] < mTarget) {
+                    break;
+                }
+            }
+            if (size == NUM_STOCKED_SIZES) {
+                pthread_cond_wait(&mCond, &mLock);
+                continue;
+            }
+
+            int64_t delay = delayMs(monotonic_ms());
+            if (delay > 0) {
+                waitMs(delay);
+                continue;
+            }
+
+            pthread_mutex_unlock(&mLock);
+            Keypair keypair;
+            CK_RV rv = generate(&kStockedSizes[size], &keypair);
+            pthread_mutex_lock(&mLock);
+
+            if (rv != CKR_OK) {
+                ALOGW("Could not generate a stocked key: 0x%x", rv);
+                // Back off, the TEE may be out of memory
+                waitMs(KEY_STOCK_IDLE_MS);
+                continue;
+            }
+
+            mKeys[size][mCount[size]++] = keypair;
+            ALOGV("Stocked a %u bit key, %d in stock", kStockedSizes[size].modulusBits,
+                    mCount[size]);
+        }
+
+        pthread_mutex_unlock(&mLock);
+    }
+
+    CK_RV generate(const KeySize* size, Keypair* keypair) {
+        CK_BBOOL bTRUE = CK_TRUE;
+        CK_BBOOL bFALSE = CK_FALSE;
+        CK_ULONG modulusBits = size->modulusBits;
+
+        CK_MECHANISM mechanism = {
+                CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0,
+        };
+
+        CK_BYTE publicExponent[sizeof(uint64_t)];
+        size_t offset = sizeof(publicExponent) - 1;
+        for (size_t i = 0; i < sizeof(publicExponent); i++) {
+            publicExponent[offset--] = (size->publicExponent >> (i * CHAR_BIT)) & 0xFF;
+        }
+
+        CK_ATTRIBUTE publicKeyTemplate[] = {
+                {CKA_TOKEN,           &bFALSE,        sizeof(bFALSE)},
+                {CKA_ENCRYPT,         &bTRUE,         sizeof(bTRUE)},
+                {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
+                {CKA_MODULUS_BITS,    &modulusBits,   sizeof(modulusBits)},
+                {CKA_PUBLIC_EXPONENT, publicExponent, sizeof(publicExponent)},
+        };
+
+        CK_ATTRIBUTE privateKeyTemplate[] = {
+                {CKA_TOKEN,           &bFALSE,        sizeof(bFALSE)},
+                {CKA_DECRYPT,         &bTRUE,         sizeof(bTRUE)},
+                {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
+        };
+
+        return C_GenerateKeyPair(mSession,
+                &mechanism,
+                publicKeyTemplate,
+                sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+                privateKeyTemplate,
+                sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+                &keypair->publicKey,
+                &keypair->privateKey);
+    }
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    pthread_t mThread;
+    CK_SESSION_HANDLE mPrimary;
+    CK_SESSION_HANDLE mSession;
+    int mTarget;
+    int mCount[NUM_STOCKED_SIZES];
+    Keypair mKeys[NUM_STOCKED_SIZES][KEY_STOCK_MAX];
+    int64_t mLastActivity;
+    bool mRunning;
+    bool mExit;
+};
+
+/** The key sizes worth stocking: keystore's default and the legacy one */
+const KeyStock::KeySize KeyStock::kStockedSizes[KeyStock::NUM_STOCKED_SIZES] = {
+    { 2048, 65537 },
+    { 1024, 65537 },
+};
+
+/**
+ * State shared by the entry points, kept in keymaster0_device_t::context.
+ */
+struct TeeContext {
+    TeeContext(CK_SESSION_HANDLE primary) :
+            sessions(primary), keys(primary), stock(primary) {
+    }
+
+    SessionPool sessions;
+    KeyCache keys;
+    KeyStock stock;
+};
+
+static TeeContext* get_context(const keymaster0_device_t* dev) {
+    return reinterpret_cast<TeeContext*>(dev->context);
+}
+
+/**
+ * A sub-session checked out of the pool for the lifetime of the object.
+ * Results of calls made on it should go through check(), so that a
+ * sub-session which saw an error is not handed out again.
+ */
+class CryptoSession {
+public:
+    CryptoSession(TeeContext* context) :
+            mContext(context), mPool(&context->sessions), mHealthy(true) {
+        context->stock.touch();
+        mSubsession = mPool->checkout();
+        if (mSubsession == CK_INVALID_HANDLE) {
+            // The library was finalized, taking the cached handles with it
+            context->keys.clear(false);
+            context->stock.disable("The TEE sessions were lost");
+        }
+    }
+
+    ~CryptoSession() {
+        mPool->checkin(mSubsession, mHealthy);
+        mSubsession = CK_INVALID_HANDLE;
     }
 
     CK_SESSION_HANDLE get() const {
@@ -147,22 +881,36 @@ public:
     }
 
     CK_SESSION_HANDLE getPrimary() const {
-        return mHandle;
+        return mPool->getPrimary();
+    }
+
+    TeeContext* getContext() const {
+        return mContext;
+    }
+
+    CK_RV check(CK_RV rv) const {
+        // A bad signature ends the verification like a good one does.
+        if (rv != CKR_OK && rv != CKR_SIGNATURE_INVALID && rv != CKR_SIGNATURE_LEN_RANGE) {
+            mHealthy = false;
+        }
+        return rv;
     }
 
 private:
-    CK_SESSION_HANDLE mHandle;
+    TeeContext* mContext;
+    SessionPool* mPool;
     CK_SESSION_HANDLE mSubsession;
+    mutable bool mHealthy;
 };
 
 class ObjectHandle {
 public:
     ObjectHandle(const CryptoSession* session, CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE) :
-            mSession(session), mHandle(handle) {
+            mSession(session), mHandle(handle), mOwned(true) {
     }
 
     ~ObjectHandle() {
-        if (mHandle != CK_INVALID_HANDLE) {
+        if (mHandle != CK_INVALID_HANDLE && mOwned) {
             CK_RV rv = C_CloseObjectHandle(mSession->getPrimary(), mHandle);
             if (rv != CKR_OK) {
                 ALOGW("Couldn't close object handle 0x%x: 0x%x", mHandle, rv);
@@ -181,9 +929,51 @@ public:
         mHandle = handle;
     }
 
+    /** Uses a handle owned by someone else, which is not closed here */
+    void borrow(CK_OBJECT_HANDLE handle) {
+        mHandle = handle;
+        mOwned = false;
+    }
+
 private:
     const CryptoSession* mSession;
     CK_OBJECT_HANDLE mHandle;
+    bool mOwned;
+};
+
+/**
+ * A key cache entry held for the lifetime of the object.
+ */
+class CachedKey {
+public:
+    CachedKey(KeyCache* cache) :
+            mCache(cache), mSlot(-1) {
+    }
+
+    ~CachedKey() {
+        if (mSlot >= 0) {
+            mCache->release(mSlot);
+        }
+    }
+
+    KeyCache* cache() const {
+        return mCache;
+    }
+
+    void reset(int slot) {
+        mSlot = slot;
+    }
+
+    /** Drops the key from the cache after its handles failed */
+    void invalidate() {
+        if (mSlot >= 0) {
+            mCache->remove(mSlot);
+        }
+    }
+
+private:
+    KeyCache* mCache;
+    int mSlot;
 };
 
 
@@ -276,8 +1066,8 @@ static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
             { CKA_CLASS, &obj_class, sizeof(obj_class) },
     };
 
-    CK_RV rv = C_FindObjectsInit(session->get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    CK_RV rv = session->check(C_FindObjectsInit(session->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
     if (rv != CKR_OK) {
         ALOGE("Error in C_FindObjectsInit: 0x%x", rv);
         return -1;
@@ -286,45 +1076,261 @@ static int find_single_object(const uint8_t* obj_id, const size_t obj_id_length,
     CK_OBJECT_HANDLE tmpHandle;
     CK_ULONG tmpCount;
 
-    rv = C_FindObjects(session->get(), &tmpHandle, 1, &tmpCount);
+    rv = session->check(C_FindObjects(session->get(), &tmpHandle, 1, &tmpCount));
     ALOGV("Found %d object 0x%x : class 0x%x", tmpCount, tmpHandle, obj_class);
     if (rv != CKR_OK || tmpCount != 1) {
-        C_FindObjectsFinal(session->get());
+        session->check(C_FindObjectsFinal(session->get()));
         ALOGE("Couldn't find key!");
         return -1;
     }
-    C_FindObjectsFinal(session->get());
+    session->check(C_FindObjectsFinal(session->get()));
+
+    object->reset(tmpHandle);
+    return 0;
+}
+
+/**
+ * Returns the key ID stored in a key blob, or NULL if the blob is invalid.
+ */
+static const uint8_t* keyblob_get_id(const uint8_t* keyBlob, const size_t keyBlobLength) {
+    if (keyBlob == NULL) {
+        ALOGE("key blob was null");
+        return NULL;
+    }
+
+    if (keyBlobLength < (sizeof(KEY_VERSION) + ID_LENGTH)) {
+        ALOGE("key blob is not correct size");
+        return NULL;
+    }
+
+    uint32_t keyVersion = 0;
+
+    const uint8_t* p = keyBlob;
+    for (size_t i = 0; i < sizeof(keyVersion); i++) {
+        keyVersion = (keyVersion << 8) | *p++;
+    }
+
+    if (keyVersion != 1) {
+        ALOGE("Invalid key version %d", keyVersion);
+        return NULL;
+    }
+
+    return p;
+}
+
+/**
+ * Finds the objects of a key blob and, if key_type is not NULL, the key
+ * type. If cached is not NULL the handles are taken from or added to its
+ * cache and must not be used after it is gone; key_type is then required.
+ */
+static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
+        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key,
+        CK_KEY_TYPE* key_type, CachedKey* cached) {
+    const uint8_t* p = keyblob_get_id(keyBlob, keyBlobLength);
+    if (p == NULL) {
+        return -1;
+    }
+
+    if (cached != NULL) {
+        CK_OBJECT_HANDLE publicHandle, privateHandle;
+        int slot = cached->cache()->acquire(p, &publicHandle, &privateHandle, key_type);
+        if (slot >= 0) {
+            cached->reset(slot);
+            public_key->borrow(publicHandle);
+            private_key->borrow(privateHandle);
+            return 0;
+        }
+    }
+
+    if (find_single_object(p, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
+            || find_single_object(p, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key)) {
+        return -1;
+    }
+
+    if (key_type != NULL) {
+        CK_ATTRIBUTE attribute = {CKA_KEY_TYPE, key_type, sizeof(*key_type)};
+        CK_RV rv = session->check(C_GetAttributeValue(session->get(), public_key->get(),
+                &attribute, 1));
+        if (rv != CKR_OK) {
+            ALOGW("Could not query the key type: 0x%x", rv);
+            return -1;
+        }
+    }
+
+    if (cached != NULL) {
+        int slot = cached->cache()->insert(p, public_key->get(), private_key->get(), *key_type);
+        if (slot >= 0) {
+            cached->reset(slot);
+            public_key->borrow(public_key->get());
+            private_key->borrow(private_key->get());
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes bn big endian into exactly length bytes.
+ */
+static int bignum_to_padded(const BIGNUM* bn, CK_BYTE* out, size_t length) {
+    size_t bignumSize = BN_num_bytes(bn);
+
+    if (bignumSize > length) {
+        return -1;
+    }
+    memset(out, 0, length - bignumSize);
+    BN_bn2bin(bn, out + length - bignumSize);
+    return 0;
+}
+
+static int generate_ec_keypair(const keymaster0_device_t* dev, const void* key_params,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    CK_BBOOL bTRUE = CK_TRUE;
+
+    keymaster_ec_keygen_params_t* ec_params = (keymaster_ec_keygen_params_t*) key_params;
+    if (ec_params->field_size != 256) {
+        ALOGW("Unsupported EC field size %d", ec_params->field_size);
+        return -1;
+    }
+
+    CK_MECHANISM mechanism = {
+            CKM_EC_KEY_PAIR_GEN, NULL, 0,
+    };
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),   objId->length()},
+            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
+            {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       const_cast<CK_BYTE*>(P256_PARAMS), sizeof(P256_PARAMS)},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,              objId->get(),   objId->length()},
+            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
+            {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
+    };
+
+    CryptoSession session(get_context(dev));
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session.check(C_GenerateKeyPair(session.get(),
+            &mechanism,
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey,
+            &hPrivateKey));
+
+    if (rv != CKR_OK) {
+        ALOGE("Generate EC keypair failed: 0x%x", rv);
+        return -1;
+    }
+
+    ObjectHandle publicKey(&session, hPublicKey);
+    ObjectHandle privateKey(&session, hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+
+    return keyblob_save(objId.get(), key_blob, key_blob_length);
+}
+
+/**
+ * Generates and destroys a session EC keypair, to find out whether the
+ * secure world implements EC at all.
+ */
+static bool probe_ec_support(TeeContext* context) {
+    CK_BBOOL bTRUE = CK_TRUE;
+    CK_BBOOL bFALSE = CK_FALSE;
+
+    CK_MECHANISM mechanism = {
+            CKM_EC_KEY_PAIR_GEN, NULL, 0,
+    };
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_TOKEN,           &bFALSE,        sizeof(bFALSE)},
+            {CKA_VERIFY,          &bTRUE,         sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       const_cast<CK_BYTE*>(P256_PARAMS), sizeof(P256_PARAMS)},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_TOKEN,           &bFALSE,        sizeof(bFALSE)},
+            {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
+    };
+
+    CryptoSession session(context);
+
+    CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
+    CK_RV rv = session.check(C_GenerateKeyPair(session.get(),
+            &mechanism,
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey,
+            &hPrivateKey));
+    if (rv != CKR_OK) {
+        ALOGI("EC keys are not supported by the TEE: 0x%x", rv);
+        return false;
+    }
 
-    object->reset(tmpHandle);
-    return 0;
+    C_DestroyObject(session.get(), hPrivateKey);
+    C_DestroyObject(session.get(), hPublicKey);
+
+    return true;
 }
 
-static int keyblob_restore(const CryptoSession* session, const uint8_t* keyBlob,
-        const size_t keyBlobLength, ObjectHandle* public_key, ObjectHandle* private_key) {
-    if (keyBlob == NULL) {
-        ALOGE("key blob was null");
-        return -1;
-    }
+/**
+ * Moves a stocked keypair of the requested size into the token under objId.
+ * Returns -1 if there is none or it could not be copied.
+ */
+static int claim_stocked_keypair(const CryptoSession* session, CK_ULONG modulusBits,
+        uint64_t publicExponent, ByteArray* objId, ObjectHandle* publicKey,
+        ObjectHandle* privateKey) {
+    CK_BBOOL bTRUE = CK_TRUE;
+    CK_OBJECT_HANDLE hStockPublic, hStockPrivate;
 
-    if (keyBlobLength < (sizeof(KEY_VERSION) + ID_LENGTH)) {
-        ALOGE("key blob is not correct size");
+    if (!session->getContext()->stock.claim(modulusBits, publicExponent,
+            &hStockPublic, &hStockPrivate)) {
         return -1;
     }
 
-    uint32_t keyVersion = 0;
+    CK_ATTRIBUTE copyTemplate[] = {
+            {CKA_ID,              objId->get(),   objId->length()},
+            {CKA_TOKEN,           &bTRUE,         sizeof(bTRUE)},
+    };
 
-    const uint8_t* p = keyBlob;
-    for (size_t i = 0; i < sizeof(keyVersion); i++) {
-        keyVersion = (keyVersion << 8) | *p++;
+    CK_OBJECT_HANDLE hPublicKey = CK_INVALID_HANDLE, hPrivateKey = CK_INVALID_HANDLE;
+    CK_RV rv = session->check(C_CopyObject(session->get(), hStockPublic, copyTemplate,
+            sizeof(copyTemplate)/sizeof(CK_ATTRIBUTE), &hPublicKey));
+    if (rv == CKR_OK) {
+        publicKey->reset(hPublicKey);
+        rv = session->check(C_CopyObject(session->get(), hStockPrivate, copyTemplate,
+                sizeof(copyTemplate)/sizeof(CK_ATTRIBUTE), &hPrivateKey));
+    }
+    if (rv == CKR_OK) {
+        privateKey->reset(hPrivateKey);
     }
 
-    if (keyVersion != 1) {
-        ALOGE("Invalid key version %d", keyVersion);
+    // The stocked session objects are not needed either way
+    C_DestroyObject(session->get(), hStockPublic);
+    C_DestroyObject(session->get(), hStockPrivate);
+
+    if (rv != CKR_OK) {
+        ALOGW("Could not copy a stocked key: 0x%x", rv);
+        session->getContext()->stock.disable("Stocked keys cannot be claimed");
+        if (hPublicKey != CK_INVALID_HANDLE) {
+            C_DestroyObject(session->get(), hPublicKey);
+        }
         return -1;
     }
 
-    return find_single_object(p, ID_LENGTH, CKO_PUBLIC_KEY, session, public_key)
-            || find_single_object(p, ID_LENGTH, CKO_PRIVATE_KEY, session, private_key);
+    return 0;
 }
 
 static int tee_generate_keypair(const keymaster0_device_t* dev,
@@ -332,13 +1338,15 @@ static int tee_generate_keypair(const keymaster0_device_t* dev,
         uint8_t** key_blob, size_t* key_blob_length) {
     CK_BBOOL bTRUE = CK_TRUE;
 
-    if (type != TYPE_RSA) {
-        ALOGW("Unknown key type %d", type);
+    if (key_params == NULL) {
+        ALOGW("generate_keypair params were NULL");
         return -1;
     }
 
-    if (key_params == NULL) {
-        ALOGW("generate_keypair params were NULL");
+    if (type == TYPE_EC) {
+        return generate_ec_keypair(dev, key_params, key_blob, key_blob_length);
+    } else if (type != TYPE_RSA) {
+        ALOGW("Unknown key type %d", type);
         return -1;
     }
 
@@ -382,25 +1390,133 @@ static int tee_generate_keypair(const keymaster0_device_t* dev,
             {CKA_SIGN,            &bTRUE,         sizeof(bTRUE)},
     };
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
+
+    ObjectHandle publicKey(&session);
+    ObjectHandle privateKey(&session);
+
+    if (claim_stocked_keypair(&session, modulusBits, exp, objId.get(),
+            &publicKey, &privateKey) == 0) {
+        ALOGV("Claimed a stocked key, public handle = 0x%x, private handle = 0x%x",
+                publicKey.get(), privateKey.get());
+        return keyblob_save(objId.get(), key_blob, key_blob_length);
+    }
 
     CK_OBJECT_HANDLE hPublicKey, hPrivateKey;
-    CK_RV rv = C_GenerateKeyPair(session.get(),
+    CK_RV rv = session.check(C_GenerateKeyPair(session.get(),
             &mechanism,
             publicKeyTemplate,
             sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
             privateKeyTemplate,
             sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
             &hPublicKey,
-            &hPrivateKey);
+            &hPrivateKey));
 
     if (rv != CKR_OK) {
         ALOGE("Generate keypair failed: 0x%x", rv);
         return -1;
     }
 
+    publicKey.reset(hPublicKey);
+    privateKey.reset(hPrivateKey);
+    ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
+
+    return keyblob_save(objId.get(), key_blob, key_blob_length);
+}
+
+static int import_ec_keypair(const keymaster0_device_t* dev, EVP_PKEY* pkey,
+        uint8_t** key_blob, size_t* key_blob_length) {
+    CK_RV rv;
+    CK_BBOOL bTRUE = CK_TRUE;
+
+    Unique_EC_KEY ec(EVP_PKEY_get1_EC_KEY(pkey));
+    if (ec.get() == NULL) {
+        logOpenSSLError("tee_import_keypair");
+        return -1;
+    }
+
+    const EC_GROUP* group = EC_KEY_get0_group(ec.get());
+    if (group == NULL || EC_GROUP_get_curve_name(group) != NID_X9_62_prime256v1) {
+        ALOGE("Unsupported EC curve");
+        return -1;
+    }
+
+    /*
+     * CKA_EC_POINT is the DER encoding of an OCTET STRING holding the
+     * uncompressed point.
+     */
+    CK_BYTE point[2 + 1 + 2 * P256_LENGTH];
+    point[0] = V_ASN1_OCTET_STRING;
+    point[1] = sizeof(point) - 2;
+    if (EC_POINT_point2oct(group, EC_KEY_get0_public_key(ec.get()),
+            POINT_CONVERSION_UNCOMPRESSED, point + 2, sizeof(point) - 2, NULL)
+            != sizeof(point) - 2) {
+        logOpenSSLError("tee_import_keypair");
+        return -1;
+    }
+
+    CK_BYTE value[P256_LENGTH];
+    if (bignum_to_padded(EC_KEY_get0_private_key(ec.get()), value, sizeof(value))) {
+        ALOGW("Could not convert the private key");
+        return -1;
+    }
+
+    CK_KEY_TYPE ecType = CKK_EC;
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_OBJECT_CLASS privClass = CKO_PRIVATE_KEY;
+
+    Unique_ByteArray objId(generate_random_id());
+    if (objId.get() == NULL) {
+        ALOGE("Couldn't generate random key ID");
+        return -1;
+    }
+
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+            {CKA_ID,              objId->get(),          objId->length()},
+            {CKA_TOKEN,           &bTRUE,                sizeof(bTRUE)},
+            {CKA_CLASS,           &pubClass,             sizeof(pubClass)},
+            {CKA_KEY_TYPE,        &ecType,               sizeof(ecType)},
+            {CKA_VERIFY,          &bTRUE,                sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       const_cast<CK_BYTE*>(P256_PARAMS), sizeof(P256_PARAMS)},
+            {CKA_EC_POINT,        point,                 sizeof(point)},
+    };
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+            {CKA_ID,              objId->get(),          objId->length()},
+            {CKA_TOKEN,           &bTRUE,                sizeof(bTRUE)},
+            {CKA_CLASS,           &privClass,            sizeof(privClass)},
+            {CKA_KEY_TYPE,        &ecType,               sizeof(ecType)},
+            {CKA_SIGN,            &bTRUE,                sizeof(bTRUE)},
+            {CKA_EC_PARAMS,       const_cast<CK_BYTE*>(P256_PARAMS), sizeof(P256_PARAMS)},
+            {CKA_VALUE,           value,                 sizeof(value)},
+    };
+
+    CryptoSession session(get_context(dev));
+
+    CK_OBJECT_HANDLE hPublicKey;
+    rv = session.check(C_CreateObject(session.get(),
+            publicKeyTemplate,
+            sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPublicKey));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of public key failed: 0x%x", rv);
+        OPENSSL_cleanse(value, sizeof(value));
+        return -1;
+    }
     ObjectHandle publicKey(&session, hPublicKey);
+
+    CK_OBJECT_HANDLE hPrivateKey;
+    rv = session.check(C_CreateObject(session.get(),
+            privateKeyTemplate,
+            sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+            &hPrivateKey));
+    OPENSSL_cleanse(value, sizeof(value));
+    if (rv != CKR_OK) {
+        ALOGE("Creation of private key failed: 0x%x", rv);
+        return -1;
+    }
     ObjectHandle privateKey(&session, hPrivateKey);
+
     ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
     return keyblob_save(objId.get(), key_blob, key_blob_length);
@@ -430,7 +1546,9 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
         return -1;
     }
 
-    if (EVP_PKEY_type(pkey->type) != EVP_PKEY_RSA) {
+    if (EVP_PKEY_type(pkey->type) == EVP_PKEY_EC) {
+        return import_ec_keypair(dev, pkey.get(), key_blob, key_blob_length);
+    } else if (EVP_PKEY_type(pkey->type) != EVP_PKEY_RSA) {
         ALOGE("Unsupported key type: %d", EVP_PKEY_type(pkey->type));
         return -1;
     }
@@ -474,13 +1592,13 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
             {CKA_PUBLIC_EXPONENT, publicExponent->get(), publicExponent->length()},
     };
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
 
     CK_OBJECT_HANDLE hPublicKey;
-    rv = C_CreateObject(session.get(),
+    rv = session.check(C_CreateObject(session.get(),
             publicKeyTemplate,
             sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
-            &hPublicKey);
+            &hPublicKey));
     if (rv != CKR_OK) {
         ALOGE("Creation of public key failed: 0x%x", rv);
         return -1;
@@ -595,10 +1713,10 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
     }
 
     CK_OBJECT_HANDLE hPrivateKey;
-    rv = C_CreateObject(session.get(),
+    rv = session.check(C_CreateObject(session.get(),
             privateKeyTemplate.get(),
             templateOffset,
-            &hPrivateKey);
+            &hPrivateKey));
     if (rv != CKR_OK) {
         ALOGE("Creation of private key failed: 0x%x", rv);
         return -1;
@@ -610,16 +1728,108 @@ static int tee_import_keypair(const keymaster0_device_t* dev,
     return keyblob_save(objId.get(), key_blob, key_blob_length);
 }
 
+/**
+ * Encodes a public key as an X.509 SubjectPublicKeyInfo.
+ */
+static int export_public_key(EVP_PKEY* pkey, uint8_t** x509_data, size_t* x509_data_length) {
+    int len = i2d_PUBKEY(pkey, NULL);
+    if (len <= 0) {
+        logOpenSSLError("tee_get_keypair_public");
+        return -1;
+    }
+
+    UniquePtr<uint8_t> key(static_cast<uint8_t*>(malloc(len)));
+    if (key.get() == NULL) {
+        ALOGE("Could not allocate memory for public key data");
+        return -1;
+    }
+
+    unsigned char* tmp = reinterpret_cast<unsigned char*>(key.get());
+    if (i2d_PUBKEY(pkey, &tmp) != len) {
+        logOpenSSLError("tee_get_keypair_public");
+        return -1;
+    }
+
+    ALOGV("Length of x509 data is %d", len);
+    *x509_data_length = len;
+    *x509_data = key.release();
+
+    return 0;
+}
+
+static int export_ec_public_key(const CryptoSession* session, const ObjectHandle* publicKey,
+        uint8_t** x509_data, size_t* x509_data_length) {
+    // Large enough for P-256, so no call is needed to get the sizes first
+    CK_BYTE params[sizeof(P256_PARAMS)];
+    CK_BYTE point[2 + 1 + 2 * P256_LENGTH];
+
+    CK_ATTRIBUTE attributes[] = {
+            {CKA_EC_PARAMS,       params, sizeof(params)},
+            {CKA_EC_POINT,        point,  sizeof(point)},
+    };
+
+    CK_RV rv = session->check(C_GetAttributeValue(session->get(), publicKey->get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
+    if (rv != CKR_OK) {
+        ALOGW("Could not query attribute values: 0x%02x", rv);
+        return -1;
+    }
+
+    if (attributes[0].ulValueLen != sizeof(P256_PARAMS)
+            || memcmp(params, P256_PARAMS, sizeof(P256_PARAMS)) != 0) {
+        ALOGW("Unsupported EC parameters");
+        return -1;
+    }
+
+    // Take the point out of its OCTET STRING, if the TEE wrapped it
+    const unsigned char* tmp = point;
+    long pointLength = attributes[1].ulValueLen;
+    if (pointLength == sizeof(point) && point[0] == V_ASN1_OCTET_STRING) {
+        tmp += 2;
+        pointLength -= 2;
+    }
+
+    Unique_EC_KEY ec(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (ec.get() == NULL) {
+        logOpenSSLError("tee_get_keypair_public");
+        return -1;
+    }
+    // Name the curve in the encoding rather than spelling out its parameters
+    EC_KEY_set_asn1_flag(ec.get(), OPENSSL_EC_NAMED_CURVE);
+
+    EC_KEY* ecKey = ec.get();
+    if (o2i_ECPublicKey(&ecKey, &tmp, pointLength) == NULL) {
+        logOpenSSLError("tee_get_keypair_public");
+        return -1;
+    }
+
+    Unique_EVP_PKEY pkey(EVP_PKEY_new());
+    if (pkey.get() == NULL) {
+        ALOGE("Could not allocate EVP_PKEY structure");
+        return -1;
+    }
+    if (EVP_PKEY_assign_EC_KEY(pkey.get(), ec.get()) != 1) {
+        logOpenSSLError("tee_get_keypair_public");
+        return -1;
+    }
+    OWNERSHIP_TRANSFERRED(ec);
+
+    return export_public_key(pkey.get(), x509_data, x509_data_length);
+}
+
 static int tee_get_keypair_public(const keymaster0_device* dev,
         const uint8_t* key_blob, const size_t key_blob_length,
         uint8_t** x509_data, size_t* x509_data_length) {
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
+    CachedKey cachedKey(&session.getContext()->keys);
 
     ObjectHandle publicKey(&session);
     ObjectHandle privateKey(&session);
+    CK_KEY_TYPE keyType;
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey, &keyType,
+            &cachedKey)) {
         return -1;
     }
 
@@ -628,16 +1838,25 @@ static int tee_get_keypair_public(const keymaster0_device* dev,
         return -1;
     }
 
+    if (keyType == CKK_EC) {
+        if (export_ec_public_key(&session, &publicKey, x509_data, x509_data_length)) {
+            cachedKey.invalidate();
+            return -1;
+        }
+        return 0;
+    }
+
     CK_ATTRIBUTE attributes[] = {
             {CKA_MODULUS,         NULL, 0},
             {CKA_PUBLIC_EXPONENT, NULL, 0},
     };
 
     // Call first to get the sizes of the values.
-    CK_RV rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes)/sizeof(CK_ATTRIBUTE));
+    CK_RV rv = session.check(C_GetAttributeValue(session.get(), publicKey.get(), attributes,
+            sizeof(attributes)/sizeof(CK_ATTRIBUTE)));
     if (rv != CKR_OK) {
         ALOGW("Could not query attribute value sizes: 0x%02x", rv);
+        cachedKey.invalidate();
         return -1;
     }
 
@@ -647,8 +1866,8 @@ static int tee_get_keypair_public(const keymaster0_device* dev,
     attributes[0].pValue = modulus.get();
     attributes[1].pValue = exponent.get();
 
-    rv = C_GetAttributeValue(session.get(), publicKey.get(), attributes,
-            sizeof(attributes) / sizeof(CK_ATTRIBUTE));
+    rv = session.check(C_GetAttributeValue(session.get(), publicKey.get(), attributes,
+            sizeof(attributes) / sizeof(CK_ATTRIBUTE)));
     if (rv != CKR_OK) {
         ALOGW("Could not query attribute values: 0x%02x", rv);
         return -1;
@@ -697,52 +1916,37 @@ static int tee_get_keypair_public(const keymaster0_device* dev,
     }
     OWNERSHIP_TRANSFERRED(rsa);
 
-    int len = i2d_PUBKEY(pkey.get(), NULL);
-    if (len <= 0) {
-        logOpenSSLError("tee_get_keypair_public");
-        return -1;
-    }
-
-    UniquePtr<uint8_t> key(static_cast<uint8_t*>(malloc(len)));
-    if (key.get() == NULL) {
-        ALOGE("Could not allocate memory for public key data");
-        return -1;
-    }
-
-    unsigned char* tmp = reinterpret_cast<unsigned char*>(key.get());
-    if (i2d_PUBKEY(pkey.get(), &tmp) != len) {
-        logOpenSSLError("tee_get_keypair_public");
-        return -1;
-    }
-
-    ALOGV("Length of x509 data is %d", len);
-    *x509_data_length = len;
-    *x509_data = key.release();
-
-    return 0;
+    return export_public_key(pkey.get(), x509_data, x509_data_length);
 }
 
 static int tee_delete_keypair(const keymaster0_device_t* dev,
             const uint8_t* key_blob, const size_t key_blob_length) {
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
+
+    // The cached handles must not outlive the objects.
+    const uint8_t* id = keyblob_get_id(key_blob, key_blob_length);
+    if (id != NULL) {
+        session.getContext()->keys.remove(id);
+    }
 
     ObjectHandle publicKey(&session);
     ObjectHandle privateKey(&session);
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey, NULL,
+            NULL)) {
         return -1;
     }
 
     // Delete the private key.
-    CK_RV rv = C_DestroyObject(session.get(), privateKey.get());
+    CK_RV rv = session.check(C_DestroyObject(session.get(), privateKey.get()));
     if (rv != CKR_OK) {
         ALOGW("Could destroy private key object: 0x%02x", rv);
         return -1;
     }
 
     // Delete the public key.
-    rv = C_DestroyObject(session.get(), publicKey.get());
+    rv = session.check(C_DestroyObject(session.get(), publicKey.get()));
     if (rv != CKR_OK) {
         ALOGW("Could destroy public key object: 0x%02x", rv);
         return -1;
@@ -751,6 +1955,68 @@ static int tee_delete_keypair(const keymaster0_device_t* dev,
     return 0;
 }
 
+/**
+ * Converts a raw r || s ECDSA signature from the TEE to the DER encoding
+ * keystore expects.
+ */
+static int ecdsa_raw_to_der(const CK_BYTE* signature, CK_ULONG signatureLength,
+        uint8_t** der, size_t* derLength) {
+    if (signatureLength != 2 * P256_LENGTH) {
+        ALOGW("Unexpected ECDSA signature length %lu", (unsigned long) signatureLength);
+        return -1;
+    }
+
+    Unique_ECDSA_SIG sig(ECDSA_SIG_new());
+    if (sig.get() == NULL
+            || BN_bin2bn(signature, P256_LENGTH, sig->r) == NULL
+            || BN_bin2bn(signature + P256_LENGTH, P256_LENGTH, sig->s) == NULL) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+
+    int len = i2d_ECDSA_SIG(sig.get(), NULL);
+    if (len <= 0) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+
+    UniquePtr<uint8_t[]> encoded(new uint8_t[len]);
+    if (encoded.get() == NULL) {
+        ALOGE("Couldn't allocate memory for the signature");
+        return -1;
+    }
+
+    unsigned char* tmp = encoded.get();
+    if (i2d_ECDSA_SIG(sig.get(), &tmp) != len) {
+        logOpenSSLError("tee_sign_data");
+        return -1;
+    }
+
+    *der = encoded.release();
+    *derLength = len;
+    return 0;
+}
+
+/**
+ * Converts a DER encoded ECDSA signature to the raw r || s the TEE takes.
+ */
+static int ecdsa_der_to_raw(const uint8_t* der, size_t derLength, CK_BYTE* signature) {
+    const unsigned char* tmp = der;
+    Unique_ECDSA_SIG sig(d2i_ECDSA_SIG(NULL, &tmp, derLength));
+    if (sig.get() == NULL) {
+        logOpenSSLError("tee_verify_data");
+        return -1;
+    }
+
+    if (bignum_to_padded(sig->r, signature, P256_LENGTH)
+            || bignum_to_padded(sig->s, signature + P256_LENGTH, P256_LENGTH)) {
+        ALOGW("ECDSA signature values are too large");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int tee_sign_data(const keymaster0_device_t* dev,
         const void* params,
         const uint8_t* key_blob, const size_t key_blob_length,
@@ -765,44 +2031,66 @@ static int tee_sign_data(const keymaster0_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
+    CachedKey cachedKey(&session.getContext()->keys);
 
     ObjectHandle publicKey(&session);
     ObjectHandle privateKey(&session);
+    CK_KEY_TYPE keyType;
 
-    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey)) {
+    if (keyblob_restore(&session, key_blob, key_blob_length, &publicKey, &privateKey, &keyType,
+            &cachedKey)) {
         return -1;
     }
     ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
-        return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
-        return -1;
-    }
-
-    CK_MECHANISM rawRsaMechanism = {
+    CK_MECHANISM mechanism = {
             CKM_RSA_X_509, NULL, 0
     };
+    size_t signLength = dataLength;
+
+    if (keyType == CKK_EC) {
+        keymaster_ec_sign_params_t* sign_params = (keymaster_ec_sign_params_t*) params;
+        if (sign_params->digest_type != DIGEST_NONE) {
+            ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+            return -1;
+        }
+        mechanism.mechanism = CKM_ECDSA;
+        // ECDSA signs the leftmost bits of a longer digest
+        if (signLength > P256_LENGTH) {
+            signLength = P256_LENGTH;
+        }
+    } else {
+        keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
+        if (sign_params->digest_type != DIGEST_NONE) {
+            ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+            return -1;
+        } else if (sign_params->padding_type != PADDING_NONE) {
+            ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+            return -1;
+        }
+    }
 
-    CK_RV rv = C_SignInit(session.get(), &rawRsaMechanism, privateKey.get());
+    CK_RV rv = session.check(C_SignInit(session.get(), &mechanism, privateKey.get()));
     if (rv != CKR_OK) {
         ALOGV("C_SignInit failed: 0x%x", rv);
+        cachedKey.invalidate();
         return -1;
     }
 
     CK_BYTE signature[1024];
     CK_ULONG signatureLength = 1024;
 
-    rv = C_Sign(session.get(), data, dataLength, signature, &signatureLength);
+    rv = session.check(C_Sign(session.get(), data, signLength, signature, &signatureLength));
     if (rv != CKR_OK) {
         ALOGV("C_SignFinal failed: 0x%x", rv);
         return -1;
     }
 
+    if (keyType == CKK_EC) {
+        return ecdsa_raw_to_der(signature, signatureLength, signedData, signedDataLength);
+    }
+
     UniquePtr<uint8_t[]> finalSignature(new uint8_t[signatureLength]);
     if (finalSignature.get() == NULL) {
         ALOGE("Couldn't allocate memory to copy signature");
@@ -835,38 +2123,63 @@ static int tee_verify_data(const keymaster0_device_t* dev,
         return -1;
     }
 
-    CryptoSession session(reinterpret_cast<CK_SESSION_HANDLE>(dev->context));
+    CryptoSession session(get_context(dev));
+    CachedKey cachedKey(&session.getContext()->keys);
 
     ObjectHandle publicKey(&session);
     ObjectHandle privateKey(&session);
+    CK_KEY_TYPE keyType;
 
-    if (keyblob_restore(&session, keyBlob, keyBlobLength, &publicKey, &privateKey)) {
+    if (keyblob_restore(&session, keyBlob, keyBlobLength, &publicKey, &privateKey, &keyType,
+            &cachedKey)) {
         return -1;
     }
     ALOGV("public handle = 0x%x, private handle = 0x%x", publicKey.get(), privateKey.get());
 
-    keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
-    if (sign_params->digest_type != DIGEST_NONE) {
-        ALOGW("Cannot handle digest type %d", sign_params->digest_type);
-        return -1;
-    } else if (sign_params->padding_type != PADDING_NONE) {
-        ALOGW("Cannot handle padding type %d", sign_params->padding_type);
-        return -1;
-    }
-
-    CK_MECHANISM rawRsaMechanism = {
+    CK_MECHANISM mechanism = {
             CKM_RSA_X_509, NULL, 0
     };
+    size_t verifyLength = signedDataLength;
+    CK_BYTE rawSignature[2 * P256_LENGTH];
+    CK_BYTE* verifySignature = const_cast<unsigned char*>(signature);
+    size_t verifySignatureLength = signatureLength;
+
+    if (keyType == CKK_EC) {
+        keymaster_ec_sign_params_t* sign_params = (keymaster_ec_sign_params_t*) params;
+        if (sign_params->digest_type != DIGEST_NONE) {
+            ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+            return -1;
+        }
+        mechanism.mechanism = CKM_ECDSA;
+        if (verifyLength > P256_LENGTH) {
+            verifyLength = P256_LENGTH;
+        }
+        if (ecdsa_der_to_raw(signature, signatureLength, rawSignature)) {
+            return -1;
+        }
+        verifySignature = rawSignature;
+        verifySignatureLength = sizeof(rawSignature);
+    } else {
+        keymaster_rsa_sign_params_t* sign_params = (keymaster_rsa_sign_params_t*) params;
+        if (sign_params->digest_type != DIGEST_NONE) {
+            ALOGW("Cannot handle digest type %d", sign_params->digest_type);
+            return -1;
+        } else if (sign_params->padding_type != PADDING_NONE) {
+            ALOGW("Cannot handle padding type %d", sign_params->padding_type);
+            return -1;
+        }
+    }
 
-    CK_RV rv = C_VerifyInit(session.get(), &rawRsaMechanism, publicKey.get());
+    CK_RV rv = session.check(C_VerifyInit(session.get(), &mechanism, publicKey.get()));
     if (rv != CKR_OK) {
         ALOGV("C_VerifyInit failed: 0x%x", rv);
+        cachedKey.invalidate();
         return -1;
     }
 
     // This is a bad prototype for this function. C_Verify should have only const args.
-    rv = C_Verify(session.get(), signedData, signedDataLength,
-            const_cast<unsigned char*>(signature), signatureLength);
+    rv = session.check(C_Verify(session.get(), signedData, verifyLength,
+            verifySignature, verifySignatureLength));
     if (rv != CKR_OK) {
         ALOGV("C_Verify failed: 0x%x", rv);
         return -1;
@@ -879,10 +2192,20 @@ static int tee_verify_data(const keymaster0_device_t* dev,
 static int tee_close(hw_device_t *dev) {
     keymaster0_device_t *keymaster_dev = (keymaster0_device_t *) dev;
     if (keymaster_dev != NULL) {
-        CK_SESSION_HANDLE handle = reinterpret_cast<CK_SESSION_HANDLE>(keymaster_dev->context);
+        TeeContext* context = get_context(keymaster_dev);
+        CK_SESSION_HANDLE handle = context->sessions.getPrimary();
+        uint64_t hits, misses;
+        context->keys.getStats(&hits, &misses);
+        ALOGI("Key cache: %llu hits, %llu misses", (unsigned long long) hits,
+                (unsigned long long) misses);
+        context->stock.stop();
+        context->keys.clear(true);
+        context->sessions.closeIdle();
         if (handle != CK_INVALID_HANDLE) {
             C_CloseSession(handle);
         }
+        context->sessions.invalidate();
+        delete context;
     }
 
     CK_RV finalizeRV = C_Finalize(NULL_PTR);
@@ -953,10 +2276,23 @@ static int tee_open(const hw_module_t* module, const char* name,
         return -1;
     }
 
+    TeeContext* context = new TeeContext(sessionHandle);
+    if (context == NULL) {
+        C_CloseSession(sessionHandle);
+        (void) C_Finalize(NULL_PTR);
+        return -ENOMEM;
+    }
+    context->sessions.fill(1);
+    context->stock.start();
+
+    if (probe_ec_support(context)) {
+        dev->flags |= KEYMASTER_SUPPORTS_EC;
+    }
+
     ERR_load_crypto_strings();
     ERR_load_BIO_strings();
 
-    dev->context = reinterpret_cast<void*>(sessionHandle);
+    dev->context = reinterpret_cast<void*>(context);
     *device = reinterpret_cast<hw_device_t*>(dev.release());
 
     return 0;
@@ -27,10 +27,65 @@ LOCAL_SHARED_LIBRARIES := \
 
 LOCAL_SRC_FILES := \
     powerhal.cpp \
-    powerhal_utils.cpp
+    powerhal_utils.cpp \
+    timeoutpoker.cpp \
+    inputwatcher.cpp
 
 LOCAL_MODULE := power.grouper
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_PATH := $(TARGET_OUT_VENDOR_SHARED_LIBRARIES)/hw
 
 include $(BUILD_SHARED_LIBRARY)
+
+# Offline compiler for power_profiles.conf
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := profilec.cpp
+
+LOCAL_MODULE := power_profilec
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Compiled power profile table, mmap()ed by power.grouper
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := power_profiles.bin
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_PATH := $(TARGET_OUT_VENDOR)/etc
+
+include $(BUILD_SYSTEM)/base_rules.mk
+
+POWER_PROFILEC := $(HOST_OUT_EXECUTABLES)/power_profilec$(HOST_EXECUTABLE_SUFFIX)
+
+$(LOCAL_BUILT_MODULE): PRIVATE_PROFILEC := $(POWER_PROFILEC)
+$(LOCAL_BUILT_MODULE): $(LOCAL_PATH)/power_profiles.conf $(POWER_PROFILEC)
+	@echo "Power profiles: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_PROFILEC) $< $@
+
+# Host replay benchmark against a fake sysfs tree
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    powerhal.cpp \
+    powerhal_utils.cpp \
+    timeoutpoker.cpp \
+    inputwatcher.cpp \
+    bench/powerhal_bench.cpp
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_CFLAGS := -DPOWERHAL_ROOT=\"/dev/shm/powerhal_bench\"
+
+LOCAL_STATIC_LIBRARIES := \
+    libutils \
+    libcutils \
+    liblog
+
+LOCAL_LDLIBS := -lpthread -lrt -ldl
+
+LOCAL_MODULE := powerhal_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
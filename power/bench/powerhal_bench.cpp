@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * powerhal_bench: replays power hint traces through the power HAL entry
+ * points against a fake sysfs tree under POWERHAL_ROOT, then prints the
+ * caller-visible latency of each entry point followed by powerhal_dump().
+ *
+ * usage: powerhal_bench [-n iterations] [-s speed] [trace]
+ *
+ * A trace has one event per line: "<delay_ms> <event> [arg]", where event is
+ * one of interaction, launch, profile <n> or interactive <0|1>. Without a
+ * trace a built-in touch/launch/profile/screen workload is replayed. The
+ * delays are scaled by 1/speed; a speed of 0 replays as fast as possible.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "powerhal.h"
+
+#ifndef POWERHAL_ROOT
+#error "POWERHAL_ROOT must point at the fake sysfs tree"
+#endif
+
+extern struct power_module HAL_MODULE_INFO_SYM;
+
+enum {
+    EV_INTERACTION = 0,
+    EV_LAUNCH,
+    EV_PROFILE,
+    EV_INTERACTIVE,
+    EV_MAX
+};
+
+static const char *event_names[EV_MAX] = {
+    "interaction",
+    "launch",
+    "profile",
+    "interactive",
+};
+
+struct trace_event {
+    int delay_ms;
+    int type;
+    int arg;
+};
+
+struct fake_node {
+    const char *path;
+    const char *value;
+};
+
+static const struct fake_node fake_nodes[] = {
+    { "/sys/devices/system/cpu/cpufreq/interactive/boostpulse", "" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/boostpulse_duration", "80000\n" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/go_hispeed_load", "99\n" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/hispeed_freq", "1000000\n" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/io_is_busy", "0\n" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/min_sample_time", "80000\n" },
+    { "/sys/devices/system/cpu/cpufreq/interactive/target_loads", "90\n" },
+    { "/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq", "1300000\n" },
+    { "/sys/devices/system/cpu/cpu0/cpufreq/scaling_available_frequencies",
+      "51000 102000 204000 340000 475000 640000 760000 860000 1000000 "
+      "1100000 1200000 1300000 \n" },
+    { "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/idle_top_freq", "475000\n" },
+    { "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/no_lp", "0\n" },
+    { "/sys/devices/platform/host1x/nvavp/boost_sclk", "0\n" },
+    { "/sys/class/input/input0/name", "gpio-keys\n" },
+    { "/sys/class/input/input0/enabled", "1\n" },
+    { "/sys/class/input/input1/name", "elan-touchscreen\n" },
+    { "/sys/class/input/input1/enabled", "1\n" },
+    { "/dev/cpu_freq_min", "" },
+    { "/dev/min_online_cpus", "" },
+};
+
+static int mkdirs(char *path)
+{
+    char *p;
+
+    for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        *p = '/';
+    }
+
+    return 0;
+}
+
+static int create_fake_tree(void)
+{
+    char path[256];
+    FILE *fp;
+    size_t i;
+
+    for (i = 0; i < sizeof(fake_nodes) / sizeof(fake_nodes[0]); i++) {
+        snprintf(path, sizeof(path), POWERHAL_ROOT "%s", fake_nodes[i].path);
+        if (mkdirs(path))
+            return -1;
+
+        fp = fopen(path, "w");
+        if (!fp) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        fputs(fake_nodes[i].value, fp);
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+static int load_trace(const char *file, std::vector<trace_event> *trace)
+{
+    char buf[128];
+    char name[32];
+    int line = 0;
+    int n;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        trace_event ev = { 0, -1, 0 };
+
+        line++;
+        if (buf[0] == '#' || buf[0] == '\n')
+            continue;
+
+        n = sscanf(buf, "%d %31s %d", &ev.delay_ms, name, &ev.arg);
+        for (int i = 0; n >= 2 && i < EV_MAX; i++) {
+            if (!strcmp(name, event_names[i]))
+                ev.type = i;
+        }
+
+        if (ev.type < 0 || ((ev.type == EV_PROFILE ||
+                             ev.type == EV_INTERACTIVE) && n != 3)) {
+            fprintf(stderr, "%s:%d: bad event\n", file, line);
+            fclose(fp);
+            return -1;
+        }
+        trace->push_back(ev);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/* Touch bursts at 60 Hz, app launches, profile switches and screen toggles */
+static void builtin_trace(std::vector<trace_event> *trace)
+{
+    trace->push_back({ 0, EV_INTERACTIVE, 1 });
+
+    for (int cycle = 0; cycle < 10; cycle++) {
+        for (int i = 0; i < 30; i++)
+            trace->push_back({ 16, EV_INTERACTION, 0 });
+        trace->push_back({ 50, EV_LAUNCH, 0 });
+        trace->push_back({ 5, EV_LAUNCH, 0 });
+        trace->push_back({ 100, EV_PROFILE, cycle % PROFILE_MAX });
+        if (cycle % 3 == 2) {
+            trace->push_back({ 200, EV_INTERACTIVE, 0 });
+            trace->push_back({ 500, EV_INTERACTIVE, 1 });
+        }
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_event(const trace_event &ev)
+{
+    struct power_module *module = &HAL_MODULE_INFO_SYM;
+    int32_t profile;
+
+    switch (ev.type) {
+    case EV_INTERACTION:
+        module->powerHint(module, POWER_HINT_INTERACTION, NULL);
+        break;
+    case EV_LAUNCH:
+        module->powerHint(module, POWER_HINT_LAUNCH, NULL);
+        break;
+    case EV_PROFILE:
+        profile = ev.arg;
+        module->powerHint(module, POWER_HINT_SET_PROFILE, &profile);
+        break;
+    case EV_INTERACTIVE:
+        module->setInteractive(module, ev.arg);
+        break;
+    }
+}
+
+/* Waits until the hint worker has handled everything queued so far */
+static void wait_idle(void)
+{
+    struct powerhal_stats st;
+
+    for (;;) {
+        powerhal_get_stats(&st);
+        if (st.hints_completed == st.hints_posted)
+            return;
+        usleep(1000);
+    }
+}
+
+static void report_latency(const char *name, std::vector<uint64_t> &samples)
+{
+    size_t n = samples.size();
+
+    if (!n)
+        return;
+
+    std::sort(samples.begin(), samples.end());
+    printf("  %-12s %8zu %9.1f %9.1f %9.1f %9.1f\n", name, n,
+           samples[n / 2] / 1000.0,
+           samples[n * 90 / 100] / 1000.0,
+           samples[n * 99 / 100] / 1000.0,
+           samples[n - 1] / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<trace_event> trace;
+    std::vector<uint64_t> latency[EV_MAX];
+    double speed = 1.0;
+    int iterations = 1;
+    uint64_t start, t, replay_ns, drain_ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s speed] [trace]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        if (load_trace(argv[optind], &trace))
+            return 1;
+    } else {
+        builtin_trace(&trace);
+    }
+
+    if (create_fake_tree())
+        return 1;
+
+    HAL_MODULE_INFO_SYM.init(&HAL_MODULE_INFO_SYM);
+
+    start = now_ns();
+    for (int it = 0; it < iterations; it++) {
+        for (size_t i = 0; i < trace.size(); i++) {
+            const trace_event &ev = trace[i];
+
+            if (speed > 0 && ev.delay_ms)
+                usleep(ev.delay_ms * 1000 / speed);
+
+            t = now_ns();
+            run_event(ev);
+            latency[ev.type].push_back(now_ns() - t);
+        }
+    }
+    replay_ns = now_ns() - start;
+
+    t = now_ns();
+    wait_idle();
+    drain_ns = now_ns() - t;
+
+    printf("replayed %zu events x %d in %.1f ms, worker drained in %.2f ms\n",
+           trace.size(), iterations, replay_ns / 1e6, drain_ns / 1e6);
+
+    printf("\ncall latency (usec)\n");
+    printf("  %-12s %8s %9s %9s %9s %9s\n", "event", "calls", "p50", "p90",
+           "p99", "max");
+    for (int i = 0; i < EV_MAX; i++)
+        report_latency(event_names[i], latency[i]);
+
+    printf("\n");
+    fflush(stdout);
+    powerhal_dump(STDOUT_FILENO);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_HAL_HINT_QUEUE_H
+#define POWER_HAL_HINT_QUEUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include <hardware/power.h>
+
+struct hint_entry {
+    power_hint_t hint;
+    uint64_t time;
+};
+
+/*
+ * Bounded multi-producer/multi-consumer queue of power hints.
+ *
+ * Every cell carries a sequence number which tells producers and consumers
+ * whether the cell is free for the current lap, so neither side ever blocks:
+ * push() fails when the queue is full and pop() fails when it is empty.
+ * SIZE must be a power of two.
+ */
+template <unsigned SIZE>
+class HintQueue
+{
+public:
+    HintQueue() : head(0), tail(0) {
+        static_assert(SIZE && !(SIZE & (SIZE - 1)),
+                      "HintQueue size must be a power of two");
+        for (unsigned i = 0; i < SIZE; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const hint_entry &entry) {
+        unsigned pos = tail.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;) {
+            cell = &cells[pos & (SIZE - 1)];
+            unsigned seq = cell->seq.load(std::memory_order_acquire);
+            int diff = (int)(seq - pos);
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->entry = entry;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(hint_entry *entry) {
+        unsigned pos = head.load(std::memory_order_relaxed);
+        Cell *cell;
+
+        for (;;) {
+            cell = &cells[pos & (SIZE - 1)];
+            unsigned seq = cell->seq.load(std::memory_order_acquire);
+            int diff = (int)(seq - (pos + 1));
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        *entry = cell->entry;
+        cell->seq.store(pos + SIZE, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<unsigned> seq;
+        hint_entry entry;
+    };
+
+    Cell cells[SIZE];
+    std::atomic<unsigned> head;
+    std::atomic<unsigned> tail;
+};
+
+#endif // POWER_HAL_HINT_QUEUE_H
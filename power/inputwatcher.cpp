@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "PowerHAL"
+
+#include <dirent.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include "powerhal_utils.h"
+#include "inputwatcher.h"
+
+#define UEVENT_MSG_LEN 2048
+
+InputWatcher::InputWatcher(const char *inputPath, const char *const *names,
+        int count)
+    : mInputPath(inputPath), mNames(names), mCount(count),
+      mNumDevices(0), mEnabled(-1), mSocket(-1)
+{
+    pthread_mutex_init(&mLock, NULL);
+}
+
+bool InputWatcher::isWatched(const char *name) const
+{
+    for (int i = 0; i < mCount; i++) {
+        if (!strncmp(name, mNames[i], MAX_NAME))
+            return true;
+    }
+
+    return false;
+}
+
+/* Must be called with mLock held */
+void InputWatcher::openEnabled(Device *dev)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%sinput%d/enabled", mInputPath, dev->id);
+    dev->enabledFd = open(path, O_WRONLY | O_CLOEXEC);
+    if (dev->enabledFd < 0)
+        ALOGE("Error opening %s: %s", path, strerror(errno));
+}
+
+/*
+ * A descriptor that failed to open or write is reopened on the next call,
+ * like the sysfs descriptor cache does.
+ *
+ * Must be called with mLock held
+ */
+void InputWatcher::writeEnabled(Device *dev, bool on)
+{
+    char buf[80];
+
+    if (!dev->watched)
+        return;
+    if (dev->enabledFd < 0) {
+        openEnabled(dev);
+        if (dev->enabledFd < 0)
+            return;
+    }
+
+    ALOGI("%sabling input device: %d", on ? "En" : "Dis", dev->id);
+    if (pwrite(dev->enabledFd, on ? "1" : "0", 1, 0) < 0) {
+        strerror_r(errno, buf, sizeof(buf));
+        ALOGE("Error writing to input%d/enabled: %s\n", dev->id, buf);
+        close(dev->enabledFd);
+        dev->enabledFd = -1;
+    }
+}
+
+/* name must hold MAX_NAME bytes, it is left empty if the read fails */
+void InputWatcher::readName(int id, char *name)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    /* Read directly, the descriptor cache is no use for one-off reads */
+    snprintf(path, sizeof(path), "%sinput%d/name", mInputPath, id);
+    memset(name, 0, MAX_NAME);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, name, MAX_NAME - 1) < 0)
+        name[0] = '\0';
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * Adds a device, or for one already known retries a name read that failed.
+ * A rescan also reads the name of known devices again, in case the id was
+ * reused by another device while uevents were lost.
+ *
+ * Must be called with mLock held
+ */
+void InputWatcher::addDevice(int id, bool rescan)
+{
+    char name[MAX_NAME];
+    Device *dev;
+    int i;
+
+    for (i = 0; i < mNumDevices; i++) {
+        if (mDevices[i].id == id)
+            break;
+    }
+
+    if (i < mNumDevices) {
+        mDevices[i].seen = true;
+        if (mDevices[i].name[0] && !rescan)
+            return;
+        readName(id, name);
+        if (!strncmp(name, mDevices[i].name, MAX_NAME))
+            return;
+        removeDevice(id);
+    } else {
+        if (mNumDevices == MAX_DEVICES) {
+            ALOGW("Too many input devices, ignoring input%d", id);
+            return;
+        }
+        readName(id, name);
+    }
+
+    dev = &mDevices[mNumDevices++];
+    dev->id = id;
+    dev->enabledFd = -1;
+    dev->seen = true;
+    dev->watched = isWatched(name);
+    strlcpy(dev->name, name, sizeof(dev->name));
+
+    if (!dev->watched)
+        return;
+
+    openEnabled(dev);
+    ALOGI("Watching input device %d: %s", id, name);
+
+    if (mEnabled >= 0)
+        writeEnabled(dev, mEnabled);
+}
+
+/* Must be called with mLock held */
+void InputWatcher::removeDevice(int id)
+{
+    for (int i = 0; i < mNumDevices; i++) {
+        if (mDevices[i].id != id)
+            continue;
+
+        if (mDevices[i].enabledFd >= 0)
+            close(mDevices[i].enabledFd);
+        mDevices[i] = mDevices[--mNumDevices];
+        return;
+    }
+}
+
+/*
+ * Rebuilds the index from sysfs: adds new devices and drops the ones no
+ * longer there. rescan is set when uevents were lost.
+ */
+void InputWatcher::scan(bool rescan)
+{
+    struct dirent *de;
+    DIR *dir;
+    int id;
+
+    dir = opendir(mInputPath);
+    if (!dir) {
+        ALOGE("Error opening %s: %s", mInputPath, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&mLock);
+    for (int i = 0; i < mNumDevices; i++)
+        mDevices[i].seen = false;
+    while ((de = readdir(dir))) {
+        if (sscanf(de->d_name, "input%d", &id) == 1)
+            addDevice(id, rescan);
+    }
+    /* Walk backwards, removeDevice() moves the last entry into the hole */
+    for (int i = mNumDevices - 1; i >= 0; i--) {
+        if (!mDevices[i].seen)
+            removeDevice(mDevices[i].id);
+    }
+    pthread_mutex_unlock(&mLock);
+
+    closedir(dir);
+}
+
+/*
+ * Input device uevents look like "add@/devices/.../input/input5" followed by
+ * NUL separated KEY=value pairs. Child nodes such as .../input5/event2 share
+ * SUBSYSTEM=input and are skipped by requiring the last path component to
+ * be inputN.
+ */
+void InputWatcher::handleUevent(const char *msg, int len)
+{
+    const char *end = msg + len;
+    const char *action = NULL;
+    const char *devpath = NULL;
+    const char *subsystem = NULL;
+    const char *base;
+    int id;
+
+    for (; msg < end; msg += strlen(msg) + 1) {
+        if (!strncmp(msg, "ACTION=", 7))
+            action = msg + 7;
+        else if (!strncmp(msg, "DEVPATH=", 8))
+            devpath = msg + 8;
+        else if (!strncmp(msg, "SUBSYSTEM=", 10))
+            subsystem = msg + 10;
+    }
+
+    if (!action || !devpath || !subsystem || strcmp(subsystem, "input"))
+        return;
+
+    base = strrchr(devpath, '/');
+    if (!base || strncmp(base + 1, "input", 5))
+        return;
+    if (sscanf(base + 1, "input%d", &id) != 1)
+        return;
+
+    /* Any other event adds the device or retries a failed name read */
+    pthread_mutex_lock(&mLock);
+    if (!strcmp(action, "remove"))
+        removeDevice(id);
+    else
+        addDevice(id, false);
+    pthread_mutex_unlock(&mLock);
+}
+
+void *InputWatcher::threadLoop(void *arg)
+{
+    InputWatcher *watcher = (InputWatcher *)arg;
+    char msg[UEVENT_MSG_LEN + 2];
+    struct sockaddr_nl addr;
+    struct iovec iov = { msg, UEVENT_MSG_LEN };
+    struct msghdr hdr;
+    ssize_t len;
+
+    pthread_setname_np(pthread_self(), "powerhal-input");
+
+    while (1) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &addr;
+        hdr.msg_namelen = sizeof(addr);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+
+        len = recvmsg(watcher->mSocket, &hdr, 0);
+        if (len < 0) {
+            if (errno != EINTR && errno != ENOBUFS)
+                ALOGE("Error reading uevent: %s", strerror(errno));
+            /* Events may have been lost, resync from sysfs */
+            if (errno == ENOBUFS)
+                watcher->scan(true);
+            continue;
+        }
+
+        /* Only trust messages from the kernel */
+        if (addr.nl_groups == 0 || addr.nl_pid != 0)
+            continue;
+
+        msg[len] = '\0';
+        msg[len + 1] = '\0';
+        watcher->handleUevent(msg, len);
+    }
+
+    return NULL;
+}
+
+int InputWatcher::start()
+{
+    struct sockaddr_nl addr;
+    int err;
+
+    /* Bind before scanning so no device can slip in between */
+    mSocket = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                     NETLINK_KOBJECT_UEVENT);
+    if (mSocket < 0) {
+        err = errno;
+        ALOGE("Error creating uevent socket: %s", strerror(err));
+        scan(false);
+        return -err;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err = errno;
+        ALOGE("Error binding uevent socket: %s", strerror(err));
+        close(mSocket);
+        mSocket = -1;
+        scan(false);
+        return -err;
+    }
+
+    scan(false);
+
+    err = pthread_create(&mThread, NULL, threadLoop, this);
+    if (err) {
+        ALOGE("Error creating input watcher thread: %s", strerror(err));
+        close(mSocket);
+        mSocket = -1;
+        return -err;
+    }
+
+    return 0;
+}
+
+void InputWatcher::setEnabled(bool on)
+{
+    pthread_mutex_lock(&mLock);
+
+    mEnabled = on;
+    for (int i = 0; i < mNumDevices; i++)
+        writeEnabled(&mDevices[i], on);
+
+    pthread_mutex_unlock(&mLock);
+}
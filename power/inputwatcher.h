@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_HAL_INPUT_WATCHER_H
+#define POWER_HAL_INPUT_WATCHER_H
+
+#include <pthread.h>
+
+/*
+ * Keeps an index of the input devices under /sys/class/input by name.
+ *
+ * The index is built from a directory scan and then maintained from kernel
+ * uevents, so devices that re-enumerate (e.g. a touchscreen after resume)
+ * are picked up without rescanning. For devices whose name is in the watch
+ * list the writable "enabled" node is kept open, and setEnabled() writes
+ * to those descriptors directly, reopening any that failed. Devices added later get the last state.
+ */
+class InputWatcher
+{
+public:
+    /* names are compared with the contents of the sysfs name node */
+    InputWatcher(const char *inputPath, const char *const *names, int count);
+
+    int start();
+    void setEnabled(bool on);
+
+private:
+    enum { MAX_DEVICES = 32, MAX_NAME = 32 };
+
+    struct Device {
+        int id;
+        int enabledFd;
+        bool watched;
+        bool seen; /* found by the scan in progress */
+        char name[MAX_NAME];
+    };
+
+    static void *threadLoop(void *arg);
+    void scan(bool rescan);
+    void handleUevent(const char *msg, int len);
+    void readName(int id, char *name);
+    void addDevice(int id, bool rescan);
+    void removeDevice(int id);
+    bool isWatched(const char *name) const;
+    void openEnabled(Device *dev);
+    void writeEnabled(Device *dev, bool on);
+
+    const char *mInputPath;
+    const char *const *mNames;
+    int mCount;
+
+    pthread_mutex_t mLock;
+    Device mDevices[MAX_DEVICES];
+    int mNumDevices;
+    /* last state set through setEnabled(), -1 if never set */
+    int mEnabled;
+
+    int mSocket;
+    pthread_t mThread;
+};
+
+#endif // POWER_HAL_INPUT_WATCHER_H
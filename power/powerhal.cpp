@@ -22,26 +22,98 @@
 
 #include "powerhal_utils.h"
 #include "powerhal.h"
+#include "hint_queue.h"
+#include "profile_file.h"
 
-#define INTERACTIVE_PATH    "/sys/devices/system/cpu/cpufreq/interactive/"
-#define CPUQUIET_PATH       "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/"
-#define CPUFREQ_CPU0_PATH   "/sys/devices/system/cpu/cpu0/cpufreq/"
-#define NVAVP_PATH          "/sys/devices/platform/host1x/nvavp/"
+#include <atomic>
+#include <sys/mman.h>
 
-#define INPUT_PATH          "/sys/class/input/"
+/* Prefix for all nodes, lets host builds run against a fake tree */
+#ifndef POWERHAL_ROOT
+#define POWERHAL_ROOT       ""
+#endif
 
-static struct input_dev_map input_devs[] = {
-    {-1, "elan-touchscreen\n"}
-};
+#define INTERACTIVE_PATH    POWERHAL_ROOT "/sys/devices/system/cpu/cpufreq/interactive/"
+#define CPUQUIET_PATH       POWERHAL_ROOT "/sys/devices/system/cpu/cpuquiet/tegra_cpuquiet/"
+#define CPUFREQ_CPU0_PATH   POWERHAL_ROOT "/sys/devices/system/cpu/cpu0/cpufreq/"
+#define NVAVP_PATH          POWERHAL_ROOT "/sys/devices/platform/host1x/nvavp/"
+
+#define INPUT_PATH          POWERHAL_ROOT "/sys/class/input/"
 
-#define MAX_FREQ_DEFAULT 1300000
+#define CPU_FREQ_MIN_PATH   POWERHAL_ROOT "/dev/cpu_freq_min"
+#define MIN_ONLINE_CPUS_PATH POWERHAL_ROOT "/dev/min_online_cpus"
+
+/* Input devices disabled while the screen is off */
+static const char *input_dev_names[] = {
+    "elan-touchscreen\n"
+};
 
 #define BUF_SIZE 80
 #define MAX_CHARS 32
 
+#define HINT_QUEUE_SIZE 64
+#define HINT_WINDOW_MS_DEFAULT 100
+
+#define BOOT_BOOST_MS_DEFAULT 60000
+#define BOOT_BOOST_POLL_MS 100
+#define MAX_ONLINE_CPUS 4
+
 static struct powerhal_info *pInfo;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+#define STATS_FILE_DEFAULT "/data/system/powerhal_stats"
+
+/*
+ * Statistics. The lock_* histograms are protected by lock, the remaining
+ * worker side counters by stats_lock. Counters updated by the threads
+ * calling into the HAL are kept in atomics below.
+ */
+static struct powerhal_stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t lock_acquired;
+
+static const char *hint_stat_names[HINT_STAT_MAX] = {
+    "interaction",
+    "launch",
+    "set_profile",
+    "reload_profiles",
+    "dump_stats",
+    "other",
+};
+
+/* Hints waiting for the worker thread */
+static HintQueue<HINT_QUEUE_SIZE> hint_queue;
+static std::atomic<unsigned long> hints_received[HINT_STAT_MAX];
+static std::atomic<unsigned long> hints_dropped(0);
+/* Worker wakeups requested and completed, equal when the worker is idle */
+static std::atomic<unsigned long> hints_posted(0);
+static std::atomic<unsigned long> hints_completed(0);
+/* Latest POWER_HINT_SET_PROFILE request not yet applied, or -1 */
+static std::atomic<int> requested_profile(-1);
+static std::atomic<bool> reload_requested(false);
+static std::atomic<bool> dump_requested(false);
+
+/* Compiled profile table backing the strings in profiles[], if loaded */
+static void *profile_map;
+static size_t profile_map_size;
+
+static void hal_lock(void)
+{
+    uint64_t start = monotonic_us();
+
+    pthread_mutex_lock(&lock);
+    lock_acquired = monotonic_us();
+
+    latency_hist_add(&stats.lock_wait, lock_acquired - start);
+}
+
+static void hal_unlock(void)
+{
+    latency_hist_add(&stats.lock_hold, monotonic_us() - lock_acquired);
+
+    pthread_mutex_unlock(&lock);
+}
+
 /*
  * grouper frequency table
  *
@@ -59,42 +131,229 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
  * 1300 MHz (single core/OC)
  * 1400 MHz (OC)
  * 1500 MHz (OC)
+ *
+ * The table is read from scaling_available_frequencies rather than assumed,
+ * as overclocked kernels add steps at the top.
  */
-
-static void find_input_device_ids()
+static int compare_int(const void *a, const void *b)
 {
-    int i = 0;
-    int status;
-    int count = 0;
-    char path[80];
-    char name[MAX_CHARS];
+    return *(const int *)a - *(const int *)b;
+}
 
-    while (1)
-    {
-        snprintf(path, sizeof(path), INPUT_PATH "input%d/name", i);
-        if (access(path, F_OK) < 0)
+static void read_available_frequencies(void)
+{
+    char buf[512];
+    char *s, *end;
+    long freq;
+    int n = 0;
+
+    memset(buf, 0, sizeof(buf));
+    sysfs_read(CPUFREQ_CPU0_PATH "scaling_available_frequencies",
+               buf, sizeof(buf) - 1);
+
+    for (s = buf; n < MAX_FREQS; s = end) {
+        freq = strtol(s, &end, 10);
+        if (end == s)
             break;
-        else {
-            memset(name, 0, MAX_CHARS);
-            sysfs_read(path, name, MAX_CHARS);
-            for (int j = 0; j < pInfo->input_cnt; j++) {
-                status = (-1 == pInfo->input_devs[j].dev_id)
-                    && (0 == strncmp(name,
-                    pInfo->input_devs[j].dev_name, MAX_CHARS));
-                if (status) {
-                    ++count;
-                    pInfo->input_devs[j].dev_id = i;
-                    ALOGI("find_input_device_ids: %d %s",
-                        pInfo->input_devs[j].dev_id,
-                        pInfo->input_devs[j].dev_name);
-                }
-            }
-            ++i;
+        if (freq > 0)
+            pInfo->available_frequencies[n++] = freq;
+    }
+
+    qsort(pInfo->available_frequencies, n, sizeof(int), compare_int);
+    pInfo->num_available_frequencies = n;
+
+    ALOGI("%s: %d frequencies, %d to %d kHz", __func__, n,
+          n ? pInfo->available_frequencies[0] : 0,
+          n ? pInfo->available_frequencies[n - 1] : 0);
+}
+
+/*
+ * Resolves a profile frequency to an entry of the frequency table: the
+ * nearest entry for a kHz value (the higher one on a tie) or the requested
+ * percentile for FREQ_PERCENTILE(p). Without a table kHz values are kept
+ * and percentiles are taken of max_frequency.
+ */
+static int resolve_frequency(int value)
+{
+    const int *freqs = pInfo->available_frequencies;
+    int n = pInfo->num_available_frequencies;
+    int pct;
+    int i;
+
+    if (value == 0)
+        return 0;
+
+    if (value < 0) {
+        pct = -value > 100 ? 100 : -value;
+        if (!n)
+            return (int64_t)pInfo->max_frequency * pct / 100;
+        return freqs[(pct * (n - 1) + 50) / 100];
+    }
+
+    if (!n)
+        return value;
+
+    for (i = 0; i < n && freqs[i] < value; i++)
+        ;
+    if (i == 0)
+        return freqs[0];
+    if (i == n)
+        return freqs[n - 1];
+
+    return value - freqs[i - 1] < freqs[i] - value ? freqs[i - 1] : freqs[i];
+}
+
+/*
+ * The thresholds in target_loads are left alone: the governor only compares
+ * them with the current frequency, so they need not be a table entry.
+ */
+static void resolve_profile_frequencies(power_profile *table)
+{
+    for (int i = 0; i < PROFILE_MAX; i++) {
+        power_profile *p = &table[i];
+
+        p->hispeed_freq = resolve_frequency(p->hispeed_freq);
+        p->hispeed_freq_off = resolve_frequency(p->hispeed_freq_off);
+        p->max_cpu_freq = resolve_frequency(p->max_cpu_freq);
+        p->min_cpu_freq = resolve_frequency(p->min_cpu_freq);
+        p->min_cpu_freq_off = resolve_frequency(p->min_cpu_freq_off);
+        p->interaction_boost_freq =
+                resolve_frequency(p->interaction_boost_freq);
+    }
+}
+
+/* Returns the string at offset in the pool, or NULL if it is not valid */
+static char *profile_file_string(const char *base,
+        const struct profile_file_header *hdr, uint32_t offset)
+{
+    const char *pool = base + hdr->strings_offset;
+    size_t len;
+
+    if (offset >= hdr->strings_size)
+        return NULL;
+
+    len = strnlen(pool + offset, hdr->strings_size - offset);
+    if (!len || len >= TARGET_LOADS_MAX)
+        return NULL;
+
+    return (char *)pool + offset;
+}
+
+/*
+ * Maps the compiled profile table at path and fills table from it. On
+ * success the strings in table point into *map, which the caller owns.
+ */
+static int load_profile_file(const char *path, power_profile *table,
+        void **map, size_t *map_size)
+{
+    const struct profile_file_header *hdr;
+    const struct profile_file_record *rec;
+    struct stat st;
+    char *base;
+    int fd;
+    int i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGW("%s: cannot open %s: %s", __func__, path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct profile_file_header)) {
+        ALOGE("%s: %s is truncated", __func__, path);
+        close(fd);
+        return -1;
+    }
+
+    base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        ALOGE("%s: cannot map %s: %s", __func__, path, strerror(errno));
+        return -1;
+    }
+
+    hdr = (const struct profile_file_header *)base;
+    if (hdr->magic != PROFILE_FILE_MAGIC ||
+        hdr->version != PROFILE_FILE_VERSION ||
+        hdr->profile_count != PROFILE_MAX ||
+        hdr->record_size != sizeof(struct profile_file_record) ||
+        hdr->strings_offset < sizeof(*hdr) + PROFILE_MAX * sizeof(*rec) ||
+        (uint64_t)hdr->strings_offset + hdr->strings_size >
+                (uint64_t)st.st_size) {
+        ALOGE("%s: %s is not a valid profile table", __func__, path);
+        goto err;
+    }
+
+    rec = (const struct profile_file_record *)(base + sizeof(*hdr));
+    for (i = 0; i < PROFILE_MAX; i++, rec++) {
+        power_profile *p = &table[i];
+
+        p->boostpulse_duration = rec->boostpulse_duration;
+        p->go_hispeed_load = rec->go_hispeed_load;
+        p->go_hispeed_load_off = rec->go_hispeed_load_off;
+        p->hispeed_freq = rec->hispeed_freq;
+        p->hispeed_freq_off = rec->hispeed_freq_off;
+        p->io_is_busy = rec->io_is_busy;
+        p->min_sample_time = rec->min_sample_time;
+        p->target_loads = profile_file_string(base, hdr, rec->target_loads);
+        p->target_loads_off = profile_file_string(base, hdr,
+                                                  rec->target_loads_off);
+        p->max_cpu_freq = rec->max_cpu_freq;
+        p->min_cpu_freq = rec->min_cpu_freq;
+        p->min_cpu_freq_off = rec->min_cpu_freq_off;
+        p->max_cpu_online = rec->max_cpu_online;
+        p->min_cpu_online = rec->min_cpu_online;
+        p->interaction_boost_ms = rec->interaction_boost_ms;
+        p->interaction_boost_freq = rec->interaction_boost_freq;
+        p->interaction_boost_cpus = rec->interaction_boost_cpus;
+
+        if (!p->target_loads || !p->target_loads_off) {
+            ALOGE("%s: %s: bad target_loads in profile %d", __func__, path, i);
+            goto err;
         }
+    }
 
-        if (count == pInfo->input_cnt)
-            break;
+    *map = base;
+    *map_size = st.st_size;
+    return 0;
+
+err:
+    munmap(base, st.st_size);
+    return -1;
+}
+
+/*
+ * Replaces profiles[] with the compiled table, keeping the current profiles
+ * if it cannot be loaded.
+ */
+static void load_power_profiles(void)
+{
+    power_profile table[PROFILE_MAX];
+    char path[PROPERTY_VALUE_MAX];
+    void *map, *old_map;
+    size_t map_size, old_map_size;
+
+    property_get("persist.power.profiles", path, PROFILE_FILE_DEFAULT);
+    if (load_profile_file(path, table, &map, &map_size)) {
+        ALOGW("Keeping current power profiles");
+        return;
     }
+
+    resolve_profile_frequencies(table);
+
+    hal_lock();
+    memcpy(profiles, table, sizeof(profiles));
+    old_map = profile_map;
+    old_map_size = profile_map_size;
+    profile_map = map;
+    profile_map_size = map_size;
+    hal_unlock();
+
+    if (old_map)
+        munmap(old_map, old_map_size);
+
+    ALOGI("Loaded power profiles from %s", path);
 }
 
 static int is_profile_valid(int profile)
@@ -111,75 +370,93 @@ static bool is_interactive(void)
     return false;
 }
 
-static int open_w(char *path, int *fd)
+static void governor_state_init(struct governor_state *gov)
 {
-    if (*fd < 0) {
-        *fd = open(path, O_WRONLY);
-    }
-
-    return *fd;
+    gov->boostpulse_duration = GOV_UNSET;
+    gov->go_hispeed_load = GOV_UNSET;
+    gov->hispeed_freq = GOV_UNSET;
+    gov->io_is_busy = GOV_UNSET;
+    gov->min_sample_time = GOV_UNSET;
+    gov->target_loads[0] = '\0';
 }
 
-static void boostpulse()
+static void apply_governor_int(const char *node, int value, int *shadow)
 {
-    char buf[BUF_SIZE];
-    int len;
-
-    pthread_mutex_lock(&lock);
-    if (open_w(INTERACTIVE_PATH "boostpulse",
-            &pInfo->boostpulse_fd) >= 0) {
-        snprintf(buf, sizeof(buf), "%d", 1);
+    char path[sizeof(INTERACTIVE_PATH) + MAX_CHARS];
 
-        len = write(pInfo->boostpulse_fd, &buf, sizeof(buf));
-        if (len < 0) {
-            strerror_r(errno, buf, sizeof(buf));
-            ALOGE("Error writing to boostpulse: %s\n", buf);
+    if (value == GOV_UNSET)
+        return;
 
-            close(pInfo->boostpulse_fd);
-            pInfo->boostpulse_fd = -1;
-        }
+    if (value == *shadow) {
+        pInfo->gov_writes_skipped++;
+        return;
     }
-    pthread_mutex_unlock(&lock);
+
+    snprintf(path, sizeof(path), INTERACTIVE_PATH "%s", node);
+    *shadow = sysfs_write_int(path, value) ? GOV_UNSET : value;
 }
 
-void power_init(struct power_module *module __unused)
+/*
+ * Writes the fields of gov that differ from what was last written to the
+ * interactive governor. Must be called with lock held.
+ */
+static void apply_governor_state(const struct governor_state *gov)
 {
-    char buf[BUF_SIZE];
-
-    if (!pInfo)
-        pInfo = (powerhal_info*)calloc(1, sizeof(powerhal_info));
-
-    pInfo->input_devs = input_devs;
-    pInfo->input_cnt = sizeof(input_devs)/sizeof(struct input_dev_map);
+    struct governor_state *cur = &pInfo->gov_state;
+
+    apply_governor_int("boostpulse_duration", gov->boostpulse_duration,
+                       &cur->boostpulse_duration);
+    apply_governor_int("go_hispeed_load", gov->go_hispeed_load,
+                       &cur->go_hispeed_load);
+    apply_governor_int("hispeed_freq", gov->hispeed_freq,
+                       &cur->hispeed_freq);
+    apply_governor_int("io_is_busy", gov->io_is_busy,
+                       &cur->io_is_busy);
+    apply_governor_int("min_sample_time", gov->min_sample_time,
+                       &cur->min_sample_time);
+
+    if (gov->target_loads[0]) {
+        if (!strcmp(gov->target_loads, cur->target_loads))
+            pInfo->gov_writes_skipped++;
+        else if (sysfs_write(INTERACTIVE_PATH "target_loads",
+                             gov->target_loads))
+            cur->target_loads[0] = '\0';
+        else
+            strlcpy(cur->target_loads, gov->target_loads,
+                    sizeof(cur->target_loads));
+    }
 
-    // Match input device ids to names
-    find_input_device_ids();
+    ALOGV("%s: %lu governor writes skipped so far", __func__,
+          pInfo->gov_writes_skipped);
+}
 
-    // Read maximum frequency
-    sysfs_read(CPUFREQ_CPU0_PATH "scaling_max_frequency", buf, BUF_SIZE);
-    pInfo->max_frequency = atoi(buf);
-    pInfo->is_overclocked = pInfo->max_frequency > MAX_FREQ_DEFAULT ? true : false;
+/*
+ * Re-arm the interaction hint slightly before the boost of the given profile
+ * runs out, so that the boost is held continuously during interaction.
+ */
+static void set_interaction_interval(int profile)
+{
+    uint64_t interval = (uint64_t)profiles[profile].interaction_boost_ms * 900;
 
-    // Store LP cluster max frequency
-    sysfs_read(CPUQUIET_PATH "idle_top_freq", buf, BUF_SIZE);
-    pInfo->lp_max_frequency = atoi(buf);
+    pInfo->hint_interval[POWER_HINT_INTERACTION] =
+            interval > pInfo->hint_window ? interval : pInfo->hint_window;
+}
 
-    pInfo->current_power_profile = PROFILE_BALANCED;
-    pInfo->boostpulse_fd = -1;
+static void boostpulse()
+{
+    hal_lock();
+    sysfs_write(INTERACTIVE_PATH "boostpulse", "1");
+    hal_unlock();
 }
 
 void power_set_interactive(struct power_module *module __unused, int on)
 {
-    int i;
-    int dev_id;
-    char path[80];
-
     if (!pInfo)
         return;
 
     ALOGI("%s: setting interactive: %d", __func__, on);
 
-    pthread_mutex_lock(&lock);
+    hal_lock();
 
     sysfs_write(CPUQUIET_PATH "no_lp", on ? "1" : "0");
     ALOGI("Setting low power cluster: %sabled", on ? "dis" : "en");
@@ -187,47 +464,38 @@ void power_set_interactive(struct power_module *module __unused, int on)
     sysfs_write(NVAVP_PATH "boost_sclk", on ? "1" : "0");
     ALOGI("Setting boost_sclk: %sabled", on ? "en" : "dis");
 
-    for (i = 0; i < pInfo->input_cnt; i++) {
-        if (pInfo->input_devs[i].dev_id == -1)
-            continue;
-        else
-            dev_id = pInfo->input_devs[i].dev_id;
-
-        snprintf(path, sizeof(path), INPUT_PATH "input%d/enabled", dev_id);
-        if (!access(path, W_OK)) {
-            ALOGI("%sabling input device: %d", on ? "En" : "Dis", dev_id);
-            sysfs_write(path, on ? "1" : "0");
+    if (pInfo->mInputWatcher)
+        pInfo->mInputWatcher->setEnabled(on);
+
+    if (is_interactive()) {
+        const power_profile *p = &profiles[pInfo->current_power_profile];
+        struct governor_state gov;
+
+        governor_state_init(&gov);
+        if (on) {
+            gov.hispeed_freq = p->hispeed_freq;
+            gov.go_hispeed_load = p->go_hispeed_load;
+            strlcpy(gov.target_loads, p->target_loads,
+                    sizeof(gov.target_loads));
+        } else {
+            gov.hispeed_freq = p->hispeed_freq_off;
+            gov.go_hispeed_load = p->go_hispeed_load_off;
+            strlcpy(gov.target_loads, p->target_loads_off,
+                    sizeof(gov.target_loads));
         }
-    }
-
-    if (!is_interactive())
-        return;
-
-    if (on) {
-        /* interactive */
-        sysfs_write_int(INTERACTIVE_PATH "hispeed_freq",
-                        pInfo->is_overclocked ?
-                        profiles[pInfo->current_power_profile].hispeed_freq_oc :
-                        profiles[pInfo->current_power_profile].hispeed_freq);
-        sysfs_write_int(INTERACTIVE_PATH "go_hispeed_load",
-                        profiles[pInfo->current_power_profile].go_hispeed_load);
-        sysfs_write(INTERACTIVE_PATH "target_loads",
-                        profiles[pInfo->current_power_profile].target_loads);
+        apply_governor_state(&gov);
     } else {
-        /* interactive */
-        sysfs_write_int(INTERACTIVE_PATH "hispeed_freq",
-                        profiles[pInfo->current_power_profile].hispeed_freq_off);
-        sysfs_write_int(INTERACTIVE_PATH "go_hispeed_load",
-                        profiles[pInfo->current_power_profile].go_hispeed_load_off);
-        sysfs_write(INTERACTIVE_PATH "target_loads",
-                        profiles[pInfo->current_power_profile].target_loads_off);
+        /* Tunables are reset when the governor is re-initialized */
+        governor_state_init(&pInfo->gov_state);
     }
 
-    pthread_mutex_unlock(&lock);
+    hal_unlock();
 }
 
 static void set_power_profile(int profile)
 {
+    struct governor_state gov;
+
     if (!is_profile_valid(profile)) {
         ALOGE("%s: unknown profile: %d", __func__, profile);
         return;
@@ -235,41 +503,104 @@ static void set_power_profile(int profile)
 
     ALOGI("%s: setting profile: %d", __func__, profile);
 
-    pthread_mutex_lock(&lock);
+    hal_lock();
+
+    gov.boostpulse_duration = profiles[profile].boostpulse_duration;
+    gov.go_hispeed_load = profiles[profile].go_hispeed_load;
+    gov.hispeed_freq = profiles[profile].hispeed_freq;
+    gov.io_is_busy = profiles[profile].io_is_busy;
+    gov.min_sample_time = profiles[profile].min_sample_time;
+    strlcpy(gov.target_loads, profiles[profile].target_loads,
+            sizeof(gov.target_loads));
 
     /* interactive */
-    sysfs_write_int(INTERACTIVE_PATH "boostpulse_duration",
-                    profiles[profile].boostpulse_duration);
-    sysfs_write_int(INTERACTIVE_PATH "go_hispeed_load",
-                    profiles[profile].go_hispeed_load);
-    sysfs_write_int(INTERACTIVE_PATH "hispeed_freq",
-                    pInfo->is_overclocked ?
-                    profiles[profile].hispeed_freq_oc :
-                    profiles[profile].hispeed_freq);
-    sysfs_write_int(INTERACTIVE_PATH "io_is_busy",
-                    profiles[profile].io_is_busy);
-    sysfs_write_int(INTERACTIVE_PATH "min_sample_time",
-                    profiles[profile].min_sample_time);
-    sysfs_write(INTERACTIVE_PATH "target_loads",
-                    profiles[profile].target_loads);
+    apply_governor_state(&gov);
 
     pInfo->current_power_profile = profile;
-    pthread_mutex_unlock(&lock);
+    set_interaction_interval(profile);
+    hal_unlock();
+
+    ALOGV("%s: %lu sysfs syscalls saved so far", __func__,
+          sysfs_get_stats().saved);
 }
 
-void power_hint(struct power_module *module __unused,
-        power_hint_t hint, void *data __unused)
+/* Returns true if the same hint was handled within its rate limit interval */
+static bool is_hint_recent(const struct hint_entry *entry)
 {
-    if (!pInfo)
+    uint64_t last = pInfo->hint_time[entry->hint];
+
+    return last && entry->time - last < pInfo->hint_interval[entry->hint];
+}
+
+static void interaction_boost(void)
+{
+    const power_profile *p = &profiles[pInfo->current_power_profile];
+    nsecs_t timeout = ms2ns(p->interaction_boost_ms);
+
+    if (!pInfo->mTimeoutPoker || p->interaction_boost_ms <= 0)
         return;
 
+    if (p->interaction_boost_freq > 0)
+        pInfo->mTimeoutPoker->requestPmQosTimed(CPU_FREQ_MIN_PATH,
+                                                p->interaction_boost_freq,
+                                                timeout);
+    if (p->interaction_boost_cpus > 1)
+        pInfo->mTimeoutPoker->requestPmQosTimed(MIN_ONLINE_CPUS_PATH,
+                                                p->interaction_boost_cpus,
+                                                timeout);
+}
+
+static int hint_stat_index(power_hint_t hint)
+{
+    switch ((int)hint) {
+    case POWER_HINT_INTERACTION:
+        return HINT_STAT_INTERACTION;
+    case POWER_HINT_LAUNCH:
+        return HINT_STAT_LAUNCH;
+    case POWER_HINT_SET_PROFILE:
+        return HINT_STAT_SET_PROFILE;
+    case POWER_HINT_RELOAD_PROFILES:
+        return HINT_STAT_RELOAD_PROFILES;
+    case POWER_HINT_DUMP_STATS:
+        return HINT_STAT_DUMP_STATS;
+    default:
+        return HINT_STAT_OTHER;
+    }
+}
+
+static void count_hint_handled(int index, uint64_t queued)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.hints_handled[index]++;
+    if (queued)
+        latency_hist_add(&stats.hint_delay, monotonic_us() - queued);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void count_hint_rate_limited(int index)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.hints_rate_limited[index]++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void handle_hint(const struct hint_entry *entry)
+{
+    int index = hint_stat_index(entry->hint);
+
     if (!is_interactive())
         return;
 
-    switch (hint) {
-    case POWER_HINT_LOW_POWER:
-        break;
+    if (is_hint_recent(entry)) {
+        count_hint_rate_limited(index);
+        return;
+    }
+    pInfo->hint_time[entry->hint] = entry->time;
+
+    switch (entry->hint) {
     case POWER_HINT_INTERACTION:
+        ALOGV("POWER_HINT_INTERACTION");
+        interaction_boost();
         break;
     case POWER_HINT_LAUNCH:
         ALOGV("POWER_HINT_LAUNCH");
@@ -277,14 +608,349 @@ void power_hint(struct power_module *module __unused,
             break;
         boostpulse();
         break;
+    default:
+        break;
+    }
+
+    count_hint_handled(index, entry->time);
+}
+
+static void dump_stats_file(void)
+{
+    char path[PROPERTY_VALUE_MAX];
+    int fd;
+
+    property_get("persist.power.stats_file", path, STATS_FILE_DEFAULT);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        ALOGE("%s: cannot open %s: %s", __func__, path, strerror(errno));
+        return;
+    }
+
+    powerhal_dump(fd);
+    close(fd);
+}
+
+static void *hint_worker(void *arg __unused)
+{
+    struct hint_entry batch[HINT_QUEUE_SIZE];
+    int profile;
+    int i, n;
+
+    while (1) {
+        if (sem_wait(&pInfo->hint_sem) < 0)
+            continue;
+
+        if (reload_requested.exchange(false)) {
+            load_power_profiles();
+            /* Re-apply the current profile unless a new one is pending */
+            if (requested_profile.load() < 0)
+                set_power_profile(pInfo->current_power_profile);
+            count_hint_handled(HINT_STAT_RELOAD_PROFILES, 0);
+        }
+
+        profile = requested_profile.exchange(-1);
+        if (profile >= 0) {
+            set_power_profile(profile);
+            count_hint_handled(HINT_STAT_SET_PROFILE, 0);
+        }
+
+        /* Collapse runs of the same hint into the most recent one */
+        n = 0;
+        while (n < HINT_QUEUE_SIZE && hint_queue.pop(&batch[n])) {
+            if (n && batch[n - 1].hint == batch[n].hint) {
+                batch[n - 1] = batch[n];
+                pthread_mutex_lock(&stats_lock);
+                stats.hints_coalesced++;
+                pthread_mutex_unlock(&stats_lock);
+            } else {
+                n++;
+            }
+        }
+
+        for (i = 0; i < n; i++)
+            handle_hint(&batch[i]);
+
+        if (dump_requested.exchange(false)) {
+            dump_stats_file();
+            count_hint_handled(HINT_STAT_DUMP_STATS, 0);
+        }
+
+        hints_completed++;
+    }
+
+    return NULL;
+}
+
+static void start_hint_worker(void)
+{
+    pthread_attr_t attr;
+    int err;
+
+    pInfo->hint_window = (uint64_t)property_get_int32("ro.power.hint_window_ms",
+            HINT_WINDOW_MS_DEFAULT) * 1000;
+    pInfo->hint_interval[POWER_HINT_LAUNCH] = pInfo->hint_window;
+    set_interaction_interval(pInfo->current_power_profile);
+
+    if (sem_init(&pInfo->hint_sem, 0, 0) < 0) {
+        ALOGE("%s: sem_init failed: %s", __func__, strerror(errno));
+        return;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&pInfo->hint_thread, &attr, hint_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        ALOGE("%s: pthread_create failed: %s", __func__, strerror(err));
+        sem_destroy(&pInfo->hint_sem);
+        return;
+    }
+    pthread_setname_np(pInfo->hint_thread, "powerhal-hints");
+
+    pInfo->hint_worker_running = true;
+}
+
+static uint64_t boottime_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Holds the boot boost until sys.boot_completed is set or the boost times
+ * out, whichever happens first.
+ */
+static void *boot_boost_worker(void *arg __unused)
+{
+    uint64_t start = monotonic_us();
+    uint64_t elapsed;
+    bool completed;
+
+    while (1) {
+        completed = get_property_bool("sys.boot_completed", false);
+        elapsed = (monotonic_us() - start) / 1000;
+        if (completed || elapsed >= (uint64_t)pInfo->boot_boost_ms)
+            break;
+        usleep(BOOT_BOOST_POLL_MS * 1000);
+    }
+
+    /* Interaction boosts with the same values hold requests of their own */
+    pInfo->mTimeoutPoker->releasePmQos(pInfo->boot_boost_freq_req);
+    pInfo->mTimeoutPoker->releasePmQos(pInfo->boot_boost_cpus_req);
+
+    ALOGI("Boot boost released %s after %llu ms (%llu ms since kernel start)",
+          completed ? "on boot completion" : "on timeout",
+          (unsigned long long)elapsed, (unsigned long long)boottime_ms());
+
+    return NULL;
+}
+
+static void start_boot_boost(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int err;
+
+    pInfo->boot_boost_ms = property_get_int32("ro.power.boot_boost_ms",
+                                              BOOT_BOOST_MS_DEFAULT);
+    pInfo->boot_boost_freq = pInfo->max_frequency;
+
+    if (pInfo->boot_boost_ms <= 0 || pInfo->boot_boost_freq <= 0 ||
+        get_property_bool("sys.boot_completed", false))
+        return;
+
+    // Boost to max frequency on initialization to decrease boot time
+    pInfo->mTimeoutPoker->requestPmQosTimed(CPU_FREQ_MIN_PATH,
+                                            pInfo->boot_boost_freq,
+                                            ms2ns(pInfo->boot_boost_ms),
+                                            &pInfo->boot_boost_freq_req);
+    pInfo->mTimeoutPoker->requestPmQosTimed(MIN_ONLINE_CPUS_PATH,
+                                            MAX_ONLINE_CPUS,
+                                            ms2ns(pInfo->boot_boost_ms),
+                                            &pInfo->boot_boost_cpus_req);
+    ALOGI("Boosting cpu_freq_min to %d for up to %d ms to make boot faster",
+          pInfo->boot_boost_freq, pInfo->boot_boost_ms);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, boot_boost_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (err)
+        ALOGE("%s: pthread_create failed: %s", __func__, strerror(err));
+    else
+        pthread_setname_np(thread, "powerhal-boot");
+}
+
+void power_init(struct power_module *module __unused)
+{
+    char buf[BUF_SIZE];
+
+    if (!pInfo)
+        pInfo = (powerhal_info*)calloc(1, sizeof(powerhal_info));
+
+    // Track input devices by name, including ones added later
+    if (!pInfo->mInputWatcher) {
+        pInfo->mInputWatcher = new InputWatcher(INPUT_PATH, input_dev_names,
+                sizeof(input_dev_names) / sizeof(input_dev_names[0]));
+        pInfo->mInputWatcher->start();
+    }
+
+    // Read maximum frequency and the frequency table
+    sysfs_read(CPUFREQ_CPU0_PATH "scaling_max_freq", buf, BUF_SIZE);
+    pInfo->max_frequency = atoi(buf);
+    read_available_frequencies();
+    if (pInfo->max_frequency <= 0 && pInfo->num_available_frequencies)
+        pInfo->max_frequency = pInfo->available_frequencies[
+                pInfo->num_available_frequencies - 1];
+
+    // Store LP cluster max frequency
+    sysfs_read(CPUQUIET_PATH "idle_top_freq", buf, BUF_SIZE);
+    pInfo->lp_max_frequency = atoi(buf);
+
+    pInfo->current_power_profile = PROFILE_BALANCED;
+    governor_state_init(&pInfo->gov_state);
+
+    // Snap the built-in profiles to the table, then replace them with the
+    // compiled table if present
+    hal_lock();
+    resolve_profile_frequencies(profiles);
+    hal_unlock();
+    load_power_profiles();
+
+    // Initialize timeout poker
+    if (!pInfo->mTimeoutPoker) {
+        Barrier readyToRun;
+        pInfo->mTimeoutPoker = new TimeoutPoker(&readyToRun);
+        readyToRun.wait();
+        start_boot_boost();
+    }
+
+    if (!pInfo->hint_worker_running)
+        start_hint_worker();
+}
+
+/*
+ * Hints are handed to the worker thread so that the calling binder thread
+ * never waits for sysfs or for lock.
+ */
+void power_hint(struct power_module *module __unused,
+        power_hint_t hint, void *data)
+{
+    struct hint_entry entry;
+    int32_t profile;
+
+    if (!pInfo || !pInfo->hint_worker_running)
+        return;
+
+    hints_received[hint_stat_index(hint)]++;
+
+    if (hint == POWER_HINT_RELOAD_PROFILES) {
+        reload_requested.store(true);
+        hints_posted++;
+        sem_post(&pInfo->hint_sem);
+        return;
+    }
+
+    if (hint == POWER_HINT_DUMP_STATS) {
+        dump_requested.store(true);
+        hints_posted++;
+        sem_post(&pInfo->hint_sem);
+        return;
+    }
+
+    switch (hint) {
+    case POWER_HINT_LOW_POWER:
+        return;
+    case POWER_HINT_INTERACTION:
+    case POWER_HINT_LAUNCH:
+        entry.hint = hint;
+        entry.time = monotonic_us();
+        if (!hint_queue.push(entry)) {
+            hints_dropped++;
+            return;
+        }
+        break;
     case POWER_HINT_SET_PROFILE:
-        ALOGV("POWER_HINT_SET_PROFILE: %d", (*(int32_t *)data));
-        set_power_profile(*(int32_t *)data);
+        profile = *(int32_t *)data;
+        ALOGV("POWER_HINT_SET_PROFILE: %d", profile);
+        if (!is_profile_valid(profile)) {
+            ALOGE("%s: unknown profile: %d", __func__, profile);
+            return;
+        }
+        requested_profile.store(profile);
         break;
     default:
         ALOGE("Unknown power hint: 0x%x", hint);
-        break;
+        return;
+    }
+
+    hints_posted++;
+    sem_post(&pInfo->hint_sem);
+}
+
+void powerhal_get_stats(struct powerhal_stats *out)
+{
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&lock);
+    out->lock_wait = stats.lock_wait;
+    out->lock_hold = stats.lock_hold;
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < HINT_STAT_MAX; i++)
+        out->hints_received[i] = hints_received[i].load();
+    out->hints_dropped = hints_dropped.load();
+    out->hints_posted = hints_posted.load();
+    out->hints_completed = hints_completed.load();
+}
+
+void powerhal_dump(int fd)
+{
+    struct powerhal_stats st;
+    struct sysfs_stats sst;
+    int i;
+
+    powerhal_get_stats(&st);
+    sst = sysfs_get_stats();
+
+    dprintf(fd, "Power HAL statistics\n");
+    if (pInfo)
+        dprintf(fd, "profile: %d, governor writes skipped: %lu\n",
+                pInfo->current_power_profile, pInfo->gov_writes_skipped);
+    if (pInfo && pInfo->num_available_frequencies) {
+        dprintf(fd, "frequencies:");
+        for (i = 0; i < pInfo->num_available_frequencies; i++)
+            dprintf(fd, " %d", pInfo->available_frequencies[i]);
+        dprintf(fd, "\n");
     }
+
+    dprintf(fd, "\n%-22s %10s %10s %12s\n", "hints", "received",
+            "handled", "rate limited");
+    for (i = 0; i < HINT_STAT_MAX; i++)
+        dprintf(fd, "  %-20s %10lu %10lu %12lu\n", hint_stat_names[i],
+                st.hints_received[i], st.hints_handled[i],
+                st.hints_rate_limited[i]);
+    dprintf(fd, "coalesced: %lu, dropped: %lu, worker wakeups: %lu/%lu\n",
+            st.hints_coalesced, st.hints_dropped, st.hints_completed,
+            st.hints_posted);
+    latency_hist_dump(fd, "hint delay", &st.hint_delay);
+
+    dprintf(fd, "\n");
+    latency_hist_dump(fd, "lock wait", &st.lock_wait);
+    latency_hist_dump(fd, "lock hold", &st.lock_hold);
+
+    dprintf(fd, "\nsysfs: open %lu, close %lu, read %lu, write %lu, "
+            "errors %lu, write errors %lu, saved by cache %lu\n",
+            sst.opens, sst.closes, sst.reads, sst.writes, sst.errors,
+            sst.write_errors, sst.saved);
+    latency_hist_dump(fd, "sysfs write", &sst.write_latency);
 }
 
 static void power_set_feature(struct power_module *module __unused,
@@ -22,8 +22,12 @@
 #include <hardware/power.h>
 
 #include "powerhal_utils.h"
+#include "inputwatcher.h"
+#include "timeoutpoker.h"
 
+#include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 struct input_dev_map {
@@ -31,10 +35,40 @@ struct input_dev_map {
     const char* dev_name;
 };
 
+#define MAX_POWER_HINT_COUNT (POWER_HINT_LAUNCH + 1)
+
+/* Private hint: reload profiles[] from the compiled profile table */
+#define POWER_HINT_RELOAD_PROFILES ((power_hint_t)0x00000200)
+/* Private hint: write powerhal_dump() output to persist.power.stats_file */
+#define POWER_HINT_DUMP_STATS ((power_hint_t)0x00000201)
+
+#define MAX_FREQS 32
+
+/*
+ * Interactive governor tunables as last written to sysfs.
+ *
+ * An int field of -1 or an empty target_loads string means "unknown" in the
+ * shadow copy and "leave untouched" in a requested state.
+ */
+#define GOV_UNSET -1
+#define TARGET_LOADS_MAX 128
+
+struct governor_state {
+    int boostpulse_duration;
+    int go_hispeed_load;
+    int hispeed_freq;
+    int io_is_busy;
+    int min_sample_time;
+    char target_loads[TARGET_LOADS_MAX];
+};
+
 struct powerhal_info {
     /* Maximum CPU frequency */
     int max_frequency;
-    bool is_overclocked;
+
+    /* scaling_available_frequencies in ascending order, read once */
+    int available_frequencies[MAX_FREQS];
+    int num_available_frequencies;
 
     /* Maximum LP CPU frequency */
     int lp_max_frequency;
@@ -45,11 +79,69 @@ struct powerhal_info {
     /* Holds input devices */
     struct input_dev_map* input_devs;
 
-    int boostpulse_fd;
+    /* Input devices toggled with the screen, tracked through uevents */
+    InputWatcher *mInputWatcher;
 
     int current_power_profile;
+
+    /* Shadow copy of the interactive governor tunables */
+    struct governor_state gov_state;
+
+    /* Governor writes avoided because the value was already set */
+    unsigned long gov_writes_skipped;
+
+    /* Hint worker thread, woken once per queued hint */
+    pthread_t hint_thread;
+    sem_t hint_sem;
+    bool hint_worker_running;
+
+    /* LAUNCH and INTERACTION hints closer than this (usec) are dropped */
+    uint64_t hint_window;
+    uint64_t hint_time[MAX_POWER_HINT_COUNT];
+    uint64_t hint_interval[MAX_POWER_HINT_COUNT];
+
+    /* Timed PM QoS requests for boot and interaction boosts */
+    TimeoutPoker *mTimeoutPoker;
+
+    /* Boot boost, released on sys.boot_completed or after boot_boost_ms */
+    int boot_boost_ms;
+    int boot_boost_freq;
+    int boot_boost_freq_req;
+    int boot_boost_cpus_req;
+};
+
+enum {
+    HINT_STAT_INTERACTION = 0,
+    HINT_STAT_LAUNCH,
+    HINT_STAT_SET_PROFILE,
+    HINT_STAT_RELOAD_PROFILES,
+    HINT_STAT_DUMP_STATS,
+    HINT_STAT_OTHER,
+    HINT_STAT_MAX
 };
 
+/* Counters kept by the HAL, read with powerhal_get_stats() */
+struct powerhal_stats {
+    /* lock */
+    struct latency_hist lock_wait;
+    struct latency_hist lock_hold;
+    /* hints, indexed by HINT_STAT_* */
+    unsigned long hints_received[HINT_STAT_MAX];
+    unsigned long hints_handled[HINT_STAT_MAX];
+    unsigned long hints_rate_limited[HINT_STAT_MAX];
+    unsigned long hints_coalesced;
+    unsigned long hints_dropped;
+    /* time from power_hint() until the worker handled the hint */
+    struct latency_hist hint_delay;
+    /* hint worker wakeups requested and completed */
+    unsigned long hints_posted;
+    unsigned long hints_completed;
+};
+
+void powerhal_get_stats(struct powerhal_stats *stats);
+/* Writes the counters above and the sysfs statistics to fd as text */
+void powerhal_dump(int fd);
+
 enum {
     PROFILE_POWER_SAVE = 0,
     PROFILE_BALANCED,
@@ -59,13 +151,21 @@ enum {
     PROFILE_MAX
 };
 
+/*
+ * Profile frequencies are in kHz and snapped to the nearest available
+ * frequency when the profiles are loaded. FREQ_PERCENTILE(p) selects the
+ * p-th percentile (1 to 100) of the frequency table instead, so the same
+ * profile picks matching steps on stock and overclocked kernels. A
+ * frequency of 0 means unset.
+ */
+#define FREQ_PERCENTILE(p) (-(p))
+
 typedef struct governor_settings {
     /* interactive */
     int boostpulse_duration;
     int go_hispeed_load;
     int go_hispeed_load_off;
     int hispeed_freq;
-    int hispeed_freq_oc;
     int hispeed_freq_off;
     int io_is_busy;
     int min_sample_time;
@@ -77,8 +177,16 @@ typedef struct governor_settings {
     int min_cpu_freq_off;
     int max_cpu_online;
     int min_cpu_online;
+    /* interaction boost */
+    int interaction_boost_ms;
+    int interaction_boost_freq;
+    int interaction_boost_cpus;
 } power_profile;
 
+/*
+ * Built-in profiles, replaced at power_init by the compiled table from
+ * power_profiles.conf when it is installed.
+ */
 static power_profile profiles[PROFILE_MAX] = {
     [PROFILE_POWER_SAVE] = {
         /* interactive */
@@ -86,7 +194,6 @@ static power_profile profiles[PROFILE_MAX] = {
         .go_hispeed_load =        95,
         .go_hispeed_load_off =    95,
         .hispeed_freq =           760000,
-        .hispeed_freq_oc =        760000,
         .hispeed_freq_off =       760000,
         .io_is_busy =             0,
         .min_sample_time =        60000,
@@ -98,82 +205,98 @@ static power_profile profiles[PROFILE_MAX] = {
         .min_cpu_freq_off =       51000,
         .max_cpu_online =         2,
         .min_cpu_online =         1,
+        /* interaction boost */
+        .interaction_boost_ms =   0,
+        .interaction_boost_freq = 0,
+        .interaction_boost_cpus = 1,
     },
     [PROFILE_BALANCED] = {
         /* interactive */
         .boostpulse_duration =    200000,
         .go_hispeed_load =        95,
         .go_hispeed_load_off =    95,
-        .hispeed_freq =           1000000,
-        .hispeed_freq_oc =        1200000,
+        .hispeed_freq =           FREQ_PERCENTILE(75),
         .hispeed_freq_off =       760000,
         .io_is_busy =             1,
         .min_sample_time =        40000,
         .target_loads =           "70 1200000:80 1300000:85 1400000:90",
         .target_loads_off =       "90 1200000:99",
         /* cpu */
-        .max_cpu_freq =           -1,
+        .max_cpu_freq =           FREQ_PERCENTILE(100),
         .min_cpu_freq =           51000,
         .min_cpu_freq_off =       51000,
         .max_cpu_online =         4,
         .min_cpu_online =         1,
+        /* interaction boost */
+        .interaction_boost_ms =   500,
+        .interaction_boost_freq = FREQ_PERCENTILE(75),
+        .interaction_boost_cpus = 2,
     },
     [PROFILE_HIGH_PERFORMANCE] = {
         /* interactive */
         .boostpulse_duration =    1000000,
         .go_hispeed_load =        75,
         .go_hispeed_load_off =    75,
-        .hispeed_freq =           1200000,
-        .hispeed_freq_oc =        1400000,
+        .hispeed_freq =           FREQ_PERCENTILE(90),
         .hispeed_freq_off =       1000000,
         .io_is_busy =             1,
         .min_sample_time =        40000,
         .target_loads =           "70",
         .target_loads_off =       "70",
         /* cpu */
-        .max_cpu_freq =           -1,
+        .max_cpu_freq =           FREQ_PERCENTILE(100),
         .min_cpu_freq =           1000000,
         .min_cpu_freq_off =       475000,
         .max_cpu_online =         4,
         .min_cpu_online =         4,
+        /* interaction boost */
+        .interaction_boost_ms =   1000,
+        .interaction_boost_freq = FREQ_PERCENTILE(100),
+        .interaction_boost_cpus = 4,
     },
     [PROFILE_BIAS_POWER_SAVE] = {
         /* interactive */
         .boostpulse_duration =    100000,
         .go_hispeed_load =        95,
         .go_hispeed_load_off =    95,
-        .hispeed_freq =           860000,
-        .hispeed_freq_oc =        1100000,
+        .hispeed_freq =           FREQ_PERCENTILE(67),
         .hispeed_freq_off =       640000,
         .io_is_busy =             1,
         .min_sample_time =        40000,
         .target_loads =           "70 1200000:85 1300000:90 1400000:95",
         .target_loads_off =       "95",
         /* cpu */
-        .max_cpu_freq =           -1,
+        .max_cpu_freq =           FREQ_PERCENTILE(100),
         .min_cpu_freq =           51000,
         .min_cpu_freq_off =       51000,
         .max_cpu_online =         4,
         .min_cpu_online =         1,
+        /* interaction boost */
+        .interaction_boost_ms =   200,
+        .interaction_boost_freq = FREQ_PERCENTILE(55),
+        .interaction_boost_cpus = 1,
     },
     [PROFILE_BIAS_PERFORMANCE] = {
         /* interactive */
         .boostpulse_duration =    500000,
         .go_hispeed_load =        90,
         .go_hispeed_load_off =    90,
-        .hispeed_freq =           1100000,
-        .hispeed_freq_oc =        1300000,
+        .hispeed_freq =           FREQ_PERCENTILE(83),
         .hispeed_freq_off =       860000,
         .io_is_busy =             1,
         .min_sample_time =        40000,
         .target_loads =           "70 1200000:75 1300000:80 1400000:90",
         .target_loads_off =       "90",
         /* cpu */
-        .max_cpu_freq =           -1,
+        .max_cpu_freq =           FREQ_PERCENTILE(100),
         .min_cpu_freq =           51000,
         .min_cpu_freq_off =       51000,
         .max_cpu_online =         4,
         .min_cpu_online =         2,
+        /* interaction boost */
+        .interaction_boost_ms =   500,
+        .interaction_boost_freq = FREQ_PERCENTILE(90),
+        .interaction_boost_cpus = 2,
     },
 };
 
@@ -18,44 +18,178 @@
 
 #include "powerhal_utils.h"
 
-void sysfs_write(const char *path, const char *s)
+/*
+ * Cached sysfs descriptors
+ *
+ * Nodes are opened lazily on first access and kept open afterwards; all
+ * subsequent accesses go through pread/pwrite at offset 0, which makes sysfs
+ * re-run the show/store handler exactly as a fresh open would. A descriptor
+ * is only dropped (and reopened on the next access) after an I/O error.
+ */
+#define SYSFS_FD_CACHE_SIZE 32
+
+struct sysfs_fd_entry {
+    unsigned int hash;
+    int flags;
+    int fd;
+    char *path;
+};
+
+static struct sysfs_fd_entry fd_cache[SYSFS_FD_CACHE_SIZE];
+static int fd_cache_cnt;
+static struct sysfs_stats fd_stats;
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int sysfs_path_hash(const char *path)
+{
+    unsigned int hash = 5381;
+
+    while (*path)
+        hash = hash * 33 + (unsigned char)*path++;
+
+    return hash;
+}
+
+/* Must be called with fd_cache_lock held */
+static struct sysfs_fd_entry *sysfs_fd_lookup(const char *path, int flags)
+{
+    struct sysfs_fd_entry *entry;
+    unsigned int hash = sysfs_path_hash(path);
+    int i;
+
+    for (i = 0; i < fd_cache_cnt; i++) {
+        entry = &fd_cache[i];
+        if (entry->hash == hash && entry->flags == flags &&
+            !strcmp(entry->path, path))
+            return entry;
+    }
+
+    if (fd_cache_cnt == SYSFS_FD_CACHE_SIZE)
+        return NULL;
+
+    entry = &fd_cache[fd_cache_cnt];
+    entry->path = strdup(path);
+    if (!entry->path)
+        return NULL;
+    entry->hash = hash;
+    entry->flags = flags;
+    entry->fd = -1;
+    fd_cache_cnt++;
+
+    return entry;
+}
+
+/*
+ * Returns an open descriptor for path, or -1 with errno set. *entry is set to
+ * the cache slot backing the descriptor, or NULL if the cache is full and the
+ * caller owns (and must close) the returned descriptor.
+ */
+static int sysfs_fd_get(const char *path, int flags,
+        struct sysfs_fd_entry **entry)
+{
+    int fd;
+
+    *entry = sysfs_fd_lookup(path, flags);
+    if (*entry && (*entry)->fd >= 0) {
+        /* One open() and one close() avoided */
+        fd_stats.saved += 2;
+        return (*entry)->fd;
+    }
+
+    fd_stats.opens++;
+    fd = open(path, flags);
+    if (fd < 0)
+        fd_stats.errors++;
+    if (*entry)
+        (*entry)->fd = fd;
+
+    return fd;
+}
+
+static void sysfs_fd_put(struct sysfs_fd_entry *entry, int fd, bool failed)
+{
+    if (entry && !failed)
+        return;
+
+    fd_stats.closes++;
+    close(fd);
+    if (entry)
+        entry->fd = -1;
+}
+
+int sysfs_write(const char *path, const char *s)
 {
     char buf[80];
-    int len;
-    int fd = open(path, O_WRONLY);
+    struct sysfs_fd_entry *entry;
+    uint64_t start = monotonic_us();
+    int len = -1;
+    int fd;
+
+    pthread_mutex_lock(&fd_cache_lock);
 
+    fd = sysfs_fd_get(path, O_WRONLY, &entry);
     if (fd < 0) {
         strerror_r(errno, buf, sizeof(buf));
         ALOGE("Error opening %s: %s\n", path, buf);
-        return;
+        goto out;
     }
 
-    len = write(fd, s, strlen(s));
+    fd_stats.writes++;
+    len = pwrite(fd, s, strlen(s), 0);
     if (len < 0) {
+        fd_stats.errors++;
         strerror_r(errno, buf, sizeof(buf));
         ALOGE("Error writing to %s: %s\n", path, buf);
     }
-    close(fd);
+    sysfs_fd_put(entry, fd, len < 0);
+
+out:
+    if (len < 0)
+        fd_stats.write_errors++;
+    latency_hist_add(&fd_stats.write_latency, monotonic_us() - start);
+
+    pthread_mutex_unlock(&fd_cache_lock);
+
+    return len < 0 ? -1 : 0;
 }
 
 void sysfs_read(const char *path, char *s, int size)
 {
+    struct sysfs_fd_entry *entry;
     int len;
-    int fd = open(path, O_RDONLY);
+    int fd;
 
+    pthread_mutex_lock(&fd_cache_lock);
+
+    fd = sysfs_fd_get(path, O_RDONLY, &entry);
     if (fd < 0) {
         strerror_r(errno, s, size);
         ALOGE("Error opening %s: %s\n", path, s);
+        pthread_mutex_unlock(&fd_cache_lock);
         return;
     }
 
-    len = read(fd, s, size);
-    close(fd);
-
+    fd_stats.reads++;
+    len = pread(fd, s, size, 0);
     if (len < 0) {
+        fd_stats.errors++;
         strerror_r(errno, s, size);
         ALOGE("Error reading from %s: %s\n", path, s);
     }
+    sysfs_fd_put(entry, fd, len < 0);
+
+    pthread_mutex_unlock(&fd_cache_lock);
+}
+
+struct sysfs_stats sysfs_get_stats(void)
+{
+    struct sysfs_stats stats;
+
+    pthread_mutex_lock(&fd_cache_lock);
+    stats = fd_stats;
+    pthread_mutex_unlock(&fd_cache_lock);
+
+    return stats;
 }
 
 bool sysfs_exists(const char *path)
@@ -69,6 +203,48 @@ bool sysfs_exists(const char *path)
     return val;
 }
 
+uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void latency_hist_add(struct latency_hist *hist, uint64_t us)
+{
+    int bucket = 0;
+
+    while (us >> bucket && bucket < LATENCY_HIST_BUCKETS - 1)
+        bucket++;
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->total_us += us;
+    if (us > hist->max_us)
+        hist->max_us = us;
+}
+
+void latency_hist_dump(int fd, const char *name,
+                       const struct latency_hist *hist)
+{
+    int i;
+
+    dprintf(fd, "%s: count %lu, avg %llu us, max %llu us\n", name,
+            hist->count,
+            (unsigned long long)(hist->count ? hist->total_us / hist->count : 0),
+            (unsigned long long)hist->max_us);
+
+    for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        if (!hist->buckets[i])
+            continue;
+        if (i == LATENCY_HIST_BUCKETS - 1)
+            dprintf(fd, "  >= %6u us: %lu\n", 1u << (i - 1), hist->buckets[i]);
+        else
+            dprintf(fd, "  <  %6u us: %lu\n", 1u << i, hist->buckets[i]);
+    }
+}
+
 bool get_property_bool(const char *key, bool default_value)
 {
     char value[PROPERTY_VALUE_MAX];
@@ -100,10 +276,10 @@ void set_property_int(const char *key, int value)
     }
 }
 
-void sysfs_write_int(const char *path, int value)
+int sysfs_write_int(const char *path, int value)
 {
     char val[PROPERTY_VALUE_MAX];
 
     snprintf(val, sizeof(val), "%d", value);
-    sysfs_write(path, val);
+    return sysfs_write(path, val);
 }
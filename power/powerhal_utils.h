@@ -19,21 +19,61 @@
 #define POWER_HAL_UTILS_H
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <utils/Log.h>
+#include <cutils/memory.h>
 #include <cutils/properties.h>
 
-/* sysfs utilities */
-void sysfs_write(const char *path, const char *s);
-void sysfs_write_int(const char *path, int value);
+/* sysfs utilities, writes return 0 on success and -1 on failure */
+int sysfs_write(const char *path, const char *s);
+int sysfs_write_int(const char *path, int value);
 void sysfs_read(const char *path, char *s, int size);
 bool sysfs_exists(const char *path);
+/*
+ * Latency histogram, bucket 0 counts samples below 1 usec and bucket i
+ * samples in [2^(i-1), 2^i) usec. The last bucket is open ended.
+ */
+#define LATENCY_HIST_BUCKETS 16
+
+struct latency_hist {
+    unsigned long count;
+    uint64_t total_us;
+    uint64_t max_us;
+    unsigned long buckets[LATENCY_HIST_BUCKETS];
+};
+
+void latency_hist_add(struct latency_hist *hist, uint64_t us);
+void latency_hist_dump(int fd, const char *name,
+                       const struct latency_hist *hist);
+
+/* Syscalls issued by the sysfs utilities */
+struct sysfs_stats {
+    unsigned long opens;
+    unsigned long closes;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long errors;
+    unsigned long write_errors;
+    /* open/close calls avoided by the descriptor cache */
+    unsigned long saved;
+    /* time spent in sysfs_write(), including a reopen */
+    struct latency_hist write_latency;
+};
+
+struct sysfs_stats sysfs_get_stats(void);
+
+/* Time utilities */
+uint64_t monotonic_us(void);
 
 /* Property utilities */
 bool get_property_bool(const char *key, bool default_value);
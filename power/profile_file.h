@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_HAL_PROFILE_FILE_H
+#define POWER_HAL_PROFILE_FILE_H
+
+#include <stdint.h>
+
+/*
+ * Compiled power profile table, as produced by power_profilec from
+ * power_profiles.conf and mmap()ed by the HAL.
+ *
+ * Layout: header, profile_count records of record_size bytes, then a pool
+ * of NUL-terminated strings. String fields hold offsets into the pool.
+ * All values are stored in host (little endian) byte order. Frequencies use
+ * the encoding of power_profile, negative values being percentiles.
+ */
+#define PROFILE_FILE_MAGIC      0x50525750 /* "PWRP" */
+#define PROFILE_FILE_VERSION    2
+#define PROFILE_FILE_DEFAULT    "/vendor/etc/power_profiles.bin"
+
+struct profile_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t profile_count;
+    uint32_t record_size;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+};
+
+struct profile_file_record {
+    /* interactive */
+    int32_t boostpulse_duration;
+    int32_t go_hispeed_load;
+    int32_t go_hispeed_load_off;
+    int32_t hispeed_freq;
+    int32_t hispeed_freq_off;
+    int32_t io_is_busy;
+    int32_t min_sample_time;
+    uint32_t target_loads;
+    uint32_t target_loads_off;
+    /* cpu */
+    int32_t max_cpu_freq;
+    int32_t min_cpu_freq;
+    int32_t min_cpu_freq_off;
+    int32_t max_cpu_online;
+    int32_t min_cpu_online;
+    /* interaction boost */
+    int32_t interaction_boost_ms;
+    int32_t interaction_boost_freq;
+    int32_t interaction_boost_cpus;
+};
+
+#endif // POWER_HAL_PROFILE_FILE_H
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * power_profilec: compiles power_profiles.conf into the binary table loaded
+ * by the power HAL.
+ *
+ * usage: power_profilec <input.conf> <output.bin>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile_file.h"
+
+/* In the same order as the PROFILE_* enum in powerhal.h */
+static const char *profile_names[] = {
+    "power_save",
+    "balanced",
+    "high_performance",
+    "bias_power_save",
+    "bias_performance",
+};
+
+#define PROFILE_COUNT (sizeof(profile_names) / sizeof(profile_names[0]))
+
+enum field_type {
+    FIELD_INT,
+    FIELD_FREQ,
+    FIELD_STRING,
+};
+
+struct field_desc {
+    const char *name;
+    size_t offset;
+    enum field_type type;
+};
+
+#define FIELD(f, t)     { #f, offsetof(struct profile_file_record, f), t }
+#define INT_FIELD(f)    FIELD(f, FIELD_INT)
+#define FREQ_FIELD(f)   FIELD(f, FIELD_FREQ)
+#define STR_FIELD(f)    FIELD(f, FIELD_STRING)
+
+static const struct field_desc fields[] = {
+    INT_FIELD(boostpulse_duration),
+    INT_FIELD(go_hispeed_load),
+    INT_FIELD(go_hispeed_load_off),
+    FREQ_FIELD(hispeed_freq),
+    FREQ_FIELD(hispeed_freq_off),
+    INT_FIELD(io_is_busy),
+    INT_FIELD(min_sample_time),
+    STR_FIELD(target_loads),
+    STR_FIELD(target_loads_off),
+    FREQ_FIELD(max_cpu_freq),
+    FREQ_FIELD(min_cpu_freq),
+    FREQ_FIELD(min_cpu_freq_off),
+    INT_FIELD(max_cpu_online),
+    INT_FIELD(min_cpu_online),
+    INT_FIELD(interaction_boost_ms),
+    FREQ_FIELD(interaction_boost_freq),
+    INT_FIELD(interaction_boost_cpus),
+};
+
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+
+/* Maximum length of a string value, matches TARGET_LOADS_MAX in the HAL */
+#define STRING_MAX 127
+
+static struct profile_file_record records[PROFILE_COUNT];
+static bool field_set[PROFILE_COUNT][FIELD_COUNT];
+static bool profile_seen[PROFILE_COUNT];
+
+static char *pool;
+static uint32_t pool_size;
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s))
+        s++;
+
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+/* Returns the pool offset of s, adding it if it is not there yet */
+static int pool_add(const char *s, uint32_t *offset)
+{
+    uint32_t len = strlen(s) + 1;
+    uint32_t pos = 0;
+    char *p;
+
+    while (pos < pool_size) {
+        if (!strcmp(pool + pos, s)) {
+            *offset = pos;
+            return 0;
+        }
+        pos += strlen(pool + pos) + 1;
+    }
+
+    p = (char *)realloc(pool, pool_size + len);
+    if (!p)
+        return -ENOMEM;
+
+    pool = p;
+    memcpy(pool + pool_size, s, len);
+    *offset = pool_size;
+    pool_size += len;
+
+    return 0;
+}
+
+/*
+ * A frequency is either a kHz value, 0 for unset, or "<p>%" for the p-th
+ * percentile of the frequency table, stored as -p.
+ */
+static int parse_freq(const char *value, long *freq)
+{
+    char *end;
+    long val;
+
+    errno = 0;
+    val = strtol(value, &end, 10);
+    if (errno || end == value)
+        return -1;
+
+    if (!strcmp(end, "%")) {
+        if (val < 1 || val > 100)
+            return -1;
+        *freq = -val;
+        return 0;
+    }
+
+    if (*end || val < 0 || val > INT32_MAX)
+        return -1;
+
+    *freq = val;
+    return 0;
+}
+
+static int set_field(const char *file, int line, int profile,
+        const char *key, const char *value)
+{
+    char *end;
+    long val;
+    uint32_t offset;
+    size_t i;
+
+    for (i = 0; i < FIELD_COUNT; i++) {
+        if (!strcmp(fields[i].name, key))
+            break;
+    }
+
+    if (i == FIELD_COUNT) {
+        fprintf(stderr, "%s:%d: unknown field '%s'\n", file, line, key);
+        return -1;
+    }
+
+    if (field_set[profile][i]) {
+        fprintf(stderr, "%s:%d: duplicate field '%s'\n", file, line, key);
+        return -1;
+    }
+
+    if (fields[i].type == FIELD_STRING) {
+        if (!*value || strlen(value) > STRING_MAX) {
+            fprintf(stderr, "%s:%d: '%s' must be 1 to %d characters\n",
+                    file, line, key, STRING_MAX);
+            return -1;
+        }
+        if (pool_add(value, &offset))
+            return -1;
+        *(uint32_t *)((char *)&records[profile] + fields[i].offset) = offset;
+    } else if (fields[i].type == FIELD_INT) {
+        errno = 0;
+        val = strtol(value, &end, 0);
+        if (errno || end == value || *end || val < INT32_MIN || val > INT32_MAX) {
+            fprintf(stderr, "%s:%d: bad integer '%s' for '%s'\n",
+                    file, line, value, key);
+            return -1;
+        }
+        *(int32_t *)((char *)&records[profile] + fields[i].offset) = val;
+    } else {
+        if (parse_freq(value, &val)) {
+            fprintf(stderr, "%s:%d: bad frequency '%s' for '%s'\n",
+                    file, line, value, key);
+            return -1;
+        }
+        *(int32_t *)((char *)&records[profile] + fields[i].offset) = val;
+    }
+
+    field_set[profile][i] = true;
+    return 0;
+}
+
+static int parse(const char *file)
+{
+    char buf[512];
+    char *s, *eq;
+    int profile = -1;
+    int line = 0;
+    size_t i;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        line++;
+        s = trim(buf);
+
+        if (!*s || *s == '#')
+            continue;
+
+        if (*s == '[') {
+            char *close = strchr(s, ']');
+
+            if (!close || close[1]) {
+                fprintf(stderr, "%s:%d: malformed section\n", file, line);
+                goto err;
+            }
+            *close = '\0';
+
+            for (i = 0; i < PROFILE_COUNT; i++) {
+                if (!strcmp(profile_names[i], s + 1))
+                    break;
+            }
+            if (i == PROFILE_COUNT || profile_seen[i]) {
+                fprintf(stderr, "%s:%d: unknown or duplicate profile '%s'\n",
+                        file, line, s + 1);
+                goto err;
+            }
+            profile = i;
+            profile_seen[i] = true;
+            continue;
+        }
+
+        eq = strchr(s, '=');
+        if (!eq || profile < 0) {
+            fprintf(stderr, "%s:%d: expected 'key = value' inside a profile\n",
+                    file, line);
+            goto err;
+        }
+        *eq = '\0';
+
+        if (set_field(file, line, profile, trim(s), trim(eq + 1)))
+            goto err;
+    }
+
+    fclose(fp);
+
+    for (i = 0; i < PROFILE_COUNT; i++) {
+        if (!profile_seen[i]) {
+            fprintf(stderr, "%s: missing profile '%s'\n", file,
+                    profile_names[i]);
+            return -1;
+        }
+        for (size_t j = 0; j < FIELD_COUNT; j++) {
+            if (!field_set[i][j]) {
+                fprintf(stderr, "%s: profile '%s' does not set '%s'\n", file,
+                        profile_names[i], fields[j].name);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+
+err:
+    fclose(fp);
+    return -1;
+}
+
+static int write_table(const char *file)
+{
+    struct profile_file_header hdr;
+    FILE *fp;
+
+    hdr.magic = PROFILE_FILE_MAGIC;
+    hdr.version = PROFILE_FILE_VERSION;
+    hdr.profile_count = PROFILE_COUNT;
+    hdr.record_size = sizeof(struct profile_file_record);
+    hdr.strings_offset = sizeof(hdr) + sizeof(records);
+    hdr.strings_size = pool_size;
+
+    fp = fopen(file, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(records, sizeof(records), 1, fp) != 1 ||
+        fwrite(pool, pool_size, 1, fp) != 1) {
+        fprintf(stderr, "%s: write failed\n", file);
+        fclose(fp);
+        return -1;
+    }
+
+    if (fclose(fp)) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input.conf> <output.bin>\n", argv[0]);
+        return 1;
+    }
+
+    if (parse(argv[1]) || write_table(argv[2])) {
+        remove(argv[2]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "PowerHAL"
+
+#include "powerhal_utils.h"
+#include "timeoutpoker.h"
+
+TimeoutPoker::TimeoutPoker(Barrier *readyToRun)
+    : mReadyToRun(readyToRun), mNextHandle(1), mExit(false)
+{
+    int err;
+
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        mRequests[i].node = NULL;
+        mRequests[i].fd = -1;
+        mRequests[i].handle = 0;
+    }
+
+    err = pthread_create(&mThread, NULL, threadLoop, this);
+    if (err) {
+        ALOGE("Error creating timeout poker thread: %s", strerror(err));
+        mReadyToRun->open();
+    }
+}
+
+TimeoutPoker::~TimeoutPoker()
+{
+    {
+        Mutex::Autolock _l(mLock);
+        mExit = true;
+        mCond.signal();
+    }
+    pthread_join(mThread, NULL);
+
+    for (int i = 0; i < MAX_REQUESTS; i++)
+        closeRequest(&mRequests[i]);
+}
+
+void *TimeoutPoker::threadLoop(void *arg)
+{
+    TimeoutPoker *poker = (TimeoutPoker *)arg;
+
+    pthread_setname_np(pthread_self(), "powerhal-pmqos");
+    poker->mReadyToRun->open();
+    poker->expireRequests();
+
+    return NULL;
+}
+
+void TimeoutPoker::closeRequest(Request *req)
+{
+    if (req->fd < 0)
+        return;
+
+    ALOGV("Releasing %s: %d", req->node, req->value);
+    close(req->fd);
+    req->fd = -1;
+    req->node = NULL;
+    req->handle = 0;
+}
+
+void TimeoutPoker::expireRequests()
+{
+    Mutex::Autolock _l(mLock);
+
+    while (!mExit) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t next = -1;
+
+        for (int i = 0; i < MAX_REQUESTS; i++) {
+            Request *req = &mRequests[i];
+
+            if (req->fd < 0)
+                continue;
+            if (req->deadline <= now)
+                closeRequest(req);
+            else if (next < 0 || req->deadline < next)
+                next = req->deadline;
+        }
+
+        if (next < 0)
+            mCond.wait(mLock);
+        else
+            mCond.waitRelative(mLock, next - now);
+    }
+}
+
+/*
+ * If handle is not NULL the request is not shared with an identical one and
+ * *handle is set to pass to releasePmQos().
+ */
+int TimeoutPoker::requestPmQosTimed(const char *node, int value,
+        nsecs_t timeout, int *handle)
+{
+    char buf[80];
+    int err;
+    Request *slot = NULL;
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + timeout;
+    Mutex::Autolock _l(mLock);
+
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        Request *req = &mRequests[i];
+
+        if (!handle && req->fd >= 0 && !req->handle && req->value == value &&
+            !strcmp(req->node, node)) {
+            if (req->deadline < deadline)
+                req->deadline = deadline;
+            return 0;
+        }
+        if (req->fd < 0 && !slot)
+            slot = req;
+    }
+
+    if (!slot) {
+        ALOGE("No free PM QoS request slot for %s", node);
+        return -ENOSPC;
+    }
+
+    slot->fd = open(node, O_RDWR);
+    if (slot->fd < 0) {
+        err = errno;
+        strerror_r(err, buf, sizeof(buf));
+        ALOGE("Error opening %s: %s\n", node, buf);
+        return -err;
+    }
+
+    if (write(slot->fd, &value, sizeof(value)) < 0) {
+        err = errno;
+        strerror_r(err, buf, sizeof(buf));
+        ALOGE("Error writing to %s: %s\n", node, buf);
+        close(slot->fd);
+        slot->fd = -1;
+        return -err;
+    }
+
+    slot->node = node;
+    slot->value = value;
+    slot->handle = 0;
+    slot->deadline = deadline;
+    if (handle) {
+        slot->handle = mNextHandle++;
+        *handle = slot->handle;
+    }
+    mCond.signal();
+
+    return 0;
+}
+
+/* Drops a request made with a handle before its deadline */
+void TimeoutPoker::releasePmQos(int handle)
+{
+    Mutex::Autolock _l(mLock);
+
+    if (handle <= 0)
+        return;
+
+    for (int i = 0; i < MAX_REQUESTS; i++) {
+        Request *req = &mRequests[i];
+
+        if (req->fd >= 0 && req->handle == handle)
+            closeRequest(req);
+    }
+}
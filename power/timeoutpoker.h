@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_HAL_TIMEOUT_POKER_H
+#define POWER_HAL_TIMEOUT_POKER_H
+
+#include <pthread.h>
+#include <utils/Timers.h>
+
+#include "barrier.h"
+
+/*
+ * Holds PM QoS requests (/dev/cpu_freq_min, /dev/min_online_cpus, ...) for a
+ * bounded amount of time.
+ *
+ * A request stays in effect while its descriptor is open, so every
+ * (node, value) pair gets its own descriptor and the kernel aggregates them.
+ * Repeating a request that is still active only pushes its deadline out.
+ * A request made with a handle gets a descriptor of its own instead, which
+ * only releasePmQos() with that handle closes early.
+ * A worker thread closes descriptors once their deadline has passed.
+ * Node names are not copied and must outlive the request.
+ */
+class TimeoutPoker
+{
+public:
+    TimeoutPoker(Barrier *readyToRun);
+    ~TimeoutPoker();
+
+    int requestPmQosTimed(const char *node, int value, nsecs_t timeout,
+                          int *handle = NULL);
+    void releasePmQos(int handle);
+
+private:
+    enum { MAX_REQUESTS = 8 };
+
+    struct Request {
+        const char *node;
+        int value;
+        int fd;
+        int handle; /* 0 for requests shared by (node, value) */
+        nsecs_t deadline;
+    };
+
+    static void *threadLoop(void *arg);
+    void expireRequests();
+    void closeRequest(Request *req);
+
+    Barrier *mReadyToRun;
+    Mutex mLock;
+    Condition mCond;
+    Request mRequests[MAX_REQUESTS];
+    int mNextHandle;
+    pthread_t mThread;
+    bool mExit;
+};
+
+#endif // POWER_HAL_TIMEOUT_POKER_H
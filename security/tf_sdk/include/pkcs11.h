@@ -185,6 +185,9 @@ typedef CK_ULONG          CK_ATTRIBUTE_TYPE;
 
 #define CKA_MODIFIABLE         0x00000170
 #define CKA_COPYABLE           0x00000171
+
+#define CKA_EC_PARAMS          0x00000180
+#define CKA_EC_POINT           0x00000181
 #define CKA_ALWAYS_AUTHENTICATE  0x00000202
 
 #define CKA_VENDOR_DEFINED     0x80000000
@@ -246,6 +249,8 @@ typedef CK_ULONG          CK_MECHANISM_TYPE, *CK_MECHANISM_TYPE_PTR;
 #define CKM_SHA512                     0x00000270
 #define CKM_SHA512_HMAC                0x00000271
 #define CKM_GENERIC_SECRET_KEY_GEN     0x00000350
+#define CKM_EC_KEY_PAIR_GEN            0x00001040
+#define CKM_ECDSA                      0x00001041
 #define CKM_AES_KEY_GEN                0x00001080
 #define CKM_AES_ECB                    0x00001081
 #define CKM_AES_CBC                    0x00001082